@@ -0,0 +1,641 @@
+/* ################################################################## */
+/* Deduplicating store of a log. The store begins with                */
+/* PTYLIE_STORE_MAGIC followed by records:                            */
+/* - 'c' len data: a new chunk, numbered from 0 in order,             */
+/* - 'r' n: a repetition of the chunk number n,                       */
+/* - 'R' n m: a repetition of the m chunks numbered from n,           */
+/* where len, n and m are unsigned LEB128 varints. The log is cut     */
+/* where a gear rolling hash of its last 32 bytes has 5 bits null, so */
+/* that an identical content gives identical chunks wherever it is in */
+/* the log, and a screen redrawn identically gives a single 'R'.      */
+/* ################################################################## */
+
+#define _XOPEN_SOURCE 700
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "cdc.h"
+#include "ptylie.h"
+
+typedef struct cdc_entry_s cdc_entry_t;
+
+typedef struct cdc_io_s cdc_io_t;
+
+/* ---------- */
+/* Prototypes */
+/* ---------- */
+
+static void
+cdc_init_gear(void);
+
+static uint64_t
+cdc_hash(const unsigned char * p, size_t len);
+
+static int
+cdc_write_all(int fd, const unsigned char * p, size_t len);
+
+static int
+cdc_flush(cdc_t * cdc);
+
+static void
+cdc_put_varint(cdc_t * cdc, unsigned long long v);
+
+static int
+cdc_same(cdc_t * cdc, off_t off, const unsigned char * p, size_t len);
+
+static int
+cdc_grow(cdc_t * cdc);
+
+static void
+cdc_evict(cdc_t * cdc);
+
+static int
+cdc_run_end(cdc_t * cdc);
+
+static int
+cdc_chunk(cdc_t * cdc, const unsigned char * p, size_t len);
+
+static int
+cdc_get(cdc_io_t * io);
+
+static int
+cdc_get_varint(cdc_io_t * io, unsigned long long * v);
+
+static int
+cdc_put(cdc_io_t * io, const unsigned char * p, size_t len);
+
+/* ----------- */
+/* Definitions */
+/* ----------- */
+
+#define CDC_MIN 16                     /* bounds of the chunk sizes     */
+#define CDC_MAX 4096                   /*                               */
+#define CDC_MASK 0x00000000f8000000ULL /* bits set by the last 32 bytes */
+#define CDC_BUF 65536                  /* write and read buffers        */
+#define CDC_TABLE_MAX 131072           /* chunks kept in the table      */
+
+/* A distinct chunk, found by its hash in an open addressing table */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct cdc_entry_s
+{
+  uint64_t hash;
+  off_t    off; /* offset of its data in the store */
+  unsigned len; /* 0 for a free entry              */
+  unsigned id;  /*                                 */
+  int      ref; /* used since the last cdc_evict   */
+};
+
+struct cdc_s
+{
+  int           fd;
+  unsigned char pend[CDC_MAX]; /* chunk being cut                  */
+  size_t        pend_len;      /*                                  */
+  uint64_t      h;             /* rolling hash of the log          */
+  unsigned char out[CDC_BUF];  /* records not yet written          */
+  size_t        out_len;       /*                                  */
+  off_t         off;           /* bytes written to the store       */
+  cdc_entry_t * table;         /* distinct chunks                  */
+  size_t        size;          /* entries of the table, power of 2 */
+  size_t        nb;            /* entries in use                   */
+  size_t        hand;          /* next entry looked at (cdc_evict) */
+  unsigned      run_id;        /* pending references: run_len      */
+  unsigned      run_len;       /* chunks from the number run_id    */
+  cdc_stats_t   stats;
+};
+
+/* Buffered reading of a store and writing of its log (cdc_unpack) */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct cdc_io_s
+{
+  int           fd_in;
+  int           fd_out;
+  unsigned char in[CDC_BUF];
+  size_t        pos;  /* bytes of in used          */
+  size_t        len;  /* bytes of in read          */
+  off_t         base; /* offset of in in the store */
+  unsigned char out[CDC_BUF];
+  size_t        out_len;
+};
+
+static uint64_t       gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/* ================================================================ */
+/* Fills the table of the rolling hash with fixed pseudo random     */
+/* values (splitmix64), the cuts must not change between versions.  */
+/* ================================================================ */
+static void
+cdc_init_gear(void)
+{
+  uint64_t x = 0, z;
+  int      i;
+
+  for (i = 0; i < 256; i++)
+  {
+    z       = (x += 0x9e3779b97f4a7c15ULL);
+    z       = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z       = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    gear[i] = z ^ (z >> 31);
+  }
+}
+
+/* ================================================================ */
+/* FNV-1a hash identifying a chunk.                                 */
+/* ================================================================ */
+static uint64_t
+cdc_hash(const unsigned char * p, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  while (len-- > 0)
+    h = (h ^ *p++) * 0x100000001b3ULL;
+
+  return h;
+}
+
+/* ================================================================ */
+/* Creates a store writing to fd, which must be open for reading    */
+/* and writing: the chunks found again are compared with their      */
+/* first copy. Returns NULL on failure.                             */
+/* ================================================================ */
+cdc_t *
+cdc_new(int fd)
+{
+  cdc_t * cdc;
+
+  pthread_once(&gear_once, cdc_init_gear);
+
+  if ((cdc = calloc(1, sizeof *cdc)) == NULL)
+    return NULL;
+
+  cdc->fd   = fd;
+  cdc->size = 1024;
+  if ((cdc->table = calloc(cdc->size, sizeof *cdc->table)) == NULL)
+  {
+    free(cdc);
+    return NULL;
+  }
+
+  memcpy(cdc->out, PTYLIE_STORE_MAGIC, PTYLIE_STORE_MAGIC_SIZE);
+  cdc->out_len = PTYLIE_STORE_MAGIC_SIZE;
+
+  return cdc;
+}
+
+/* ================================================================ */
+/* Writes len bytes to fd. Returns 0 or -1 (errno).                 */
+/* ================================================================ */
+static int
+cdc_write_all(int fd, const unsigned char * p, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0)
+  {
+    if ((n = write(fd, p, len)) == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+/* ================================================================ */
+/* Writes the pending records. Returns 0 or -1 (errno).             */
+/* ================================================================ */
+static int
+cdc_flush(cdc_t * cdc)
+{
+  if (cdc_write_all(cdc->fd, cdc->out, cdc->out_len) == -1)
+    return -1;
+
+  cdc->off += cdc->out_len;
+  cdc->stats.bytes_out += cdc->out_len;
+  cdc->out_len = 0;
+
+  return 0;
+}
+
+static void
+cdc_put_varint(cdc_t * cdc, unsigned long long v)
+{
+  while (v >= 0x80)
+  {
+    cdc->out[cdc->out_len++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  cdc->out[cdc->out_len++] = (unsigned char)v;
+}
+
+/* ================================================================ */
+/* Returns 1 if the data of the chunk stored at off, in the file or */
+/* still in the buffer, are the len bytes at p.                     */
+/* ================================================================ */
+static int
+cdc_same(cdc_t * cdc, off_t off, const unsigned char * p, size_t len)
+{
+  unsigned char buf[CDC_MAX];
+
+  if (off >= cdc->off)
+    return memcmp(cdc->out + (off - cdc->off), p, len) == 0;
+
+  return pread(cdc->fd, buf, len, off) == (ssize_t)len
+         && memcmp(buf, p, len) == 0;
+}
+
+/* ================================================================ */
+/* Doubles the size of the table of the distinct chunks.            */
+/* ================================================================ */
+static int
+cdc_grow(cdc_t * cdc)
+{
+  cdc_entry_t * table;
+  size_t        size = cdc->size * 2, i, j;
+
+  if ((table = calloc(size, sizeof *table)) == NULL)
+    return -1;
+
+  for (i = 0; i < cdc->size; i++)
+    if (cdc->table[i].len != 0)
+    {
+      j = cdc->table[i].hash & (size - 1);
+      while (table[j].len != 0)
+        j = (j + 1) & (size - 1);
+      table[j] = cdc->table[i];
+    }
+
+  free(cdc->table);
+  cdc->table = table;
+  cdc->size  = size;
+
+  return 0;
+}
+
+/* ================================================================ */
+/* Removes from the full table a chunk not used recently (second    */
+/* chance algorithm): the entries used since the previous pass of   */
+/* the hand are spared once. The chunk stays in the store but will  */
+/* be stored again in full if it comes back.                        */
+/* ================================================================ */
+static void
+cdc_evict(cdc_t * cdc)
+{
+  cdc_entry_t * t    = cdc->table;
+  size_t        mask = cdc->size - 1, i, j, k;
+
+  for (i = cdc->hand; t[i].len == 0 || t[i].ref; i = (i + 1) & mask)
+    t[i].ref = 0;
+  cdc->hand = (i + 1) & mask;
+
+  /* The following entries of the probe sequence are moved back so */
+  /* that the lookups never stop on the hole left.                 */
+  /* ''''''''''''''''''''''''''''''''''''''''''''''''''''''''''''' */
+  for (j = (i + 1) & mask; t[j].len != 0; j = (j + 1) & mask)
+  {
+    k = t[j].hash & mask;
+    if (i <= j ? i < k && k <= j : i < k || k <= j)
+      continue;
+    t[i] = t[j];
+    i    = j;
+  }
+
+  t[i].len = 0;
+  cdc->nb--;
+}
+
+/* ================================================================ */
+/* Writes the record of the pending references.                     */
+/* ================================================================ */
+static int
+cdc_run_end(cdc_t * cdc)
+{
+  if (cdc->run_len == 0)
+    return 0;
+
+  if (cdc->out_len + 1 + 10 + 10 > CDC_BUF && cdc_flush(cdc) == -1)
+    return -1;
+
+  cdc->out[cdc->out_len++] = cdc->run_len > 1 ? 'R' : 'r';
+  cdc_put_varint(cdc, cdc->run_id);
+  if (cdc->run_len > 1)
+    cdc_put_varint(cdc, cdc->run_len);
+  cdc->run_len = 0;
+
+  return 0;
+}
+
+/* ================================================================ */
+/* Stores a chunk cut from the log: a reference if the same chunk   */
+/* is already in the store, the chunk otherwise. The references to  */
+/* consecutive chunks are grouped. At most CDC_TABLE_MAX chunks are */
+/* kept in the table to bound the memory of long sessions.          */
+/* ================================================================ */
+static int
+cdc_chunk(cdc_t * cdc, const unsigned char * p, size_t len)
+{
+  uint64_t      hash = cdc_hash(p, len);
+  size_t        i    = hash & (cdc->size - 1);
+  cdc_entry_t * e;
+
+  cdc->stats.chunks++;
+
+  for (; (e = &cdc->table[i])->len != 0; i = (i + 1) & (cdc->size - 1))
+    if (e->hash == hash && e->len == len && cdc_same(cdc, e->off, p, len))
+    {
+      e->ref = 1;
+
+      if (cdc->run_len > 0 && e->id == cdc->run_id + cdc->run_len)
+      {
+        cdc->run_len++;
+        return 0;
+      }
+
+      if (cdc_run_end(cdc) == -1)
+        return -1;
+      cdc->run_id  = e->id;
+      cdc->run_len = 1;
+      return 0;
+    }
+
+  /* Room for a record: a tag, a varint and the data */
+  /* ''''''''''''''''''''''''''''''''''''''''''''''' */
+  if (cdc_run_end(cdc) == -1
+      || (cdc->out_len + 1 + 10 + len > CDC_BUF && cdc_flush(cdc) == -1))
+    return -1;
+
+  cdc->out[cdc->out_len++] = 'c';
+  cdc_put_varint(cdc, len);
+
+  /* The eviction may have moved the free entry found */
+  /* '''''''''''''''''''''''''''''''''''''''''''''''' */
+  if (cdc->nb == CDC_TABLE_MAX)
+  {
+    cdc_evict(cdc);
+    for (i = hash & (cdc->size - 1); cdc->table[i].len != 0;
+         i = (i + 1) & (cdc->size - 1))
+      ;
+    e = &cdc->table[i];
+  }
+
+  e->hash = hash;
+  e->off  = cdc->off + cdc->out_len;
+  e->len  = len;
+  e->id   = cdc->stats.unique++;
+  e->ref  = 1;
+  cdc->nb++;
+
+  memcpy(cdc->out + cdc->out_len, p, len);
+  cdc->out_len += len;
+
+  if (cdc->nb * 2 > cdc->size && cdc->nb < CDC_TABLE_MAX)
+    return cdc_grow(cdc);
+
+  return 0;
+}
+
+/* ================================================================ */
+/* Adds len bytes to the log. The records of the chunks cut are     */
+/* written to the store by blocks of CDC_BUF bytes, the end of the  */
+/* last chunk is kept until more bytes or cdc_free.                 */
+/* Returns 0 or -1 (errno).                                         */
+/* ================================================================ */
+int
+cdc_write(cdc_t * cdc, const void * buf, size_t len)
+{
+  const unsigned char * p   = buf;
+  const unsigned char * end = p + len;
+  uint64_t              h   = cdc->h;
+  size_t                n   = cdc->pend_len;
+
+  cdc->stats.bytes_in += len;
+
+  while (p < end)
+  {
+    cdc->pend[n++] = *p;
+    h              = (h << 1) + gear[*p++];
+
+    if ((n >= CDC_MIN && (h & CDC_MASK) == 0) || n == CDC_MAX)
+    {
+      if (cdc_chunk(cdc, cdc->pend, n) == -1)
+        return -1;
+      n = 0;
+    }
+  }
+
+  cdc->h        = h;
+  cdc->pend_len = n;
+
+  return 0;
+}
+
+void
+cdc_stats(cdc_t * cdc, cdc_stats_t * stats)
+{
+  *stats = cdc->stats;
+  stats->bytes_out += cdc->out_len;
+}
+
+/* ================================================================ */
+/* Stores the end of the log and frees the store, its file is not   */
+/* closed. Returns 0 or -1 (errno).                                 */
+/* ================================================================ */
+int
+cdc_free(cdc_t * cdc)
+{
+  int rc = 0;
+
+  if (cdc->pend_len > 0)
+    rc = cdc_chunk(cdc, cdc->pend, cdc->pend_len);
+  if (rc == 0 && (rc = cdc_run_end(cdc)) == 0)
+    rc = cdc_flush(cdc);
+
+  free(cdc->table);
+  free(cdc);
+
+  return rc;
+}
+
+/* ================================================================ */
+/* Returns the next byte of the store, -1 at its end or -2 on error */
+/* ================================================================ */
+static int
+cdc_get(cdc_io_t * io)
+{
+  ssize_t n;
+
+  if (io->pos == io->len)
+  {
+    while ((n = read(io->fd_in, io->in, CDC_BUF)) == -1 && errno == EINTR)
+      ;
+    if (n <= 0)
+      return n == 0 ? -1 : -2;
+    io->base += io->len;
+    io->pos = 0;
+    io->len = n;
+  }
+
+  return io->in[io->pos++];
+}
+
+/* ================================================================ */
+/* Reads a varint of the store in *v. Returns 0, -1 on error or -2  */
+/* if the store is truncated or invalid.                            */
+/* ================================================================ */
+static int
+cdc_get_varint(cdc_io_t * io, unsigned long long * v)
+{
+  int c, shift = 0;
+
+  *v = 0;
+  do
+  {
+    if ((c = cdc_get(io)) < 0)
+      return c == -2 ? -1 : -2;
+    if (shift > 56)
+      return -2;
+    *v |= (unsigned long long)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+
+  return 0;
+}
+
+/* ================================================================ */
+/* Appends len bytes to the log being rebuilt. Returns 0 or -1.     */
+/* ================================================================ */
+static int
+cdc_put(cdc_io_t * io, const unsigned char * p, size_t len)
+{
+  if (io->out_len + len > CDC_BUF)
+  {
+    if (cdc_write_all(io->fd_out, io->out, io->out_len) == -1)
+      return -1;
+    io->out_len = 0;
+  }
+
+  memcpy(io->out + io->out_len, p, len);
+  io->out_len += len;
+
+  return 0;
+}
+
+/* ================================================================ */
+/* Writes to fd_out the log stored in fd_in. The data of the chunks */
+/* repeated are read again in fd_in, which must be a regular file.  */
+/* Returns 0, -1 on a system error (errno) or -2 if fd_in is not a  */
+/* valid store.                                                     */
+/* ================================================================ */
+int
+cdc_unpack(int fd_in, int fd_out)
+{
+  cdc_io_t *         io     = calloc(1, sizeof *io);
+  cdc_entry_t *      chunks = NULL, *e;
+  unsigned char      chunk[CDC_MAX];
+  size_t             nb = 0, max = 0, n, i;
+  unsigned long long v, m = 1;
+  int                c, rc;
+
+  if (io == NULL)
+    return -1;
+
+  io->fd_in  = fd_in;
+  io->fd_out = fd_out;
+
+  for (i = 0; i < PTYLIE_STORE_MAGIC_SIZE; i++)
+    if ((c = cdc_get(io)) != (unsigned char)PTYLIE_STORE_MAGIC[i])
+    {
+      free(io);
+      return c == -2 ? -1 : -2;
+    }
+
+  while ((c = cdc_get(io)) >= 0)
+  {
+    if ((rc = cdc_get_varint(io, &v)) != 0)
+      goto end;
+    rc = -2;
+
+    if (c == 'c')
+    {
+      /* New chunk, kept as its place in the store */
+      /* ''''''''''''''''''''''''''''''''''''''''' */
+      if (v == 0 || v > CDC_MAX)
+        goto end;
+
+      if (nb == max)
+      {
+        max = max > 0 ? max * 2 : 1024;
+        if ((e = realloc(chunks, max * sizeof *chunks)) == NULL)
+        {
+          rc = -1;
+          goto end;
+        }
+        chunks = e;
+      }
+
+      e      = &chunks[nb++];
+      e->off = io->base + io->pos;
+      e->len = v;
+
+      while (v > 0)
+      {
+        if (io->pos == io->len)
+        {
+          if ((c = cdc_get(io)) < 0)
+          {
+            rc = c == -2 ? -1 : -2;
+            goto end;
+          }
+          io->pos--;
+        }
+
+        n = io->len - io->pos < v ? io->len - io->pos : v;
+        if (cdc_put(io, io->in + io->pos, n) == -1)
+        {
+          rc = -1;
+          goto end;
+        }
+        io->pos += n;
+        v -= n;
+      }
+    }
+    else if (c == 'r' || c == 'R')
+    {
+      /* Repeated chunks, read again */
+      /* ''''''''''''''''''''''''''' */
+      if (c == 'R' && (rc = cdc_get_varint(io, &m)) != 0)
+        goto end;
+      rc = -2;
+      if (v >= nb || m > nb - v)
+        goto end;
+
+      for (e = &chunks[v]; m > 0; m--, e++)
+        if (pread(fd_in, chunk, e->len, e->off) != (ssize_t)e->len
+            || cdc_put(io, chunk, e->len) == -1)
+        {
+          rc = -1;
+          goto end;
+        }
+      m = 1;
+    }
+    else
+      goto end;
+  }
+
+  rc = c == -2 ? -1 : cdc_write_all(fd_out, io->out, io->out_len);
+
+end:
+  free(chunks);
+  free(io);
+
+  return rc;
+}
@@ -0,0 +1,41 @@
+/* ################################################################### */
+/* Deduplicating store of a log: the output is cut in content defined */
+/* chunks by a rolling hash, each distinct chunk is stored once and    */
+/* the repeated ones are replaced by their number.                     */
+/* ################################################################### */
+
+#ifndef CDC_H
+#define CDC_H
+
+#include <stddef.h>
+
+typedef struct cdc_s cdc_t;
+
+typedef struct cdc_stats_s cdc_stats_t;
+
+/* Counters of a store, for the statistics */
+/* """"""""""""""""""""""""""""""""""""""" */
+struct cdc_stats_s
+{
+  unsigned long long bytes_in;  /* bytes of the log              */
+  unsigned long long bytes_out; /* bytes of the store            */
+  unsigned long      chunks;    /* chunks of the log             */
+  unsigned long      unique;    /* chunks stored with their data */
+};
+
+cdc_t *
+cdc_new(int fd);
+
+int
+cdc_write(cdc_t * cdc, const void * buf, size_t len);
+
+void
+cdc_stats(cdc_t * cdc, cdc_stats_t * stats);
+
+int
+cdc_free(cdc_t * cdc);
+
+int
+cdc_unpack(int fd_in, int fd_out);
+
+#endif
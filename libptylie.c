@@ -0,0 +1,5265 @@
+#define _XOPEN_SOURCE 700
+#include "config.h"
+/* For POSIX_SPAWN_SETSID and close_range */
+#if HAVE_DECL_POSIX_SPAWN_SETSID || HAVE_DECL_CLOSE_RANGE
+#define _GNU_SOURCE
+#endif
+#if HAVE_DECL_POSIX_SPAWN_SETSID
+#include <spawn.h>
+#endif
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <poll.h>
+/* For FIONREAD */
+#if defined(__sun)
+#include <sys/filio.h>
+#endif
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+/* For pidfd_open */
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#include <termios.h>
+#include <term.h>
+#include <unistd.h>
+
+#include "tree.h"
+#include "vt.h"
+#include "cdc.h"
+#include "ring.h"
+#include "ptylie.h"
+
+#ifndef TIOCPKT_DATA
+#define TIOCPKT_DATA 0
+#endif
+
+typedef struct stk_s stk_t;
+
+typedef struct map_elem_s map_elem_t;
+
+typedef struct pool_entry_s pool_entry_t;
+
+typedef struct out_stats_s out_stats_t;
+
+typedef struct inj_stats_s inj_stats_t;
+
+typedef struct trace_ev_s trace_ev_t;
+
+typedef struct trace_buf_s trace_buf_t;
+
+typedef struct lat_key_s lat_key_t;
+
+typedef struct mark_s mark_t;
+
+typedef struct sample_s sample_t;
+
+typedef struct log_dest_s log_dest_t;
+
+typedef struct dump_s dump_t;
+
+typedef struct target_s target_t;
+
+/* ---------- */
+/* Prototypes */
+/* ---------- */
+
+static void
+stk_init(stk_t * stack);
+
+static int
+stk_push(stk_t * stack, int fd);
+
+static int
+stk_pop(stk_t * stack);
+
+static void
+tv_norm(struct timeval * tv);
+
+static void
+tv_add(struct timeval * tv1, struct timeval * tv2);
+
+static void
+tv_sub(struct timeval * tv1, struct timeval * tv2);
+
+static long long
+real_ns(void);
+
+static void
+clock_now(ptylie_t * s, struct timespec * ts);
+
+static int
+clock_sleep(ptylie_t * s, struct timespec * delay);
+
+static int
+child_idle(ptylie_t * s);
+
+static int
+targets_idle(ptylie_t * s);
+
+static int
+child_reading(ptylie_t * s);
+
+static int
+child_ready(ptylie_t * s, int mode);
+
+static int
+ready_wait(ptylie_t * s, struct timespec * delay);
+
+static void
+drain_end(ptylie_t * s);
+
+static void
+ready_init(ptylie_t * s);
+
+static void
+adapt_pace(ptylie_t * s, long long late);
+
+static void
+init_etime(ptylie_t * s);
+
+static void
+add_srt_entry(ptylie_t * s, char * buf);
+
+static int
+mb_get_length(unsigned char c);
+
+static int
+mb_validate(const char * str, int length);
+
+static void
+mb_interpret(char * s);
+
+static int
+error(ptylie_t * s, int err, const char * message, ...);
+
+static const char *
+open_pty(int * fd_master, int * fd_slave);
+
+static ssize_t
+arg_read(int fd, void * buf, size_t count);
+
+static void
+get_arg(int fd, unsigned char * buf, int * len);
+
+static int
+map_elem_comp(const void * ptr1, const void * ptr2);
+
+static void
+map_elem_free(void * ptr);
+
+static void
+map_load(ptylie_t * s, FILE * map);
+
+static void
+init_terminfo(void);
+
+static const char *
+ti_lookup(char * arg);
+
+static const char *
+named_key_lookup(const char * name);
+
+static int
+inject_parse(ptylie_t * s);
+
+static int
+inject_unit(ptylie_t * s);
+
+static void
+control_accept(ptylie_t * s);
+
+static void
+control_status(ptylie_t * s);
+
+static int
+control_unlink(const char * path);
+
+static int
+log_open(log_dest_t * d, const char * log_file, const char * timing_file,
+         int dedup);
+
+static void
+log_close(log_dest_t * d);
+
+static long long
+log_delay(ptylie_t * s);
+
+static void
+log_put(log_dest_t * d, const void * buf, size_t len, long long delay);
+
+static void
+log_chunk(ptylie_t * s, const void * buf, size_t len);
+
+static int
+dump_record(void * ctx, long long time, const void * buf, size_t len);
+
+static int
+dump_ring(ptylie_t * s);
+
+static void
+transcript_chunk(ptylie_t * s, const unsigned char * buf, size_t len);
+
+static long
+screen_time(ptylie_t * s);
+
+static void
+screen_dump(ptylie_t * s, const char * marker);
+
+static int
+read_bucket(ssize_t size);
+
+static void
+stats_counter(FILE * out, int format, const char * name,
+              const char * help, unsigned long long value);
+
+static void
+stats_seconds(FILE * out, int format, const char * name,
+              const char * help, unsigned long long ns);
+
+static long long
+trace_now(ptylie_t * s);
+
+static void
+trace_event(ptylie_t * s, trace_buf_t ** pbuf, const char * name,
+            long long ts, long long dur, const char * arg1, long long val1,
+            const char * arg2, long long val2);
+
+static void
+trace_swap(ptylie_t * s, trace_buf_t ** pbuf);
+
+static void
+trace_write(ptylie_t * s, trace_buf_t * buf);
+
+static void *
+trace_writer(void * args);
+
+static void
+trace_end(ptylie_t * s);
+
+static void
+latency_key(ptylie_t * s);
+
+static void
+latency_output(ptylie_t * s, long long now, ssize_t len);
+
+static void
+latency_end(ptylie_t * s);
+
+static void
+csv_key(FILE * out, const unsigned char * key, int len);
+
+static void
+render_unit(ptylie_t * s, int next);
+
+static void
+render_end(ptylie_t * s);
+
+static int
+ll_comp(const void * ptr1, const void * ptr2);
+
+static double
+sample_time(ptylie_t * s);
+
+static void
+sample_tree(ptylie_t * s, sample_t * sum);
+
+static void
+sample_marker(ptylie_t * s, const char * name);
+
+static void *
+sampler(void * args);
+
+static void
+sample_end(ptylie_t * s);
+
+static void
+stats_quantiles(FILE * out, int format, const char * name,
+                const char * help, long long * v, size_t n, int ns);
+
+static int
+slave_setup(int fd_slave);
+
+static void
+slave(int fd_slave, char * const argv[], int fd_err);
+
+static void
+slave_park(int fd_slave, int fd_argv, int fd_err);
+
+static unsigned long long
+pool_context(void);
+
+static int
+pool_park(pool_entry_t * e);
+
+static void
+pool_release(pool_entry_t * e);
+
+static void *
+pool_filler(void * args);
+
+static int
+pool_take(pool_entry_t * e);
+
+/* ----------- */
+/* Definitions */
+/* ----------- */
+
+/* 255 int positions stack */
+/* """"""""""""""""""""""" */
+struct stk_s
+{
+  int nb;
+  int stack[255];
+};
+
+struct map_elem_s
+{
+  char * key;
+  char * repl;
+};
+
+/* Upper bounds of the buckets of the read size histogram, the last */
+/* bucket counts the larger reads.                                  */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+static const ssize_t read_bounds[] = { 16, 64, 256, 1024, 4096, 16384 };
+
+#define READ_BUCKETS (sizeof read_bounds / sizeof *read_bounds + 1)
+
+/* Counters of the output side (ptylie_read, ptylie_write) */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct out_stats_s
+{
+  unsigned long long reads;         /* reads returning data           */
+  unsigned long long read_bytes;    /* bytes read from the child      */
+  unsigned long long read_empty;    /* polls or reads without data    */
+  unsigned long long read_size[READ_BUCKETS];
+  unsigned long long writes;        /* writes to the child            */
+  unsigned long long write_bytes;   /* bytes written to the child     */
+  unsigned long long write_partial; /* writes shorter than requested  */
+  unsigned long long write_stalls;  /* writes refused with EAGAIN     */
+  unsigned long long packets;       /* TIOCPKT status changes         */
+};
+
+/* Counters of the injection side (ptylie_step, ptylie_inject) */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct inj_stats_s
+{
+  unsigned long long steps;       /* calls of ptylie_step             */
+  unsigned long long units;       /* units injected by the directives */
+  unsigned long long bytes;       /* bytes injected (TIOCSTI)         */
+  unsigned long long sleep_ns;    /* sleeps asked by the directives   */
+  unsigned long long wait_ns;     /* waits for an empty input queue   */
+  unsigned long long srt_entries; /* subtitles written                */
+  unsigned long long ready_late;  /* \w or start gate timeouts        */
+};
+
+/* An event of the trace (ptylie_trace): a span of dur us or an */
+/* instant event if dur is negative, with up to two arguments.  */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct trace_ev_s
+{
+  const char * name;
+  const char * arg1; /* NULL if the event has no argument */
+  const char * arg2; /* NULL if the event has one argument */
+  long long    ts;   /* us since ptylie_trace was called */
+  long long    dur;
+  long long    val1;
+  long long    val2;
+};
+
+#define TRACE_EVENTS 1024 /* events per buffer */
+
+/* Events of one side of the session waiting to be written */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct trace_buf_s
+{
+  trace_buf_t * next;
+  int           tid; /* trace_out_tid or trace_inj_tid */
+  int           nb;
+  trace_ev_t    ev[TRACE_EVENTS];
+};
+
+/* An injected unit and the output burst which follows it, the burst */
+/* ends when the output goes quiet (ptylie_latency).                 */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct lat_key_s
+{
+  long long     inject; /* real time of the injection, ns          */
+  long long     first;  /* first and last output bytes of the      */
+  long long     last;   /* burst, 0 if the child has not answered  */
+  unsigned long bytes;  /* output bytes of the burst               */
+  int           ended;  /* 1 once the output has gone quiet        */
+  int           len;    /* bytes injected                          */
+  unsigned char key[8]; /* the first of them                       */
+};
+
+/* Resources used by the process tree of the child (ptylie_sample) */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct sample_s
+{
+  int                procs; /* processes in the tree                */
+  double             cpu;   /* user + system s, waited children too */
+  long               rss;   /* resident set, KB                     */
+  unsigned long long vcsw;  /* voluntary context switches           */
+  unsigned long long ivcsw; /* involuntary context switches         */
+  unsigned long long rchar; /* bytes read and written by system     */
+  unsigned long long wchar; /* calls (/proc/pid/io)                 */
+};
+
+/* A \P marker reached by the command file (ptylie_marker) */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct mark_s
+{
+  char      name[64];
+  long long ns; /* real time since the spawn of the child */
+};
+
+/* Another session driven by the command file (\@, ptylie_target) */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct target_s
+{
+  char       name[32];
+  ptylie_t * s;
+};
+
+/* Kinds of units returned by the command file parser */
+/* """""""""""""""""""""""""""""""""""""""""""""""""" */
+enum
+{
+  UNIT_EOF,    /* the command file is exhausted                   */
+  UNIT_INJECT, /* bytes are ready to be injected                  */
+  UNIT_SLEEP,  /* \S: sleep once then continue the parsing        */
+  UNIT_WAIT,   /* \w: wait for the child to read its input        */
+  UNIT_PAUSE,  /* nothing to inject, only wait the inter-key time */
+  UNIT_NONE    /* the control connection has sent nothing yet     */
+};
+
+/* Time to wait for the end of a directive on a control connection */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#define ARG_WAIT_MS 500
+
+/* States of the child awaited by \w and the start gate */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""" */
+enum
+{
+  READY_NONE,  /* no wait in progress                           */
+  READY_ANY,   /* the child waits for its input                 */
+  READY_RAW,   /* the same with ICANON off (raw or cbreak mode) */
+  READY_COOKED /* the same with ICANON on (line editing mode)   */
+};
+
+/* Files receiving a log: the log or its deduplicated store, the    */
+/* timing file and its index, NULL if there is no timing (log_put). */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct log_dest_s
+{
+  int       fd;       /* log file, -1 if none                 */
+  cdc_t *   cdc;      /* its store if deduplicated, else NULL */
+  FILE *    tim;      /* delay and size of each chunk         */
+  FILE *    idx;      /* fixed size seek index of the two     */
+  long long time;     /* us since the start of the recording  */
+  long long size;     /* bytes written in the log             */
+  long long idx_next; /* time of the next index entry         */
+};
+
+/* Dump of the log kept in memory (dump_record) */
+/* """""""""""""""""""""""""""""""""""""""""""" */
+struct dump_s
+{
+  log_dest_t dest;
+  long long  prev; /* time of the previous record, -1 before the first */
+};
+
+/* State of a recording session: the child and its PTY, the log and */
+/* subtitles files and the state of the command file interpreter.   */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct ptylie_s
+{
+  pid_t pid;       /* pid of the child                     */
+  int   reaped;    /* 1 when the child has been waited for */
+  int   fd_exec;   /* execvp result of a pooled child      */
+  int   fd_pid;    /* pidfd of the child, -1 if none       */
+  int   fd_master; /* master side of the PTY               */
+  int   fd_slave;  /* slave side of the PTY                */
+  int   packet;    /* 1 if the master is in TIOCPKT mode   */
+  int   fdx;       /* plain text transcript, -1 if none    */
+  int   fdc;       /* command file currently read          */
+  stk_t fd_stack;  /* nested command files (\R)            */
+
+  struct rusage rusage;  /* resources used by the child (ptylie_wait) */
+  long long     spawned; /* real time of its spawn, ns                */
+
+  vt_strip_t strip; /* escape sequences stripper of the transcript */
+
+  unsigned width;
+  unsigned height;
+
+  struct timeval first;      /* origin of the subtitles timestamps */
+  struct timeval srt_offset; /* offset added to the timestamps     */
+  int            offset_sign;
+  FILE *         srt;
+  char *         srt_file;
+  int            srt_on;
+  unsigned       srt_count;
+  int            duration; /* ms */
+
+  rb_tree * map_tree; /* subtitles map (\m) */
+  int       map_on;
+
+  /* Log and timing (opts.log_file and timing_file), log_lock keeps   */
+  /* the log and its timing in the same order when both sides write   */
+  /* in the log. With opts.ring_size the chunks only go to ring, the  */
+  /* files are written by ptylie_dump and log_lock serializes them.   */
+  /* '''''''''''''''''''''''''''''''''''''''''''''''''''''''''''''''' */
+  pthread_mutex_t log_lock;
+  log_dest_t      log;         /* files written as the session runs */
+  struct timespec log_last;    /* time of the previous chunk        */
+  ring_t *        ring;        /* last chunks, NULL if not kept     */
+  long long       ring_time;   /* us since the start, in the ring   */
+  char *          ring_log;    /* files of ptylie_dump              */
+  char *          ring_timing; /*                                   */
+  int             ring_dedup;  /*                                   */
+  unsigned long   dumps;       /* calls of ptylie_dump done         */
+
+  /* Clock of the session (see clock_now), the times are in ns */
+  /* ''''''''''''''''''''''''''''''''''''''''''''''''''''''''' */
+  pthread_mutex_t clock_lock;
+  ptylie_t *      clock;        /* session of the clock, see clock_now  */
+  int             virtual_time; /* 1 if the sleeps are not real         */
+  long long       clock_offset; /* added to the real monotonic clock    */
+  long long       vsleep;       /* virtual sleep waiting for the child  */
+  long long       vsleep_start; /* real time at which it was requested  */
+  long long       last_output;  /* real time of the last output         */
+
+  /* Counters (ptylie_stats), each side only updates its own set so    */
+  /* no lock is needed, the padding keeps them in distinct cache lines */
+  /* ''''''''''''''''''''''''''''''''''''''''''''''''''''''''''''''''' */
+  out_stats_t out_stats;
+  char        stats_pad[64];
+  inj_stats_t inj_stats;
+
+  /* Trace (ptylie_trace), each side fills its own buffer without    */
+  /* lock, the full ones are queued under trace_lock and written by  */
+  /* the trace_writer thread.                                        */
+  /* ''''''''''''''''''''''''''''''''''''''''''''''''''''''''''''''' */
+  pthread_mutex_t trace_lock;
+  pthread_cond_t  trace_cond;
+  pthread_t       trace_thread;
+  FILE *          trace;        /* NULL if the session is not traced */
+  int             trace_stop;   /* 1 when trace_writer must end      */
+  long long       trace_start;  /* real time origin of the trace     */
+  long long       trace_drain;  /* start of a wait for the child, us */
+  trace_buf_t *   trace_out;    /* buffer of the output side         */
+  trace_buf_t *   trace_inj;    /* buffer of the injection side      */
+  trace_buf_t *   trace_head;   /* full buffers, oldest first        */
+  trace_buf_t *   trace_tail;   /*                                   */
+  trace_buf_t *   trace_free;   /* buffers ready to be reused        */
+
+  char errmsg[256]; /* message describing the last error */
+
+  /* Control socket (ptylie_control) */
+  /* ''''''''''''''''''''''''''''''' */
+  int           fd_ctl;     /* listening socket, -1 if none       */
+  int           fd_client;  /* connection being played, -1 if none */
+  char *        ctl_path;   /* path of the socket                 */
+  char          marker[64]; /* last \P marker seen                */
+  unsigned long injected;   /* number of bytes injected           */
+  mark_t *      marks;      /* all the \P markers seen            */
+  unsigned      marks_nb;   /*                                    */
+  unsigned      marks_max;  /* allocated entries                  */
+
+  /* Latency profile (ptylie_latency), the injection side adds the */
+  /* keys and the output side completes the last one under lat_lock */
+  /* '''''''''''''''''''''''''''''''''''''''''''''''''''''''''''''' */
+  pthread_mutex_t lat_lock;
+  FILE *          lat;      /* per key CSV, NULL if not profiling */
+  lat_key_t *     lat_keys; /* the keys injected so far           */
+  size_t          lat_nb;   /*                                    */
+  size_t          lat_max;  /* allocated entries                  */
+
+  /* Render cost (ptylie_render), the output side counts in render_cost */
+  /* and the injection side writes the unit of each key, under          */
+  /* render_lock.                                                       */
+  /* '''''''''''''''''''''''''''''''''''''''''''''''''''''''''''''''''' */
+  pthread_mutex_t render_lock;
+  FILE *          render;        /* per unit CSV, NULL if not analysing */
+  vt_cost_t       render_cost;   /* counters since the start            */
+  vt_cost_t       render_base;   /* counters at the start of the unit   */
+  long long       render_start;  /* real time of the start, ns          */
+  long long       render_inject; /* real time of the unit, ns           */
+  int             render_len;    /* bytes injected by the unit          */
+  unsigned char   render_key[8]; /* the first of them                   */
+
+  /* Resources sampler (ptylie_sample), a thread of its own writes the */
+  /* samples, sample_lock orders them with the \P markers.             */
+  /* ''''''''''''''''''''''''''''''''''''''''''''''''''''''''''''''''' */
+  pthread_mutex_t sample_lock;
+  pthread_cond_t  sample_cond;
+  pthread_t       sample_thread;
+  FILE *          sample;       /* NULL if not sampling         */
+  long            sample_every; /* ms between two samples       */
+  int             sample_stop;  /* 1 when the sampler must end  */
+
+  /* Screen model (ptylie_screen), the output and the injection sides */
+  /* both use it, vt_lock protects it along with the fields below.    */
+  /* '''''''''''''''''''''''''''''''''''''''''''''''''''''''''''''''' */
+  pthread_mutex_t vt_lock;
+  vt_t *          vt;            /* NULL if the screen is not modeled */
+  FILE *          snap;          /* snapshots file                    */
+  int             snap_json;     /* 1 for JSON lines snapshots        */
+  long            snap_interval; /* ms between snapshots, 0 for none  */
+  long            snap_last;     /* time of the last snapshot         */
+  struct timespec snap_start;    /* origin of the snapshot timestamps */
+
+  /* Command file interpreter state */
+  /* '''''''''''''''''''''''''''''' */
+  int             special;
+  int             meta;
+  int             control;
+  long            sleep_time; /* ms between two injections        */
+  struct timespec sleep_ts;   /* the same as a timespec           */
+  struct timespec sleep_once; /* argument of the last \S          */
+  int             pending;    /* 1 if buf is still to be injected */
+  int             wait_mode;  /* READY_* state awaited by \w      */
+  long long       wait_start; /* real times of the start and the  */
+  long long       wait_end;   /* timeout of the wait, ns          */
+  long            start_wait; /* ms, see opts.start_wait          */
+  int             adaptive;   /* 1 after \s[auto]                 */
+  long long       adapt_ns;   /* adaptive inter-key time          */
+  long long       adapt_min;  /* bounds of adapt_ns               */
+  long long       adapt_max;  /*                                  */
+  long long       adapt_late; /* start of a wait for the queue    */
+  long long       drain_from; /* real start of a drain wait, ns   */
+  ptylie_t *      target;     /* session injected (\@), s if none */
+  target_t *      targets;    /* sessions named by ptylie_target  */
+  unsigned        targets_nb; /*                                  */
+  unsigned char   c;          /* last byte read                   */
+  int             l;          /* number of bytes in buf           */
+  unsigned char   buf[4096];
+  unsigned char   vbuf[4096];
+};
+
+static const int default_duration = 300; /* ms */
+
+/* In virtual time mode and during \w the child is considered idle    */
+/* when it has read all its input and has not written anything for    */
+/* this time.                                                         */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+static const long long idle_quiet = 10000000LL; /* ns */
+
+/* Timeout of \w when its argument does not give one */
+/* """"""""""""""""""""""""""""""""""""""""""""""""" */
+static const long default_wait = 10000; /* ms */
+
+/* Default bounds of the adaptive inter-key time (\s[auto]) */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+static const long default_adapt_min = 1;   /* ms */
+static const long default_adapt_max = 500; /* ms */
+
+/* Thread ids of the two sides of a session in the traces */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""" */
+static const int trace_out_tid = 1;
+static const int trace_inj_tid = 2;
+
+/* Terminfo sequences already computed by \T, keyed by the raw directive */
+/* argument, that is the capability name followed by its parameters.    */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+static rb_tree *       ti_cache_tree = NULL;
+static int             ti_ok         = 0; /* 1 if setupterm has succeeded */
+static pthread_mutex_t ti_lock       = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t  ti_once       = PTHREAD_ONCE_INIT;
+
+/* Serializes the creation of the file descriptors which cannot be */
+/* created with O_CLOEXEC and the forks, so that the descriptors   */
+/* of a session are never inherited by the child of another one.   */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+static pthread_mutex_t spawn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A child parked in a PTY of its own, waiting for the program to */
+/* execute (see ptylie_pool).                                     */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct pool_entry_s
+{
+  pid_t              pid;
+  int                fd_master;
+  int                fd_slave;
+  int                fd_argv; /* the arguments of execvp are written here */
+  int                fd_err;  /* errno of a failed execvp is read here    */
+  unsigned long long context; /* pool_context when the child was parked   */
+};
+
+static pthread_mutex_t pool_lock      = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  pool_cond      = PTHREAD_COND_INITIALIZER;
+static pool_entry_t *  pool           = NULL;
+static unsigned        pool_nb        = 0; /* parked children     */
+static unsigned        pool_size      = 0; /* wanted children     */
+static unsigned        pool_max       = 0; /* allocated entries   */
+static int             pool_thread_on = 0; /* 1 if filler started */
+
+extern char ** environ;
+
+/* Named keys usable in \K[...], their sequences are read from the */
+/* terminfo database once at startup.                              */
+/* This array must stay sorted by name (case insensitive).         */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct named_key_s
+{
+  const char * name;
+  const char * capname;
+  char *       seq;
+};
+
+typedef struct named_key_s named_key_t;
+
+static named_key_t named_keys[] = {
+  { "BackTab", "kcbt", NULL }, { "Del", "kdch1", NULL },
+  { "Down", "kcud1", NULL },   { "End", "kend", NULL },
+  { "F1", "kf1", NULL },       { "F10", "kf10", NULL },
+  { "F11", "kf11", NULL },     { "F12", "kf12", NULL },
+  { "F2", "kf2", NULL },       { "F3", "kf3", NULL },
+  { "F4", "kf4", NULL },       { "F5", "kf5", NULL },
+  { "F6", "kf6", NULL },       { "F7", "kf7", NULL },
+  { "F8", "kf8", NULL },       { "F9", "kf9", NULL },
+  { "Home", "khome", NULL },   { "Ins", "kich1", NULL },
+  { "Left", "kcub1", NULL },   { "PgDn", "knp", NULL },
+  { "PgUp", "kpp", NULL },     { "Right", "kcuf1", NULL },
+  { "Up", "kcuu1", NULL },
+};
+
+/* ------------------------------ */
+/* int stack management functions */
+/* ------------------------------ */
+
+static void
+stk_init(stk_t * stack)
+{
+  stack->nb = 0;
+}
+
+static int
+stk_push(stk_t * stack, int fd)
+{
+  if (stack->nb == 255)
+    return -1;
+
+  stack->stack[stack->nb] = fd;
+  stack->nb++;
+
+  return fd;
+}
+
+static int
+stk_pop(stk_t * stack)
+{
+  if (stack->nb == 0)
+    return -1;
+
+  stack->nb--;
+
+  return stack->stack[stack->nb];
+}
+
+/* ----------------------------- */
+/* Timeval management functions. */
+/* ----------------------------- */
+
+/* ==================================== */
+/* Ensures that 0 <= tv_usec < 1000000. */
+/* ==================================== */
+static void
+tv_norm(struct timeval * tv)
+{
+  if (tv->tv_usec >= 1000000)
+  {
+    tv->tv_sec += tv->tv_usec / 1000000;
+    tv->tv_usec %= 1000000;
+  }
+  else if (tv->tv_usec < 0)
+  {
+    tv->tv_usec = 0;
+  }
+}
+
+/* ======================= */
+/* timeval add tv2 to tv1. */
+/* ======================= */
+static void
+tv_add(struct timeval * tv1, struct timeval * tv2)
+{
+  /* Ensures that 0 <= usec < 1000000. */
+  /* """"""""""""""""""""""""""""""""" */
+  tv_norm(tv1);
+  tv_norm(tv2);
+
+  tv1->tv_sec += tv2->tv_sec;
+  tv1->tv_usec += tv2->tv_usec;
+
+  if (tv1->tv_usec >= 1000000)
+  {
+    tv1->tv_sec++;
+    tv1->tv_usec -= 1000000;
+  }
+}
+
+/* ========================= */
+/* timeval sub tv2 from tv1. */
+/* ========================= */
+static void
+tv_sub(struct timeval * tv1, struct timeval * tv2)
+{
+  /* Ensures that 0 <= usec < 1000000. */
+  /* """"""""""""""""""""""""""""""""" */
+  tv_norm(tv1);
+  tv_norm(tv2);
+
+  tv1->tv_sec -= tv2->tv_sec;
+  tv1->tv_usec -= tv2->tv_usec;
+
+  if (tv1->tv_usec < 0)
+  {
+    tv1->tv_sec--;
+    tv1->tv_usec += 1000000;
+  }
+}
+
+/* ======================================================= */
+/* Returns the value of the monotonic clock in nanoseconds */
+/* ======================================================= */
+static long long
+real_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* ================================================================= */
+/* Gives the current time of the session: the monotonic clock plus   */
+/* the sleeps skipped in virtual time mode. All the timestamps of    */
+/* the session (log timing, subtitles, snapshots) come from here.    */
+/* The targets of a command file use the clock of its session.       */
+/* ================================================================= */
+static void
+clock_now(ptylie_t * s, struct timespec * ts)
+{
+  long long now = real_ns();
+
+  s = s->clock;
+  if (s->virtual_time)
+  {
+    pthread_mutex_lock(&s->clock_lock);
+    now += s->clock_offset;
+    pthread_mutex_unlock(&s->clock_lock);
+  }
+
+  ts->tv_sec  = now / 1000000000LL;
+  ts->tv_nsec = now % 1000000000LL;
+}
+
+/* ================================================================== */
+/* Called by ptylie_step before returning a sleep of *delay. In       */
+/* virtual time mode the sleep is recorded as pending and replaced    */
+/* by a short real one: ptylie_step will advance the clock of the     */
+/* session instead of sleeping as soon as the child is idle.          */
+/* Returns 1 as ptylie_step.                                          */
+/* ================================================================== */
+static int
+clock_sleep(ptylie_t * s, struct timespec * delay)
+{
+  if (!s->virtual_time)
+    return 1;
+
+  s->vsleep       = delay->tv_sec * 1000000000LL + delay->tv_nsec;
+  s->vsleep_start = real_ns();
+
+  delay->tv_sec  = 0;
+  delay->tv_nsec = 1000000L;
+
+  return 1;
+}
+
+/* ================================================================== */
+/* Returns 1 if the child has read all the injected keys and has been */
+/* silent for idle_quiet ns.                                          */
+/* ================================================================== */
+static int
+child_idle(ptylie_t * s)
+{
+  int       chars = 0;
+  long long last;
+
+  ioctl(s->fd_slave, FIONREAD, &chars);
+  if (chars > 0)
+    return 0;
+
+  pthread_mutex_lock(&s->clock_lock);
+  last = s->last_output;
+  pthread_mutex_unlock(&s->clock_lock);
+
+  return real_ns() - last >= idle_quiet;
+}
+
+/* ================================================================== */
+/* Returns 1 if the child of the session and those of all its targets */
+/* are idle (see child_idle).                                         */
+/* ================================================================== */
+static int
+targets_idle(ptylie_t * s)
+{
+  unsigned i;
+
+  if (!child_idle(s))
+    return 0;
+
+  for (i = 0; i < s->targets_nb; i++)
+    if (!child_idle(s->targets[i].s))
+      return 0;
+
+  return 1;
+}
+
+/* ================================================================== */
+/* Tells if the foreground process of the terminal of the child is    */
+/* blocked in a system call waiting for its input: a read of the      */
+/* terminal or a select/poll like call, whose descriptors are not     */
+/* checked. Uses /proc/<pid>/syscall on Linux.                        */
+/* Returns 1 if it is, 0 if it is not and -1 if it cannot be known.   */
+/* ================================================================== */
+static int
+child_reading(ptylie_t * s)
+{
+#if defined(__linux__)
+  static const long waits[] = {
+    SYS_pselect6, SYS_ppoll, SYS_epoll_pwait,
+#ifdef SYS_select
+    SYS_select,
+#endif
+#ifdef SYS_poll
+    SYS_poll,
+#endif
+#ifdef SYS_epoll_wait
+    SYS_epoll_wait,
+#endif
+  };
+
+  char          path[64];
+  char          line[128];
+  struct stat   st, st_tty;
+  pid_t         pg;
+  long          nr;
+  unsigned long fd;
+  ssize_t       n;
+  int           f;
+  unsigned      i;
+
+  if ((pg = tcgetpgrp(s->fd_master)) <= 0)
+    pg = s->pid;
+
+  snprintf(path, sizeof path, "/proc/%ld/syscall", (long)pg);
+  if ((f = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+    return -1;
+  n = read(f, line, sizeof line - 1);
+  close(f);
+  if (n <= 0)
+    return -1;
+  line[n] = '\0';
+
+  /* "running" or -1 outside of a system call */
+  /* '''''''''''''''''''''''''''''''''''''''' */
+  if (sscanf(line, "%ld 0x%lx", &nr, &fd) != 2 || nr < 0)
+    return 0;
+
+  if (nr == SYS_read || nr == SYS_readv)
+  {
+    snprintf(path, sizeof path, "/proc/%ld/fd/%lu", (long)pg, fd);
+    return stat(path, &st) == 0 && fstat(s->fd_slave, &st_tty) == 0
+           && S_ISCHR(st.st_mode) && st.st_rdev == st_tty.st_rdev;
+  }
+
+  for (i = 0; i < sizeof waits / sizeof *waits; i++)
+    if (nr == waits[i])
+      return 1;
+
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+/* ================================================================== */
+/* Returns 1 if the child is ready to receive keys in the given mode: */
+/* it has read all its input, has been silent for idle_quiet ns, its  */
+/* line discipline is in the awaited state and it is waiting for its  */
+/* input if this can be known.                                        */
+/* ================================================================== */
+static int
+child_ready(ptylie_t * s, int mode)
+{
+  struct termios t;
+
+  if (!child_idle(s))
+    return 0;
+
+  if (mode != READY_ANY)
+  {
+    if (tcgetattr(s->fd_slave, &t) == -1)
+      return 0;
+    if ((mode == READY_RAW) == ((t.c_lflag & ICANON) != 0))
+      return 0;
+  }
+
+  return child_reading(s) != 0;
+}
+
+/* ================================================================== */
+/* Polls the readiness of the child during a \w or the start gate.    */
+/* Returns 1 with a short *delay while the child is not ready, 0 when */
+/* the wait is over because it is or because the timeout expired.     */
+/* ================================================================== */
+static int
+ready_wait(ptylie_t * s, struct timespec * delay)
+{
+  long long now   = real_ns();
+  int       ready = child_ready(s->target, s->wait_mode);
+
+  if (!ready && now < s->wait_end)
+  {
+    delay->tv_sec  = 0;
+    delay->tv_nsec = 1000000L;
+    return 1;
+  }
+
+  s->inj_stats.wait_ns += now - s->wait_start;
+
+  /* A check of the command file has failed, the log kept in memory */
+  /* is written.                                                    */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (!ready)
+  {
+    s->inj_stats.ready_late++;
+    if (s->ring != NULL)
+      ptylie_dump(s);
+  }
+
+  trace_event(s, &s->trace_inj, "ready wait",
+              trace_now(s) - (now - s->wait_start) / 1000,
+              (now - s->wait_start) / 1000, "mode", s->wait_mode,
+              "timeout", !ready);
+  s->wait_mode = READY_NONE;
+
+  return 0;
+}
+
+/* ================================================================== */
+/* Counts the time actually waited for the child to process its input */
+/* once the wait started at s->drain_from is over.                    */
+/* ================================================================== */
+static void
+drain_end(ptylie_t * s)
+{
+  if (s->drain_from > 0)
+  {
+    s->inj_stats.wait_ns += real_ns() - s->drain_from;
+    s->drain_from = 0;
+  }
+}
+
+/* ================================================================== */
+/* Called once the child is started: puts the master in packet mode,  */
+/* so that the changes of the line discipline done by the child (flow */
+/* control, flushes) are reported, and arms the start gate.           */
+/* ================================================================== */
+static void
+ready_init(ptylie_t * s)
+{
+#ifdef TIOCPKT
+  int on = 1;
+
+  s->packet = ioctl(s->fd_master, TIOCPKT, &on) == 0;
+#endif
+
+  if (s->start_wait > 0)
+  {
+    s->wait_mode  = READY_ANY;
+    s->wait_start = real_ns();
+    s->wait_end   = s->wait_start + s->start_wait * 1000000LL;
+  }
+}
+
+/* ================================================================== */
+/* Adjusts the adaptive inter-key time before an injection. late is   */
+/* the time the previous unit stayed in the input queue after the     */
+/* pause which followed it, 0 if the queue was already empty.         */
+/* A late child gets this time plus a margin, otherwise the pause is  */
+/* shortened by 1/8 so that it converges towards the smallest value   */
+/* the child keeps up with.                                           */
+/* ================================================================== */
+static void
+adapt_pace(ptylie_t * s, long long late)
+{
+  long long d = s->adapt_ns;
+
+  if (late > 0)
+    d = (d + late) + (d + late) / 4;
+  else
+    d -= d / 8;
+
+  if (d < s->adapt_min)
+    d = s->adapt_min;
+  else if (d > s->adapt_max)
+    d = s->adapt_max;
+
+  s->adapt_ns = d;
+}
+
+/* =============== */
+/* init the timer. */
+/* =============== */
+static void
+init_etime(ptylie_t * s)
+{
+  struct timespec now;
+
+  s->spawned = real_ns();
+
+  clock_now(s, &now);
+  s->log_last      = now;
+  s->first.tv_sec  = now.tv_sec;
+  s->first.tv_usec = now.tv_nsec / 1000;
+  if (s->offset_sign > 0)
+    tv_sub(&s->first, &s->srt_offset);
+  else
+    tv_add(&s->first, &s->srt_offset);
+}
+
+/* ================================================ */
+/* return elapsed seconds since call to init_etime. */
+/* ================================================ */
+static void
+add_srt_entry(ptylie_t * s, char * buf)
+{
+  int  h1, m1;
+  int  h2, m2;
+  long s1, ms1;
+  long s2, ms2;
+
+  long etime;
+
+  struct timeval  curr;
+  struct timespec now;
+
+  clock_now(s, &now);
+  curr.tv_sec  = now.tv_sec;
+  curr.tv_usec = now.tv_nsec / 1000;
+  etime = (curr.tv_sec - s->first.tv_sec) * 1000000L
+          + (curr.tv_usec - s->first.tv_usec);
+
+  etime /= 1000;
+
+  h1  = (int)(etime / 3600000);
+  m1  = (int)((etime - h1 * 3600000) / 60000);
+  s1  = (etime - h1 * 3600000 - m1 * 60000) / 1000;
+  ms1 = etime - h1 * 3600000 - m1 * 60000 - s1 * 1000;
+
+  etime += s->duration;
+
+  h2  = (int)(etime / 3600000);
+  m2  = (int)((etime - h2 * 3600000) / 60000);
+  s2  = (etime - h2 * 3600000 - m2 * 60000) / 1000;
+  ms2 = etime - h2 * 3600000 - m2 * 60000 - s2 * 1000;
+
+  fprintf(s->srt,
+          "%u\n"
+          "%02d:%02d:%02ld,%03ld --> "
+          "%02d:%02d:%02ld,%03ld\n"
+          "%s\n\n",
+          s->srt_count++, h1, m1, s1, ms1, h2, m2, s2, ms2, buf);
+
+  s->inj_stats.srt_entries++;
+}
+
+/* ----------------- */
+/* Utility functions */
+/* ----------------- */
+
+/* ========================================================= */
+/* Decode the number of bytes taken by a character (UTF-8)   */
+/* It is the length of the leading sequence of bits set to 1 */
+/* (Count Leading Ones)                                      */
+/* ========================================================= */
+static int
+mb_get_length(unsigned char c)
+{
+  if (c >= 0xf0)
+    return 4;
+  else if (c >= 0xe0)
+    return 3;
+  else if (c >= 0xc2)
+    return 2;
+  else
+    return 1;
+}
+
+static const char trailing_bytes_for_utf8[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+  2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5
+};
+
+/* ================================================================= */
+/* UTF8 validation routine inspired by Jeff Bezanson                 */
+/*   placed in the public domain Fall 2005                           */
+/*   (https://github.com/JeffBezanson/cutef8)                        */
+/*                                                                   */
+/* Returns 1 if str contains a valid UTF8 byte sequence, 0 otherwise */
+/* ================================================================= */
+static int
+mb_validate(const char * str, int length)
+{
+  const unsigned char *p, *pend = (unsigned char *)str + length;
+  unsigned char        c;
+  int                  ab;
+
+  for (p = (unsigned char *)str; p < pend; p++)
+  {
+    c = *p;
+    if (c < 128)
+      continue;
+    if ((c & 0xc0) != 0xc0)
+      return 0;
+    ab = trailing_bytes_for_utf8[c];
+    if (length < ab)
+      return 0;
+    length -= ab;
+
+    p++;
+    /* Check top bits in the second byte */
+    /* """"""""""""""""""""""""""""""""" */
+    if ((*p & 0xc0) != 0x80)
+      return 0;
+
+    /* Check for overlong sequences for each different length */
+    /* """""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    switch (ab)
+    {
+      /* Check for xx00 000x */
+      /* """"""""""""""""""" */
+      case 1:
+        if ((c & 0x3e) == 0)
+          return 0;
+        continue; /* We know there aren't any more bytes to check */
+
+      /* Check for 1110 0000, xx0x xxxx */
+      /* """""""""""""""""""""""""""""" */
+      case 2:
+        if (c == 0xe0 && (*p & 0x20) == 0)
+          return 0;
+        break;
+
+      /* Check for 1111 0000, xx00 xxxx */
+      /* """""""""""""""""""""""""""""" */
+      case 3:
+        if (c == 0xf0 && (*p & 0x30) == 0)
+          return 0;
+        break;
+
+      /* Check for 1111 1000, xx00 0xxx */
+      /* """""""""""""""""""""""""""""" */
+      case 4:
+        if (c == 0xf8 && (*p & 0x38) == 0)
+          return 0;
+        break;
+
+      /* Check for leading 0xfe or 0xff,   */
+      /* and then for 1111 1100, xx00 00xx */
+      /* """"""""""""""""""""""""""""""""" */
+      case 5:
+        if (c == 0xfe || c == 0xff || (c == 0xfc && (*p & 0x3c) == 0))
+          return 0;
+        break;
+    }
+
+    /* Check for valid bytes after the 2nd, if any; all must start 10 */
+    /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    while (--ab > 0)
+    {
+      if ((*(++p) & 0xc0) != 0x80)
+        return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* ======================================================================== */
+/* unicode (UTF-8) ascii representation interprer.                          */
+/* The string passed will be altered but will not move in memory            */
+/* All sequence of \uxx, \uxxxx, \uxxxxxx and \uxxxxxxxx will be replace by */
+/* the corresponding UTF-8 character.                                       */
+/* ======================================================================== */
+static void
+mb_interpret(char * s)
+{
+  char * utf8_str;          /* \uxx...                                        */
+  size_t utf8_to_eos_len;   /* bytes in s starting from the first             *
+                             * occurrence of \u                               */
+  size_t init_len;          /* initial lengths of the string to interpret     */
+  size_t utf8_ascii_len;    /* 2,4,6 or 8 bytes                               */
+  size_t len_to_remove = 0; /* number of bytes to remove after the conversion */
+  char   tmp[9];            /* temporary string                               */
+
+  /* Guard against the case where s is NULL */
+  /* """""""""""""""""""""""""""""""""""""" */
+  if (s == NULL)
+    return;
+
+  init_len = strlen(s);
+
+  while ((utf8_str = strstr(s, "\\u")) != NULL)
+  {
+    utf8_to_eos_len = strlen(utf8_str);
+    if (utf8_to_eos_len
+        < 4) /* string too short to contain a valid UTF-8 char */
+    {
+      *utf8_str       = '.';
+      *(utf8_str + 1) = '\0';
+    }
+    else /* s is long enough */
+    {
+      unsigned byte;
+      char *   utf8_seq_offset = utf8_str + 2;
+
+      /* Get the first 2 utf8 bytes */
+      *tmp       = *utf8_seq_offset;
+      *(tmp + 1) = *(utf8_seq_offset + 1);
+      *(tmp + 2) = '\0';
+
+      /* If they are invalid, replace the \u sequence by a dot */
+      /* """"""""""""""""""""""""""""""""""""""""""""""""""""" */
+      if (!isxdigit(tmp[0]) || !isxdigit(tmp[1]))
+      {
+        *utf8_str = '.';
+        if (4 >= utf8_to_eos_len)
+          *(utf8_str + 1) = '\0';
+        else
+          memmove(utf8_str, utf8_str + 4, utf8_to_eos_len - 4);
+        return;
+      }
+      else
+      {
+        /* They are valid, deduce from them the length of the sequence */
+        /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+        sscanf(tmp, "%2x", &byte);
+        utf8_ascii_len = mb_get_length(byte) * 2;
+
+        /* Check again if the inputs string is long enough */
+        /* """"""""""""""""""""""""""""""""""""""""""""""" */
+        if (utf8_to_eos_len - 2 < utf8_ascii_len)
+        {
+          *utf8_str       = '.';
+          *(utf8_str + 1) = '\0';
+        }
+        else
+        {
+          /* replace the \u sequence by the bytes forming the UTF-8 char */
+          /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+          size_t i;
+          *tmp = byte;
+
+          /* Put the bytes in the tmp string */
+          /* ''''''''''''''''''''''''''''''' */
+          for (i = 1; i < utf8_ascii_len / 2; i++)
+          {
+            sscanf(utf8_seq_offset + 2 * i, "%2x", &byte);
+            *(tmp + i) = byte;
+          }
+          tmp[utf8_ascii_len / 2] = '\0';
+
+          /* Does they form a valid UTF-8 char? */
+          /* '''''''''''''''''''''''''''''''''' */
+          if (mb_validate(tmp, utf8_ascii_len / 2))
+          {
+            /* Put them back in the original string and move */
+            /* the remaining bytes after them                */
+            /* ''''''''''''''''''''''''''''''''''''''''''''' */
+            memmove(utf8_str, tmp, utf8_ascii_len / 2);
+
+            if (utf8_to_eos_len < utf8_ascii_len)
+              *(utf8_str + utf8_ascii_len / 2 + 1) = '\0';
+            else
+              memmove(utf8_str + utf8_ascii_len / 2,
+                      utf8_seq_offset + utf8_ascii_len,
+                      utf8_to_eos_len - utf8_ascii_len - 2 + 1);
+          }
+          else
+          {
+            /* The invalid sequence is replaced by a dot */
+            /* ''''''''''''''''''''''''''''''''''''''''' */
+            *utf8_str = '.';
+            if (utf8_to_eos_len < utf8_ascii_len)
+              *(utf8_str + 1) = '\0';
+            else
+              memmove(utf8_str + 1, utf8_seq_offset + utf8_ascii_len,
+                      utf8_to_eos_len - utf8_ascii_len - 2 + 1);
+            utf8_ascii_len = 2;
+          }
+        }
+
+        /* Update the number of bytes to remove at the end */
+        /* of the initial string                           */
+        /* """"""""""""""""""""""""""""""""""""""""""""""" */
+        len_to_remove += 2 + utf8_ascii_len / 2;
+      }
+    }
+  }
+
+  /* Make sure that the string is well terminated */
+  /* """""""""""""""""""""""""""""""""""""""""""" */
+  *(s + init_len - len_to_remove) = '\0';
+
+  return;
+}
+/* ================================================================ */
+/* printf like function which records an error message in s and     */
+/* returns err so that it can be used as: return error(s, err, ...) */
+/* errno is preserved.                                              */
+/* ================================================================ */
+static int
+error(ptylie_t * s, int err, const char * message, ...)
+{
+  va_list args;
+  int     saved_errno = errno;
+
+  va_start(args, message);
+  vsnprintf(s->errmsg, sizeof s->errmsg, message, args);
+  va_end(args);
+
+  errno = saved_errno;
+
+  return err;
+}
+
+/* ================================================================= */
+/* Obtain the master and slave file descriptors of a new PTY, they   */
+/* will not be inherited by the children. Must be called with        */
+/* spawn_lock held.                                                  */
+/* Returns NULL or the name of the failed call, errno is then set.   */
+/* ================================================================= */
+static const char *
+open_pty(int * fd_master, int * fd_slave)
+{
+  int fd, err;
+
+  fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (fd < 0)
+    return "posix_openpt()";
+
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  if (grantpt(fd) != 0 || unlockpt(fd) != 0)
+  {
+    err = errno;
+    close(fd);
+    errno = err;
+    return "grantpt()";
+  }
+
+  /* Open the slave side of the PTY */
+  /* """""""""""""""""""""""""""""" */
+  *fd_slave = open(ptsname(fd), O_RDWR | O_APPEND | O_NOCTTY | O_CLOEXEC);
+  if (*fd_slave == -1)
+  {
+    err = errno;
+    close(fd);
+    errno = err;
+    return "open(pts)";
+  }
+
+  *fd_master = fd;
+
+  return NULL;
+}
+
+/* ================================================================= */
+/* read() of the rest of a directive. A control connection is non    */
+/* blocking, its peer is given at most ARG_WAIT_MS to send the bytes */
+/* following the start of the directive.                             */
+/* ================================================================= */
+static ssize_t
+arg_read(int fd, void * buf, size_t count)
+{
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  ssize_t       rc;
+
+  rc = read(fd, buf, count);
+  if (rc == -1 && errno == EAGAIN && poll(&pfd, 1, ARG_WAIT_MS) == 1)
+    rc = read(fd, buf, count);
+
+  return rc;
+}
+
+/* ===================================================================== */
+/* get the directive argument that must be found starting at the current */
+/* fd position and ending before the next ']'.                           */
+/*                                                                       */
+/* fd  (IN)  file desctiptor to work on.                                 */
+/* buf (OUT) output null terminated buffer.                              */
+/* len (OUT) size in byte of the argument found.                         */
+/*                                                                       */
+/* NOTE: a missing trailing ']' is silently ignored and at most 4096     */
+/*       byte will be read.                                              */
+/*                                                                       */
+/* TODO: Make this more robust and generic                               */
+/* ===================================================================== */
+static void
+get_arg(int fd, unsigned char * buf, int * len)
+{
+  int data = '\0';
+  int rc   = 0;
+
+  *len = 0;
+
+  while (rc != -1 && data != ']' && *len < 4096)
+  {
+    rc = arg_read(fd, &data, 1);
+    if (rc == -1 || rc == 0)
+      break;
+    buf[(*len)++] = (unsigned char)data;
+  }
+  buf[*len] = '\0';
+}
+
+static int
+map_elem_comp(const void * ptr1, const void * ptr2)
+{
+  map_elem_t * d1 = (map_elem_t *)ptr1;
+  map_elem_t * d2 = (map_elem_t *)ptr2;
+  return strcmp(d1->key, d2->key);
+}
+
+static void
+map_elem_free(void * ptr)
+{
+  map_elem_t * d = (map_elem_t *)ptr;
+  free(d->key);
+  free(d->repl);
+}
+
+/* ================================================================ */
+/* Replaces the subtitles map of s by the content of the map file:  */
+/* one "key replacement" pair per line, both can contain \u escapes */
+/* ================================================================ */
+static void
+map_load(ptylie_t * s, FILE * map)
+{
+  char line[256];
+  char key[256], repl[256];
+
+  rb_tree_remove_all(s->map_tree, map_elem_free);
+
+  while (!feof(map))
+  {
+    fscanf(map, "%255[^\n]\n", line);
+    line[255] = '\0';
+
+    if (sscanf(line, "%255[^ ] %255[^\n]\n", key, repl) != 2)
+      continue;
+    else
+    {
+      key[255] = repl[255] = '\0';
+
+      map_elem_t * elem = malloc(sizeof(map_elem_t));
+      elem->key         = strdup(key);
+      mb_interpret(elem->key);
+      elem->repl = strdup(repl);
+      mb_interpret(elem->repl);
+      rb_tree_insert(s->map_tree, elem);
+    }
+  }
+}
+
+/* ================================================================== */
+/* Initializes terminfo once in the parent and reads the sequences of */
+/* the named keys used by \K so that no terminfo work remains to be   */
+/* done while injecting.                                              */
+/* ================================================================== */
+static void
+init_terminfo(void)
+{
+  size_t i;
+  int    err;
+  char * p;
+
+  ti_cache_tree = new_rb_tree(map_elem_comp);
+
+  if (setupterm((char *)0, 1, &err) != 0)
+    return;
+
+  ti_ok = 1;
+
+  for (i = 0; i < sizeof(named_keys) / sizeof(named_keys[0]); i++)
+  {
+    p = tigetstr((char *)named_keys[i].capname);
+    if (p != NULL && p != (char *)-1)
+      named_keys[i].seq = strdup(p);
+  }
+}
+
+/* ================================================================= */
+/* Returns the sequence of bytes corresponding to the \T directive   */
+/* argument arg (capability name and parameters separated by spaces) */
+/* The result is computed the first time and then taken from a       */
+/* cache. An empty string is returned for unknown capabilities.      */
+/* arg is altered.                                                   */
+/* ================================================================= */
+static const char *
+ti_lookup(char * arg)
+{
+  map_elem_t   elem;
+  map_elem_t * pelem;
+  char *       v[10 + 1];
+  long         q[9];
+  char *       p;
+  char *       seq = "";
+  int          i = 0, j;
+
+  pthread_mutex_lock(&ti_lock);
+
+  elem.key = arg;
+  if ((pelem = rb_tree_search(ti_cache_tree, &elem)) != NULL)
+  {
+    pthread_mutex_unlock(&ti_lock);
+    return pelem->repl;
+  }
+
+  pelem      = malloc(sizeof(map_elem_t));
+  pelem->key = strdup(arg);
+
+  for (p = arg; i < 10;)
+  {
+    while (isspace(*(unsigned char *)p))
+      p++;
+    if (*p == '\0')
+      break;
+    v[i++] = p;
+    while (!isspace(*(unsigned char *)p) && *p != '\0')
+      ++p;
+    if (*p == '\0')
+      break;
+    *p++ = '\0';
+  }
+  v[i] = NULL;
+
+  if (ti_ok && i > 0 && (p = (char *)tigetstr(v[0])) != (char *)-1
+      && p != NULL)
+  {
+    char * end;
+
+    q[0] = q[1] = q[2] = q[3] = q[4] = q[5] = q[6] = q[7] = q[8] = 0L;
+
+    for (j = 1; j < i; j++)
+    {
+      q[j - 1] = strtol(v[j], &end, 0);
+      if (*end != '\0')
+        q[j - 1] = (long)v[j];
+    }
+
+    seq = tparm(p, q[0], q[1], q[2], q[3], q[4], q[5], q[6], q[7], q[8]);
+    if (seq == NULL)
+      seq = "";
+  }
+
+  pelem->repl = strdup(seq);
+  rb_tree_insert(ti_cache_tree, pelem);
+
+  pthread_mutex_unlock(&ti_lock);
+
+  return pelem->repl;
+}
+
+static int
+named_key_comp(const void * ptr1, const void * ptr2)
+{
+  return strcasecmp((const char *)ptr1, ((const named_key_t *)ptr2)->name);
+}
+
+/* =============================================================== */
+/* Returns the sequence of bytes emitted by the key named name     */
+/* (ex: Up, F5) or NULL if the key is unknown or absent from the   */
+/* terminfo description of the terminal.                           */
+/* =============================================================== */
+static const char *
+named_key_lookup(const char * name)
+{
+  named_key_t * key;
+
+  key = bsearch(name, named_keys, sizeof(named_keys) / sizeof(named_keys[0]),
+                sizeof(named_key_t), named_key_comp);
+
+  return key == NULL ? NULL : key->seq;
+}
+
+/* =================================================================== */
+/* Reads the command file until a complete unit (one or more bytes to  */
+/* inject) or a pause is found, the unit is left in s->buf and         */
+/* s->vbuf contains its subtitle representation if any.                */
+/* Manages also some special additional directives (\s, \S, ...)       */
+/* Returns UNIT_EOF, UNIT_INJECT, UNIT_SLEEP, UNIT_WAIT, UNIT_PAUSE,   */
+/* UNIT_NONE or PTYLIE_ESCRIPT if an invalid directive is found.       */
+/* =================================================================== */
+static int
+inject_parse(ptylie_t * s)
+{
+  int             rc;
+  int             i;
+  int             l, len;
+  int             n;
+  unsigned char   c;
+  unsigned char   scanf_buf[4096];
+  char            tmp[256];
+  char            rows[4], cols[4];
+  char *          format;
+  unsigned char * buf  = s->buf;
+  unsigned char * vbuf = s->vbuf;
+
+  for (;;)
+  {
+    rc = read(s->fdc, &c, 1);
+    if (rc == -1 && s->fdc != s->fd_client)
+      return UNIT_EOF;
+    if (rc == -1 && errno == EAGAIN)
+      return UNIT_NONE;
+    if (rc <= 0)
+    {
+      /* A control connection ends like an included file */
+      /* ''''''''''''''''''''''''''''''''''''''''''''''' */
+      if (s->fdc == s->fd_client)
+        s->fd_client = -1;
+
+      close(s->fdc);
+      s->fdc = stk_pop(&s->fd_stack);
+      trace_event(s, &s->trace_inj, "include end", trace_now(s), -1,
+                  "depth", s->fd_stack.nb, NULL, 0);
+      if (s->fdc == -1)
+        return UNIT_EOF;
+      else
+        continue;
+    }
+
+    s->c = c;
+
+    if (s->srt_on)
+      vbuf[0] = '\0';
+
+    if (!s->special)
+    {
+      if (c == '\\')
+      {
+        s->special = 1;
+        continue;
+      }
+
+      if (s->meta)
+      {
+        s->meta = 0;
+        buf[0]  = 0x1b;
+        buf[1]  = c;
+
+        if (s->srt_on)
+        {
+          strcpy((char *)vbuf, "ALT-");
+          vbuf[4] = toupper(c);
+          vbuf[5] = '\0';
+        }
+
+        l = 2;
+      }
+      else if (s->control)
+      {
+        s->control = 0;
+        buf[0]     = toupper(c) - '@';
+
+        if (s->srt_on)
+        {
+          vbuf[0] = '^';
+          vbuf[1] = toupper(c);
+          vbuf[2] = '\0';
+        }
+
+        l = 1;
+      }
+      else
+      {
+        buf[0] = c;
+        l      = mb_get_length(c);
+
+        if (l > 1)
+        {
+          int bread;
+          int bsofar = 0;
+          do
+          {
+            bread = arg_read(s->fdc, &buf[bsofar + 1], l - 1 - bsofar);
+            bsofar += bread;
+          } while (bsofar < l - 1 && bread > 0);
+        }
+      }
+    }
+    else
+    {
+      l          = 1;
+      s->special = 0;
+
+      switch (c)
+      {
+        case '\n':
+          return UNIT_PAUSE;
+
+        case '\\':
+          buf[0] = '\\';
+          break;
+
+        case 's': /* set new seep time between keytrokes        */
+        case 'S': /* sleep for the given amount of milliseconds */
+          get_arg(s->fdc, scanf_buf, &len);
+
+          /* \s[auto min max]: adaptive inter-key time */
+          /* ''''''''''''''''''''''''''''''''''''''''' */
+          if (c == 's' && strncmp((char *)scanf_buf, "[auto", 5) == 0)
+          {
+            long min = default_adapt_min;
+            long max = default_adapt_max;
+
+            n = sscanf((char *)scanf_buf + 5, "%ld %ld", &min, &max);
+            if (scanf_buf[len - 1] != ']' || min < 1 || max < min)
+              return error(s, PTYLIE_ESCRIPT, "Invalid \\s argument: %s",
+                           scanf_buf);
+
+            s->adapt_min = min * 1000000LL;
+            s->adapt_max = max * 1000000LL;
+            if (!s->adaptive)
+              s->adapt_ns = s->sleep_time * 1000000LL;
+            s->adaptive = 1;
+            adapt_pace(s, 0);
+            return UNIT_PAUSE;
+          }
+
+          n = sscanf((char *)scanf_buf, "[%5[0-9]]%n", tmp, &l);
+          if (n != 1)
+            return error(s, PTYLIE_ESCRIPT, "Invalid \\%c argument: %s", c,
+                         scanf_buf);
+
+          if (c == 'S')
+          {
+            long delay_ms = atol(tmp); /* milliseconds */
+
+            s->sleep_once.tv_sec  = delay_ms / 1000;
+            s->sleep_once.tv_nsec = (delay_ms % 1000) * 1000000L;
+            return UNIT_SLEEP;
+          }
+          else
+          {
+            s->adaptive   = 0;
+            s->sleep_time = atol(tmp); /* milliseconds */
+            s->sleep_ts.tv_sec  = s->sleep_time / 1000L;
+            s->sleep_ts.tv_nsec = (s->sleep_time % 1000L) * 1000000L;
+            return UNIT_PAUSE;
+          }
+
+        case 'w': /* wait for the child to read its input [raw 2000] */
+        {
+          char mode[8], ms[8];
+          long timeout = default_wait;
+
+          get_arg(s->fdc, scanf_buf, &len);
+          n = sscanf((char *)scanf_buf, "[%7[a-z]%7[ 0-9]", mode, ms);
+          if (n < 1 || len == 0 || scanf_buf[len - 1] != ']')
+            return error(s, PTYLIE_ESCRIPT, "Invalid \\w argument: %s",
+                         scanf_buf);
+          if (n == 2)
+            timeout = atol(ms);
+
+          if (strcmp(mode, "any") == 0)
+            s->wait_mode = READY_ANY;
+          else if (strcmp(mode, "raw") == 0)
+            s->wait_mode = READY_RAW;
+          else if (strcmp(mode, "cooked") == 0)
+            s->wait_mode = READY_COOKED;
+          else
+            return error(s, PTYLIE_ESCRIPT, "Invalid \\w argument: %s",
+                         scanf_buf);
+
+          s->wait_start = real_ns();
+          s->wait_end   = s->wait_start + timeout * 1000000LL;
+          return UNIT_WAIT;
+        }
+
+        case 'W': /* for terminal resizing (ex: [80x24] */
+          get_arg(s->fdc, scanf_buf, &len);
+          n = sscanf((char *)scanf_buf, "[%3[0-9]x%3[0-9]]", cols, rows);
+          if (n != 2)
+            return error(s, PTYLIE_ESCRIPT, "Invalid \\W argument: %s",
+                         scanf_buf);
+          {
+            long long t = trace_now(s);
+
+            ptylie_resize(s->target, atoi(cols), atoi(rows));
+            trace_event(s, &s->trace_inj, "resize", t, trace_now(s) - t,
+                        "cols", atoi(cols), "rows", atoi(rows));
+          }
+          return UNIT_PAUSE;
+
+        case 'R': /* include a bytes sequence form a given file, beware *
+                   * to trailing newlines.                              */
+        {
+          int fd_include;
+          get_arg(s->fdc, scanf_buf, &len);
+          if (scanf_buf[0] != '\0')
+          {
+            if (scanf_buf[strlen((char *)scanf_buf + 1)] == ']')
+              scanf_buf[strlen((char *)scanf_buf + 1)] = '\0';
+
+            if ((fd_include = open((char *)scanf_buf + 1, O_RDONLY | O_CLOEXEC))
+                == -1)
+            {
+              return error(s, PTYLIE_ESCRIPT, "Cannot open include file %s",
+                           scanf_buf + 1);
+            }
+            else if (stk_push(&s->fd_stack, s->fdc) == -1)
+            {
+              close(fd_include);
+              return error(s, PTYLIE_ESCRIPT, "Too many nested include files");
+            }
+            else
+            {
+              s->fdc = fd_include;
+              trace_event(s, &s->trace_inj, "include", trace_now(s), -1,
+                          "depth", s->fd_stack.nb, NULL, 0);
+              continue;
+            }
+          }
+        }
+        break;
+
+        case 'm': /* consider a new map file */
+        {
+          FILE * map;
+
+          get_arg(s->fdc, scanf_buf, &len);
+          if (scanf_buf[0] != '\0')
+          {
+            if (scanf_buf[strlen((char *)scanf_buf + 1)] == ']')
+              scanf_buf[strlen((char *)scanf_buf + 1)] = '\0';
+
+            if ((map = fopen((char *)scanf_buf + 1, "re")) == NULL)
+            {
+              return error(s, PTYLIE_ESCRIPT, "Cannot open map file %s",
+                           scanf_buf + 1);
+            }
+            else
+            {
+              long long t = trace_now(s);
+
+              map_load(s, map);
+              trace_event(s, &s->trace_inj, "map load", t, trace_now(s) - t,
+                          "bytes", ftello(map), NULL, 0);
+              fclose(map);
+              s->map_on = 1;
+              continue;
+            }
+          }
+        }
+
+        break;
+
+        case 'x': /* Arbitrary hexadecimal sequence (max 256) */
+        case 'u': /* for raw hexadecimal UTF-8 injection \u[xx[yy[zz[tt]]]]*/
+          if (c == 'x')
+            format = "[%256[0-9a-fA-F]]%n";
+          else
+            format = "[%8[0-9a-fA-F]]%n";
+
+          get_arg(s->fdc, scanf_buf, &len);
+          n = sscanf((char *)scanf_buf, format, tmp, &l);
+
+          if (n != 1)
+            return error(s, PTYLIE_ESCRIPT, "Invalid sequence: %s", scanf_buf);
+
+          if (l < 2 || l % 2 == 1)
+            return error(s, PTYLIE_ESCRIPT, "Invalid hexadecimal sequence: %s",
+                         scanf_buf);
+
+          for (i = 0; i < (l - 2) / 2; i++)
+          {
+            unsigned char charhex[3] = { tmp[i * 2], tmp[i * 2 + 1], 0 };
+            tmp[i] = (unsigned char)strtol((char *)charhex, NULL, 16);
+          }
+
+          l      = (l - 2) / 2;
+          tmp[l] = '\0';
+          memcpy(buf, tmp, l);
+
+          break;
+
+        case 'T': /* terminfo capability \T[capname [param...]] */
+        {
+          const char * seq;
+
+          get_arg(s->fdc, scanf_buf, &len);
+          n = sscanf((char *)scanf_buf, "[%255[^]]]", tmp);
+          if (n != 1)
+            tmp[0] = '\0';
+
+          seq = ti_lookup(tmp);
+          l   = strlen(seq);
+          if (l == 0)
+            return UNIT_PAUSE;
+          memcpy(buf, seq, l);
+        }
+        break;
+
+        case 'K': /* named key \K[name] (ex: Up, F5) */
+        {
+          const char * seq;
+
+          get_arg(s->fdc, scanf_buf, &len);
+          n = sscanf((char *)scanf_buf, "[%255[^]]]", tmp);
+          if (n != 1 || (seq = named_key_lookup(tmp)) == NULL)
+            return UNIT_PAUSE;
+
+          l = strlen(seq);
+          memcpy(buf, seq, l);
+
+          if (s->srt_on)
+            strcpy((char *)vbuf, tmp);
+        }
+        break;
+
+        case 'c': /* colour setting \c[x;y;z] */
+          buf[0] = 0x1b;
+          buf[1] = '[';
+          l      = 2;
+          get_arg(s->fdc, scanf_buf, &len);
+          n = sscanf((char *)scanf_buf, "[%8[0-9;]]", tmp);
+          if (n != 1)
+            return error(s, PTYLIE_ESCRIPT, "Invalid \\c argument: %s",
+                         scanf_buf);
+
+          while (l < len)
+          {
+            buf[l] = tmp[l - 2];
+            l++;
+          }
+          buf[l] = 'm';
+          l++;
+          break;
+
+        case 'k': /* keys as subtitle on/off */
+          if (s->srt == NULL)
+            s->srt = fopen(s->srt_file, "we");
+
+          s->srt_on = !s->srt_on;
+          continue;
+
+        case 'P': /* marker \P[name] */
+          get_arg(s->fdc, scanf_buf, &l);
+          n = sscanf((char *)scanf_buf, "[%63[^]]]", tmp);
+          if (n != 1)
+            return error(s, PTYLIE_ESCRIPT, "Invalid \\P argument: %s",
+                         scanf_buf);
+
+          if (s->marks_nb == s->marks_max)
+          {
+            unsigned max   = s->marks_max > 0 ? s->marks_max * 2 : 16;
+            mark_t * marks = realloc(s->marks, max * sizeof *marks);
+
+            if (marks != NULL)
+            {
+              s->marks     = marks;
+              s->marks_max = max;
+            }
+          }
+          if (s->marks_nb < s->marks_max)
+          {
+            strcpy(s->marks[s->marks_nb].name, tmp);
+            s->marks[s->marks_nb++].ns = real_ns() - s->spawned;
+          }
+
+          if (s->sample != NULL)
+            sample_marker(s, tmp);
+
+          /* The screen is dumped at each marker when it is modeled */
+          /* '''''''''''''''''''''''''''''''''''''''''''''''''''''' */
+          pthread_mutex_lock(&s->vt_lock);
+          strcpy(s->marker, tmp);
+          if (s->vt != NULL)
+            screen_dump(s, s->marker);
+          pthread_mutex_unlock(&s->vt_lock);
+          continue;
+
+        case '?': /* status query, only meaningful on a control connection */
+          control_status(s);
+          continue;
+
+        case '@': /* injection target \@[name], \@[] for the session */
+          get_arg(s->fdc, scanf_buf, &l);
+          if (strcmp((char *)scanf_buf, "[]") == 0)
+            i = -1;
+          else
+          {
+            n = sscanf((char *)scanf_buf, "[%31[^]]]", tmp);
+            if (n != 1)
+              return error(s, PTYLIE_ESCRIPT, "Invalid \\@ argument: %s",
+                           scanf_buf);
+
+            for (i = 0; i < (int)s->targets_nb; i++)
+              if (strcmp(s->targets[i].name, tmp) == 0)
+                break;
+            if (i == (int)s->targets_nb)
+              return error(s, PTYLIE_ESCRIPT, "Unknown target: %s", tmp);
+          }
+
+          s->target = i < 0 ? s : s->targets[i].s;
+          trace_event(s, &s->trace_inj, "target", trace_now(s), -1,
+                      "index", i + 1, NULL, 0);
+          continue;
+
+        case 'M':
+          s->meta = 1;
+          continue;
+
+        case 'C':
+          s->control = 1;
+          continue;
+
+        case '%':
+          break;
+
+        case 'r':
+          buf[0] = '\r';
+          break;
+
+        case '\"':
+          buf[0] = '"';
+          if (s->srt_on)
+            break;
+          /* fall through */
+
+        case '\'':
+          buf[0] = '\'';
+          if (s->srt_on)
+            break;
+
+        case 'a': /* ignored */
+          continue;
+
+        case 't':
+          buf[0] = '\t';
+          break;
+
+        case 'n':
+          buf[0] = '\n';
+          break;
+
+        case 'e':
+          buf[0] = 0x1b;
+          break;
+
+        case 'b':
+        case 'h':
+          buf[0] = '\b';
+          break;
+      }
+    }
+
+    /* Close the buffer, it is ready to be injected */
+    /* """""""""""""""""""""""""""""""""""""""""""" */
+    buf[l] = '\0';
+    s->l   = l;
+
+    return UNIT_INJECT;
+  }
+}
+
+/* ================================================================= */
+/* Injects the unit prepared by inject_parse in the slave's keyboard */
+/* buffer, we need to have root privileges to do that.               */
+/* Also generates the corresponding subtitle if needed.              */
+/* Returns PTYLIE_OK or PTYLIE_ESYS.                                 */
+/* ================================================================= */
+static int
+inject_unit(ptylie_t * s)
+{
+  unsigned char * buf  = s->buf;
+  unsigned char * vbuf = s->vbuf;
+  int             l    = s->l;
+
+  char * v_empty = "";
+  char * v_space = "\xe2\x90\xa3";
+  char * v_ht    = "\xe2\x87\xa5";
+  char * v_lf    = "\xe2\x8f\x8e";
+  char * v_cr    = "\xe2\x90\x8d";
+  char * v_bs    = "\xe2\x8c\xab";
+  char * v_esc   = "ESC";
+
+  char * srt_buf_prt = v_empty;
+
+  if (l > 1)
+  {
+    unsigned char * p;
+    for (p = buf; *p; p++)
+      if (ioctl(s->target->fd_slave, TIOCSTI, p) < 0)
+        return error(s, PTYLIE_ESYS, "Error %d on ioctl(TIOCSTI)", errno);
+
+    if (s->srt_on)
+    {
+      if (*vbuf != '\0')
+        add_srt_entry(s, (char *)vbuf);
+      else if (mb_validate((char *)buf, l))
+        add_srt_entry(s, (char *)buf);
+    }
+  }
+  else
+  {
+    if (s->srt_on)
+    {
+      if (*vbuf != '\0')
+        add_srt_entry(s, (char *)vbuf);
+      else if (isgraph(buf[0]))
+        add_srt_entry(s, (char *)buf);
+      else
+      {
+        if (!s->map_on)
+        {
+          switch (buf[0])
+          {
+            case ' ':
+              srt_buf_prt = v_space;
+              break;
+
+            case 0x09:
+              srt_buf_prt = v_ht;
+              break;
+
+            case 0x0d:
+              srt_buf_prt = v_cr;
+              break;
+
+            case 0x0a:
+              srt_buf_prt = v_lf;
+              break;
+
+            case 0x1b:
+              srt_buf_prt = v_esc;
+              break;
+
+            case '\b':
+            case 0x7f:
+              srt_buf_prt = v_bs;
+              break;
+
+            default:
+              sprintf((char *)vbuf, "<0x%2x>", s->c);
+              srt_buf_prt = (char *)vbuf;
+              break;
+          }
+          add_srt_entry(s, srt_buf_prt);
+        }
+      }
+    }
+
+    if (ioctl(s->target->fd_slave, TIOCSTI, buf) < 0)
+      return error(s, PTYLIE_ESYS, "Error %d on ioctl(TIOCSTI)", errno);
+  }
+
+  s->injected += l;
+  s->inj_stats.units++;
+  s->inj_stats.bytes += l;
+
+  return PTYLIE_OK;
+}
+
+/* ================================================================= */
+/* Accepts a pending connection on the control socket, if any, and  */
+/* makes it the current command file. The interrupted command file  */
+/* is resumed when the peer closes the connection, as with \R.      */
+/* Only one connection is played at a time, the others wait in the  */
+/* listen queue.                                                    */
+/* ================================================================= */
+static void
+control_accept(ptylie_t * s)
+{
+  int fd;
+
+  if (s->fd_ctl == -1 || s->fd_client != -1)
+    return;
+
+  pthread_mutex_lock(&spawn_lock);
+  fd = accept(s->fd_ctl, NULL, NULL);
+  if (fd != -1)
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  pthread_mutex_unlock(&spawn_lock);
+
+  if (fd == -1)
+    return;
+
+  /* An idle peer must not block the injection thread */
+  /* """""""""""""""""""""""""""""""""""""""""""""""" */
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  if (s->fdc != -1 && stk_push(&s->fd_stack, s->fdc) == -1)
+  {
+    close(fd);
+    return;
+  }
+
+  s->fdc       = fd;
+  s->fd_client = fd;
+
+  trace_event(s, &s->trace_inj, "control connection", trace_now(s), -1,
+              "depth", s->fd_stack.nb, NULL, 0);
+}
+
+/* ================================================================= */
+/* Answers a \? directive read from a control connection with a      */
+/* single line describing the session.                               */
+/* ================================================================= */
+static void
+control_status(ptylie_t * s)
+{
+  char line[256];
+  int  n;
+
+  if (s->fdc != s->fd_client)
+    return;
+
+  n = snprintf(line, sizeof line, "pid=%ld size=%ux%u injected=%lu marker=%s\n",
+               (long)s->pid, s->width, s->height, s->injected,
+               *s->marker ? s->marker : "-");
+
+  write(s->fd_client, line, n);
+}
+
+/* ================================================================= */
+/* Removes the control socket at path. As the program can be setuid, */
+/* only a socket of the real user is removed, -1 is returned if path */
+/* is any other file.                                                */
+/* ================================================================= */
+static int
+control_unlink(const char * path)
+{
+  struct stat st;
+
+  if (lstat(path, &st) == -1)
+    return errno == ENOENT ? 0 : -1;
+
+  if (!S_ISSOCK(st.st_mode) || st.st_uid != getuid())
+    return -1;
+
+  return unlink(path);
+}
+
+/* ================================================================ */
+/* Returns the number of ms elapsed since ptylie_screen was called. */
+/* ================================================================ */
+static long
+screen_time(ptylie_t * s)
+{
+  struct timespec now;
+
+  clock_now(s, &now);
+
+  return (now.tv_sec - s->snap_start.tv_sec) * 1000
+         + (now.tv_nsec - s->snap_start.tv_nsec) / 1000000;
+}
+
+/* ================================================================ */
+/* Writes a snapshot of the screen model, vt_lock must be held.     */
+/* ================================================================ */
+static void
+screen_dump(ptylie_t * s, const char * marker)
+{
+  s->snap_last = screen_time(s);
+  vt_dump(s->vt, s->snap, s->snap_json, s->snap_last, marker);
+  fflush(s->snap);
+}
+
+/* ================================================================ */
+/* Returns the index of the bucket of the read size histogram       */
+/* counting the reads of size bytes.                                */
+/* ================================================================ */
+static int
+read_bucket(ssize_t size)
+{
+  int i;
+
+  for (i = 0; i < (int)READ_BUCKETS - 1; i++)
+    if (size <= read_bounds[i])
+      break;
+
+  return i;
+}
+
+/* ================================================================ */
+/* Writes a counter in the format of ptylie_stats.                  */
+/* ================================================================ */
+static void
+stats_counter(FILE * out, int format, const char * name,
+              const char * help, unsigned long long value)
+{
+  if (format == PTYLIE_STATS_OPENMETRICS)
+    fprintf(out,
+            "# TYPE ptylie_%s counter\n"
+            "# HELP ptylie_%s %s\n"
+            "ptylie_%s_total %llu\n",
+            name, name, help, name, value);
+  else
+    fprintf(out, "%s=%llu\n", name, value);
+}
+
+/* ================================================================ */
+/* Writes a counter of ns in seconds in the format of ptylie_stats. */
+/* ================================================================ */
+static void
+stats_seconds(FILE * out, int format, const char * name,
+              const char * help, unsigned long long ns)
+{
+  if (format == PTYLIE_STATS_OPENMETRICS)
+    fprintf(out,
+            "# TYPE ptylie_%s_seconds counter\n"
+            "# UNIT ptylie_%s_seconds seconds\n"
+            "# HELP ptylie_%s_seconds %s\n"
+            "ptylie_%s_seconds_total %llu.%09llu\n",
+            name, name, name, help, name, ns / 1000000000ULL,
+            ns % 1000000000ULL);
+  else
+    fprintf(out, "%s_seconds=%llu.%09llu\n", name, ns / 1000000000ULL,
+            ns % 1000000000ULL);
+}
+
+static int
+ll_comp(const void * ptr1, const void * ptr2)
+{
+  long long v1 = *(const long long *)ptr1;
+  long long v2 = *(const long long *)ptr2;
+
+  return (v1 > v2) - (v1 < v2);
+}
+
+/* ================================================================ */
+/* Returns the time of the recording clock in s since the spawn of  */
+/* the child, the time base of the timing file.                     */
+/* ================================================================ */
+static double
+sample_time(ptylie_t * s)
+{
+  struct timespec now;
+
+  clock_now(s, &now);
+
+  return (now.tv_sec * 1000000000LL + now.tv_nsec - s->spawned) / 1e9;
+}
+
+/* ================================================================ */
+/* Adds the resources used by the process tree of the child to sum: */
+/* the processes are found through their parent in /proc/pid/stat. */
+/* ================================================================ */
+static void
+sample_tree(ptylie_t * s, sample_t * sum)
+{
+#if defined(__linux__)
+  static long     tick, page;
+  DIR *           dir;
+  struct dirent * ent;
+  pid_t *         pids = NULL, *ppids = NULL, pid;
+  char *          in   = NULL;
+  size_t          nb = 0, max = 0, i;
+  int             more;
+  char            path[64], line[512], *p;
+  FILE *          f;
+
+  if (tick == 0)
+  {
+    tick = sysconf(_SC_CLK_TCK);
+    page = sysconf(_SC_PAGESIZE) / 1024;
+  }
+
+  if ((dir = opendir("/proc")) == NULL)
+    return;
+
+  /* Parent of each process */
+  /* '''''''''''''''''''''' */
+  while ((ent = readdir(dir)) != NULL)
+  {
+    if ((pid = atoi(ent->d_name)) <= 0)
+      continue;
+
+    snprintf(path, sizeof path, "/proc/%ld/stat", (long)pid);
+    if ((f = fopen(path, "re")) == NULL)
+      continue;
+    p = fgets(line, sizeof line, f);
+    fclose(f);
+    if (p == NULL || (p = strrchr(line, ')')) == NULL)
+      continue;
+
+    if (nb == max)
+    {
+      max   = max > 0 ? max * 2 : 512;
+      pids  = realloc(pids, max * sizeof *pids);
+      ppids = realloc(ppids, max * sizeof *ppids);
+      if (pids == NULL || ppids == NULL)
+        break;
+    }
+    pids[nb] = pid;
+    if (sscanf(p + 2, "%*c %d", &ppids[nb]) == 1)
+      nb++;
+  }
+  closedir(dir);
+
+  /* Descendants of the child, until no more are found */
+  /* ''''''''''''''''''''''''''''''''''''''''''''''''' */
+  if (pids != NULL && ppids != NULL && (in = calloc(nb + 1, 1)) != NULL)
+    do
+    {
+      more = 0;
+      for (i = 0; i < nb; i++)
+        if (!in[i] && pids[i] == s->pid)
+          in[i] = more = 1;
+        else if (!in[i])
+        {
+          size_t j;
+
+          for (j = 0; j < nb; j++)
+            if (in[j] && pids[j] == ppids[i])
+            {
+              in[i] = more = 1;
+              break;
+            }
+        }
+    } while (more);
+
+  for (i = 0; in != NULL && i < nb; i++)
+  {
+    unsigned long      utime, stime;
+    long               cutime, cstime, rss;
+    unsigned long long v;
+
+    if (!in[i])
+      continue;
+
+    snprintf(path, sizeof path, "/proc/%ld/stat", (long)pids[i]);
+    if ((f = fopen(path, "re")) == NULL)
+      continue;
+    p = fgets(line, sizeof line, f);
+    fclose(f);
+    if (p == NULL || (p = strrchr(line, ')')) == NULL
+        || sscanf(p + 2,
+                  "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %ld "
+                  "%ld %*d %*d %*d %*d %*u %*u %ld",
+                  &utime, &stime, &cutime, &cstime, &rss)
+             != 5)
+      continue;
+
+    sum->procs++;
+    sum->cpu += (double)(utime + stime + cutime + cstime) / tick;
+    sum->rss += rss * page;
+
+    snprintf(path, sizeof path, "/proc/%ld/status", (long)pids[i]);
+    if ((f = fopen(path, "re")) != NULL)
+    {
+      while (fgets(line, sizeof line, f) != NULL)
+        if (sscanf(line, "voluntary_ctxt_switches: %llu", &v) == 1)
+          sum->vcsw += v;
+        else if (sscanf(line, "nonvoluntary_ctxt_switches: %llu", &v) == 1)
+          sum->ivcsw += v;
+      fclose(f);
+    }
+
+    snprintf(path, sizeof path, "/proc/%ld/io", (long)pids[i]);
+    if ((f = fopen(path, "re")) != NULL)
+    {
+      while (fgets(line, sizeof line, f) != NULL)
+        if (sscanf(line, "rchar: %llu", &v) == 1)
+          sum->rchar += v;
+        else if (sscanf(line, "wchar: %llu", &v) == 1)
+          sum->wchar += v;
+      fclose(f);
+    }
+  }
+
+  free(pids);
+  free(ppids);
+  free(in);
+#endif
+}
+
+/* ================================================================ */
+/* Writes a \P marker in the samples file.                          */
+/* ================================================================ */
+static void
+sample_marker(ptylie_t * s, const char * name)
+{
+  const unsigned char * p;
+
+  pthread_mutex_lock(&s->sample_lock);
+
+  fprintf(s->sample, "{\"t\":%.6f,\"marker\":\"", sample_time(s));
+  for (p = (const unsigned char *)name; *p; p++)
+    if (*p == '"' || *p == '\\')
+      fprintf(s->sample, "\\%c", *p);
+    else if (*p < 0x20)
+      fprintf(s->sample, "\\u%04x", *p);
+    else
+      fputc(*p, s->sample);
+  fputs("\"}\n", s->sample);
+  fflush(s->sample);
+
+  pthread_mutex_unlock(&s->sample_lock);
+}
+
+/* ================================================================ */
+/* Thread function writing a sample of the resources used by the    */
+/* process tree of the child every s->sample_every ms, with the CPU */
+/* usage since the previous one, until sample_stop is set.          */
+/* ================================================================ */
+static void *
+sampler(void * args)
+{
+  ptylie_t *      s = args;
+  sample_t        sum;
+  struct timespec end;
+  double          t, prev_t = 0, prev_cpu = 0;
+
+  pthread_mutex_lock(&s->sample_lock);
+
+  while (!s->sample_stop)
+  {
+    if (s->pid != -1 && !s->reaped)
+    {
+      pthread_mutex_unlock(&s->sample_lock);
+      memset(&sum, 0, sizeof sum);
+      sample_tree(s, &sum);
+      t = sample_time(s);
+      pthread_mutex_lock(&s->sample_lock);
+
+      fprintf(s->sample,
+              "{\"t\":%.6f,\"procs\":%d,\"cpu\":%.3f,\"cpu_pct\":%.1f,"
+              "\"rss_kb\":%ld,\"vcsw\":%llu,\"ivcsw\":%llu,"
+              "\"read_bytes\":%llu,\"write_bytes\":%llu}\n",
+              t, sum.procs, sum.cpu,
+              t > prev_t ? (sum.cpu - prev_cpu) * 100 / (t - prev_t) : 0,
+              sum.rss, sum.vcsw, sum.ivcsw, sum.rchar, sum.wchar);
+      fflush(s->sample);
+      prev_t   = t;
+      prev_cpu = sum.cpu;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += s->sample_every / 1000;
+    end.tv_nsec += (s->sample_every % 1000) * 1000000L;
+    if (end.tv_nsec >= 1000000000L)
+    {
+      end.tv_sec++;
+      end.tv_nsec -= 1000000000L;
+    }
+
+    while (!s->sample_stop
+           && pthread_cond_timedwait(&s->sample_cond, &s->sample_lock, &end)
+                != ETIMEDOUT)
+      ;
+  }
+
+  pthread_mutex_unlock(&s->sample_lock);
+
+  return NULL;
+}
+
+/* ================================================================ */
+/* Stops the sampler and closes the samples file.                   */
+/* ================================================================ */
+static void
+sample_end(ptylie_t * s)
+{
+  pthread_mutex_lock(&s->sample_lock);
+  s->sample_stop = 1;
+  pthread_cond_broadcast(&s->sample_cond);
+  pthread_mutex_unlock(&s->sample_lock);
+
+  pthread_join(s->sample_thread, NULL);
+
+  fclose(s->sample);
+  s->sample = NULL;
+}
+
+/* ================================================================ */
+/* Writes the 50th, 90th and 99th percentiles and the maximum of    */
+/* the n values of v (sorted in place) in the format of             */
+/* ptylie_stats: a summary in OpenMetrics. ns tells if the values   */
+/* are ns to be written in seconds.                                 */
+/* ================================================================ */
+static void
+stats_quantiles(FILE * out, int format, const char * name,
+                const char * help, long long * v, size_t n, int ns)
+{
+  static const double q[]  = { 0.5, 0.9, 0.99, 1 };
+  static const char * qn[] = { "p50", "p90", "p99", "max" };
+  const char *        unit = ns ? "_seconds" : "";
+  double              div  = ns ? 1e9 : 1;
+  long long           sum  = 0;
+  size_t              i;
+
+  if (n == 0)
+    return;
+
+  qsort(v, n, sizeof *v, ll_comp);
+  for (i = 0; i < n; i++)
+    sum += v[i];
+
+  if (format == PTYLIE_STATS_OPENMETRICS)
+  {
+    fprintf(out, "# TYPE ptylie_%s%s summary\n", name, unit);
+    if (ns)
+      fprintf(out, "# UNIT ptylie_%s%s seconds\n", name, unit);
+    fprintf(out, "# HELP ptylie_%s%s %s\n", name, unit, help);
+  }
+
+  for (i = 0; i < sizeof q / sizeof *q; i++)
+  {
+    long long value = v[(size_t)(q[i] * (n - 1) + 0.5)];
+
+    if (format == PTYLIE_STATS_OPENMETRICS)
+      fprintf(out, "ptylie_%s%s{quantile=\"%g\"} %.9g\n", name, unit, q[i],
+              value / div);
+    else
+      fprintf(out, "%s%s_%s=%.9g\n", name, unit, qn[i], value / div);
+  }
+
+  if (format == PTYLIE_STATS_OPENMETRICS)
+    fprintf(out, "ptylie_%s%s_count %zu\nptylie_%s%s_sum %.9g\n", name,
+            unit, n, name, unit, sum / div);
+}
+
+/* ================================================================ */
+/* Returns the time of the trace in us, 0 if the session is not     */
+/* traced.                                                          */
+/* ================================================================ */
+static long long
+trace_now(ptylie_t * s)
+{
+  if (s->trace == NULL)
+    return 0;
+
+  return (real_ns() - s->trace_start) / 1000;
+}
+
+/* ================================================================ */
+/* Records an event in the buffer of the side of the session of the */
+/* calling thread, *pbuf is s->trace_out or s->trace_inj.           */
+/* ================================================================ */
+static void
+trace_event(ptylie_t * s, trace_buf_t ** pbuf, const char * name,
+            long long ts, long long dur, const char * arg1, long long val1,
+            const char * arg2, long long val2)
+{
+  trace_ev_t * ev;
+
+  if (s->trace == NULL)
+    return;
+
+  ev       = &(*pbuf)->ev[(*pbuf)->nb++];
+  ev->name = name;
+  ev->ts   = ts;
+  ev->dur  = dur;
+  ev->arg1 = arg1;
+  ev->val1 = val1;
+  ev->arg2 = arg2;
+  ev->val2 = val2;
+
+  if ((*pbuf)->nb == TRACE_EVENTS)
+    trace_swap(s, pbuf);
+}
+
+/* ================================================================ */
+/* Queues the buffer *pbuf for trace_writer and replaces it by an   */
+/* empty one.                                                       */
+/* ================================================================ */
+static void
+trace_swap(ptylie_t * s, trace_buf_t ** pbuf)
+{
+  trace_buf_t * buf = *pbuf;
+  trace_buf_t * empty;
+
+  pthread_mutex_lock(&s->trace_lock);
+
+  buf->next = NULL;
+  if (s->trace_tail != NULL)
+    s->trace_tail->next = buf;
+  else
+    s->trace_head = buf;
+  s->trace_tail = buf;
+
+  if ((empty = s->trace_free) != NULL)
+    s->trace_free = empty->next;
+
+  pthread_cond_signal(&s->trace_cond);
+  pthread_mutex_unlock(&s->trace_lock);
+
+  if (empty == NULL && (empty = malloc(sizeof(trace_buf_t))) == NULL)
+  {
+    /* Out of memory, wait for trace_writer to give one back */
+    /* ''''''''''''''''''''''''''''''''''''''''''''''''''''' */
+    pthread_mutex_lock(&s->trace_lock);
+    while ((empty = s->trace_free) == NULL)
+      pthread_cond_wait(&s->trace_cond, &s->trace_lock);
+    s->trace_free = empty->next;
+    pthread_mutex_unlock(&s->trace_lock);
+  }
+
+  empty->tid = buf->tid;
+  empty->nb  = 0;
+  *pbuf      = empty;
+}
+
+/* ================================================================ */
+/* Writes the events of buf in the Chrome trace event format.       */
+/* ================================================================ */
+static void
+trace_write(ptylie_t * s, trace_buf_t * buf)
+{
+  trace_ev_t * ev;
+  int          i;
+
+  for (i = 0; i < buf->nb; i++)
+  {
+    ev = &buf->ev[i];
+
+    fprintf(s->trace, ",\n{\"name\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%lld,",
+            ev->name, buf->tid, ev->ts);
+
+    if (ev->dur >= 0)
+      fprintf(s->trace, "\"ph\":\"X\",\"dur\":%lld", ev->dur);
+    else
+      fprintf(s->trace, "\"ph\":\"i\",\"s\":\"t\"");
+
+    if (ev->arg2 != NULL)
+      fprintf(s->trace, ",\"args\":{\"%s\":%lld,\"%s\":%lld}}", ev->arg1,
+              ev->val1, ev->arg2, ev->val2);
+    else if (ev->arg1 != NULL)
+      fprintf(s->trace, ",\"args\":{\"%s\":%lld}}", ev->arg1, ev->val1);
+    else
+      fputc('}', s->trace);
+  }
+}
+
+/* ================================================================ */
+/* Thread writing the buffers queued by trace_swap until trace_end. */
+/* ================================================================ */
+static void *
+trace_writer(void * args)
+{
+  ptylie_t *    s = args;
+  trace_buf_t * buf;
+
+  pthread_mutex_lock(&s->trace_lock);
+  for (;;)
+  {
+    while (s->trace_head == NULL && !s->trace_stop)
+      pthread_cond_wait(&s->trace_cond, &s->trace_lock);
+
+    if ((buf = s->trace_head) == NULL)
+      break;
+
+    if ((s->trace_head = buf->next) == NULL)
+      s->trace_tail = NULL;
+    pthread_mutex_unlock(&s->trace_lock);
+
+    trace_write(s, buf);
+    fflush(s->trace);
+
+    pthread_mutex_lock(&s->trace_lock);
+    buf->next     = s->trace_free;
+    s->trace_free = buf;
+    pthread_cond_broadcast(&s->trace_cond);
+  }
+  pthread_mutex_unlock(&s->trace_lock);
+
+  return NULL;
+}
+
+/* ================================================================ */
+/* Writes the pending events and closes the trace. Neither side of  */
+/* the session may be running.                                      */
+/* ================================================================ */
+static void
+trace_end(ptylie_t * s)
+{
+  trace_buf_t * buf;
+
+  trace_swap(s, &s->trace_out);
+  trace_swap(s, &s->trace_inj);
+
+  pthread_mutex_lock(&s->trace_lock);
+  s->trace_stop = 1;
+  pthread_cond_broadcast(&s->trace_cond);
+  pthread_mutex_unlock(&s->trace_lock);
+
+  pthread_join(s->trace_thread, NULL);
+
+  fprintf(s->trace, "\n]\n");
+  fclose(s->trace);
+  s->trace = NULL;
+
+  free(s->trace_out);
+  free(s->trace_inj);
+  while ((buf = s->trace_free) != NULL)
+  {
+    s->trace_free = buf->next;
+    free(buf);
+  }
+}
+
+/* ================================================================ */
+/* Records the unit about to be injected as the start of a new      */
+/* burst, before the injection so that its echo cannot be missed.   */
+/* ================================================================ */
+static void
+latency_key(ptylie_t * s)
+{
+  lat_key_t * k;
+
+  pthread_mutex_lock(&s->lat_lock);
+
+  if (s->lat_nb == s->lat_max)
+  {
+    size_t      max  = s->lat_max > 0 ? s->lat_max * 2 : 256;
+    lat_key_t * keys = realloc(s->lat_keys, max * sizeof *keys);
+
+    if (keys == NULL)
+    {
+      pthread_mutex_unlock(&s->lat_lock);
+      return;
+    }
+    s->lat_keys = keys;
+    s->lat_max  = max;
+  }
+
+  k         = &s->lat_keys[s->lat_nb++];
+  k->inject = real_ns();
+  k->first  = 0;
+  k->last   = 0;
+  k->bytes  = 0;
+  k->ended  = 0;
+  k->len    = s->l;
+  memcpy(k->key, s->buf, s->l < 8 ? s->l : 8);
+
+  pthread_mutex_unlock(&s->lat_lock);
+}
+
+/* ================================================================ */
+/* Adds len bytes read at now to the burst of the last key unless   */
+/* the output has been quiet for idle_quiet ns since its last byte. */
+/* ================================================================ */
+static void
+latency_output(ptylie_t * s, long long now, ssize_t len)
+{
+  lat_key_t * k;
+
+  pthread_mutex_lock(&s->lat_lock);
+
+  if (s->lat_nb > 0 && !(k = &s->lat_keys[s->lat_nb - 1])->ended)
+  {
+    if (k->first == 0)
+      k->first = now;
+    else if (now - k->last > idle_quiet)
+      k->ended = 1;
+
+    if (!k->ended)
+    {
+      k->last = now;
+      k->bytes += len;
+    }
+  }
+
+  pthread_mutex_unlock(&s->lat_lock);
+}
+
+/* ================================================================ */
+/* Writes the CSV file of the latency profile and closes it, the    */
+/* keys are kept for ptylie_stats. Neither side may be running.     */
+/* ================================================================ */
+static void
+latency_end(ptylie_t * s)
+{
+  size_t i;
+
+  fprintf(s->lat, "key,time,bytes_in,first_byte_ms,quiet_ms,bytes_out\n");
+
+  for (i = 0; i < s->lat_nb; i++)
+  {
+    lat_key_t * k = &s->lat_keys[i];
+
+    csv_key(s->lat, k->key, k->len);
+    fprintf(s->lat, ",%.6f,%d,", (k->inject - s->lat_keys[0].inject) / 1e9,
+            k->len);
+    if (k->first > 0)
+      fprintf(s->lat, "%.3f,%.3f", (k->first - k->inject) / 1e6,
+              (k->last - k->inject) / 1e6);
+    else
+      fputc(',', s->lat);
+    fprintf(s->lat, ",%lu\n", k->bytes);
+  }
+
+  fclose(s->lat);
+  s->lat = NULL;
+}
+
+/* ================================================================ */
+/* Writes the first 8 bytes of a key injected as a quoted CSV       */
+/* field, the non printable bytes as \xhh.                          */
+/* ================================================================ */
+static void
+csv_key(FILE * out, const unsigned char * key, int len)
+{
+  int i;
+
+  fputc('"', out);
+  for (i = 0; i < len && i < 8; i++)
+  {
+    if (key[i] == '"')
+      fputs("\"\"", out);
+    else if (key[i] == '\\')
+      fputs("\\\\", out);
+    else if (key[i] >= 0x20 && key[i] < 0x7f)
+      fputc(key[i], out);
+    else
+      fprintf(out, "\\x%02x", key[i]);
+  }
+  fputc('"', out);
+}
+
+/* ================================================================ */
+/* Writes the render cost of the output which followed the previous */
+/* unit and, if next is 1, starts the unit about to be injected.   */
+/* ================================================================ */
+static void
+render_unit(ptylie_t * s, int next)
+{
+  vt_cost_t * c = &s->render_cost;
+  vt_cost_t * b = &s->render_base;
+  long long   text, ctrl;
+
+  pthread_mutex_lock(&s->render_lock);
+
+  text = c->text - b->text;
+  ctrl = c->control - b->control;
+
+  csv_key(s->render, s->render_key, s->render_len);
+  fprintf(s->render, ",%.6f,%d,%lld,%lld,%lld,%lu,%lu,%lu,%lu,%lu,",
+          (s->render_inject - s->render_start) / 1e9, s->render_len,
+          text + ctrl, text, ctrl, c->clears - b->clears,
+          c->erases - b->erases, c->moves - b->moves,
+          c->scrolls - b->scrolls, c->sgr - b->sgr);
+  if (text + ctrl > 0)
+    fprintf(s->render, "%.3f\n", (double)text / (text + ctrl));
+  else
+    fputc('\n', s->render);
+
+  *b = *c;
+  if (next)
+  {
+    s->render_inject = real_ns();
+    s->render_len    = s->l;
+    memcpy(s->render_key, s->buf, s->l < 8 ? s->l : 8);
+  }
+
+  pthread_mutex_unlock(&s->render_lock);
+}
+
+/* ================================================================ */
+/* Writes the last unit of the render cost analysis and closes its  */
+/* file, the totals are kept for ptylie_stats. Neither side may be  */
+/* running.                                                         */
+/* ================================================================ */
+static void
+render_end(ptylie_t * s)
+{
+  render_unit(s, 0);
+
+  fclose(s->render);
+  s->render = NULL;
+}
+
+/* ================================================================= */
+/* Makes the slave side of the PTY the controlling terminal and the  */
+/* standard input and outputs of the calling (child) process.        */
+/* Returns -1 on failure.                                            */
+/* ================================================================= */
+static int
+slave_setup(int fd_slave)
+{
+  /* The slave side of the PTY becomes the standard input and outputs */
+  /* of the child process.                                            */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  close(0); /* Close standard input (current terminal)  */
+  close(1); /* Close standard output (current terminal) */
+  close(2); /* Close standard error (current terminal)  */
+
+  /* PTY becomes standard input (0), output (1) and error (2) */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (dup(fd_slave) == -1 || dup(fd_slave) == -1 || dup(fd_slave) == -1)
+    return -1;
+
+  /* Make the current process a new session leader */
+  /* """"""""""""""""""""""""""""""""""""""""""""" */
+  setsid();
+
+  /* As the child is a session leader, set the controlling terminal to */
+  /* be the slave side of the PTY (Mandatory for programs like thea    */
+  /* shell to make them correctly manage their outputs).               */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  ioctl(0, TIOCSCTTY, 1);
+
+  /* Set the effective uid from the real uid. */
+  /* """""""""""""""""""""""""""""""""""""""" */
+  seteuid(getuid());
+
+  return 0;
+}
+
+/* ===================== */
+/* Slave side of the PTY */
+/* ===================== */
+static void
+slave(int fd_slave, char * const argv[], int fd_err)
+{
+  int err;
+
+  /* Program execution with its arguments */
+  /* """""""""""""""""""""""""""""""""""" */
+  if (slave_setup(fd_slave) == 0)
+    execvp(argv[0], argv);
+
+  /* Report errno to the parent through the close-on-exec pipe */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  err = errno;
+  write(fd_err, &err, sizeof err);
+  _exit(127);
+}
+
+/* ================================================================= */
+/* Slave side of a pooled PTY: the child prepares its terminal, then */
+/* waits for the NUL separated arguments of the program to execute   */
+/* on fd_argv. It quietly exits if the pipe is closed without any    */
+/* argument.                                                         */
+/* Only async-signal-safe functions are used here as the parent may  */
+/* be multithreaded.                                                 */
+/* ================================================================= */
+static void
+slave_park(int fd_slave, int fd_argv, int fd_err)
+{
+  static char   args[65536];
+  static char * argv[1024];
+  size_t        len = 0;
+  size_t        i;
+  ssize_t       rc;
+  int           argc;
+#if HAVE_DECL_CLOSE_RANGE
+  unsigned lo, hi;
+#else
+  int fd, fd_max;
+#endif
+  int           err;
+
+  /* Keep the pipes out of the way of the standard descriptors */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  fd_argv = fcntl(fd_argv, F_DUPFD, 3);
+  fd_err  = fcntl(fd_err, F_DUPFD, 3);
+
+  if (fd_argv == -1 || fd_err == -1 || slave_setup(fd_slave) == -1)
+    _exit(127);
+
+  /* Do not keep the descriptors of the other sessions open, a parked */
+  /* child could wait for a long time.                                */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#if HAVE_DECL_CLOSE_RANGE
+  lo = fd_argv < fd_err ? fd_argv : fd_err;
+  hi = fd_argv < fd_err ? fd_err : fd_argv;
+
+  if (lo > 3)
+    close_range(3, lo - 1, 0);
+  if (hi > lo + 1)
+    close_range(lo + 1, hi - 1, 0);
+  close_range(hi + 1, ~0U, 0);
+#else
+  fd_max = sysconf(_SC_OPEN_MAX);
+  for (fd = 3; fd < fd_max; fd++)
+    if (fd != fd_argv && fd != fd_err)
+      close(fd);
+#endif
+
+  while (len < sizeof args
+         && (rc = read(fd_argv, args + len, sizeof args - len)) != 0)
+  {
+    if (rc == -1 && errno != EINTR)
+      _exit(127);
+    if (rc > 0)
+      len += rc;
+  }
+
+  if (len == 0)
+    _exit(0);
+
+  err = E2BIG;
+  if (len == sizeof args || args[len - 1] != '\0')
+    goto fail;
+
+  for (argc = 0, i = 0; i < len; i += strlen(args + i) + 1)
+  {
+    if (argc == 1023)
+      goto fail;
+    argv[argc++] = args + i;
+  }
+  argv[argc] = NULL;
+
+  close(fd_argv);
+  fcntl(fd_err, F_SETFD, FD_CLOEXEC);
+
+  execvp(argv[0], argv);
+  err = errno;
+
+fail:
+  write(fd_err, &err, sizeof err);
+  _exit(127);
+}
+
+/* ================================================================= */
+/* Returns a hash of what a child inherits from the process besides */
+/* its descriptors: the environment, the current directory and the   */
+/* resource limits. A parked child no longer matching is not used.   */
+/* ================================================================= */
+static unsigned long long
+pool_context(void)
+{
+  static const int   limits[] = { RLIMIT_AS,     RLIMIT_CORE,  RLIMIT_CPU,
+                                  RLIMIT_DATA,   RLIMIT_FSIZE, RLIMIT_NOFILE,
+                                  RLIMIT_STACK };
+  unsigned long long h        = 0xcbf29ce484222325ULL;
+  struct stat        st;
+  struct rlimit      rl;
+  char **            env;
+  const char *       p;
+  size_t             i;
+
+  for (env = environ; *env != NULL; env++)
+    for (p = *env;; p++)
+    {
+      h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+      if (*p == '\0')
+        break;
+    }
+
+  if (stat(".", &st) == 0)
+    h = (h ^ st.st_dev ^ ((unsigned long long)st.st_ino << 17))
+        * 0x100000001b3ULL;
+
+  for (i = 0; i < sizeof limits / sizeof *limits; i++)
+    if (getrlimit(limits[i], &rl) == 0)
+      h = (h ^ rl.rlim_cur ^ ((unsigned long long)rl.rlim_max << 7))
+          * 0x100000001b3ULL;
+
+  return h;
+}
+
+/* ================================================================= */
+/* Opens a PTY and forks a child parked in it, the entry is filled   */
+/* on success. Returns -1 on failure.                                */
+/* ================================================================= */
+static int
+pool_park(pool_entry_t * e)
+{
+  int   fd_argv[2];
+  int   fd_err[2];
+  pid_t pid;
+
+  pthread_mutex_lock(&spawn_lock);
+
+  if (open_pty(&e->fd_master, &e->fd_slave) != NULL)
+  {
+    pthread_mutex_unlock(&spawn_lock);
+    return -1;
+  }
+
+  if (pipe(fd_argv) == -1 || pipe(fd_err) == -1)
+    goto fail;
+
+  fcntl(fd_argv[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fd_argv[1], F_SETFD, FD_CLOEXEC);
+  fcntl(fd_err[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fd_err[1], F_SETFD, FD_CLOEXEC);
+
+  e->context = pool_context();
+
+  pid = fork();
+  if (pid == 0)
+    slave_park(e->fd_slave, fd_argv[0], fd_err[1]);
+
+  pthread_mutex_unlock(&spawn_lock);
+
+  close(fd_argv[0]);
+  close(fd_err[1]);
+
+  if (pid == -1)
+  {
+    close(fd_argv[1]);
+    close(fd_err[0]);
+    close(e->fd_master);
+    close(e->fd_slave);
+    return -1;
+  }
+
+  e->pid     = pid;
+  e->fd_argv = fd_argv[1];
+  e->fd_err  = fd_err[0];
+
+  return 0;
+
+fail:
+  pthread_mutex_unlock(&spawn_lock);
+  close(e->fd_master);
+  close(e->fd_slave);
+  return -1;
+}
+
+/* ================================================================= */
+/* Releases a parked child which is no longer wanted, closing the    */
+/* argument pipe makes it exit.                                      */
+/* ================================================================= */
+static void
+pool_release(pool_entry_t * e)
+{
+  close(e->fd_argv);
+  close(e->fd_err);
+  close(e->fd_master);
+  close(e->fd_slave);
+  waitpid(e->pid, NULL, 0);
+}
+
+/* ================================================================= */
+/* Thread function keeping pool_size children parked.                */
+/* ================================================================= */
+static void *
+pool_filler(void * args)
+{
+  pool_entry_t e;
+  int          rc;
+
+  (void)args;
+
+  pthread_mutex_lock(&pool_lock);
+
+  for (;;)
+  {
+    while (pool_nb >= pool_size)
+      pthread_cond_wait(&pool_cond, &pool_lock);
+
+    pthread_mutex_unlock(&pool_lock);
+    rc = pool_park(&e);
+    pthread_mutex_lock(&pool_lock);
+
+    /* Stop filling the pool when the system is short of resources */
+    /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    if (rc == -1)
+      pool_size = pool_nb;
+    else if (pool_nb < pool_size)
+      pool[pool_nb++] = e;
+    else
+    {
+      pthread_mutex_unlock(&pool_lock);
+      pool_release(&e);
+      pthread_mutex_lock(&pool_lock);
+    }
+  }
+
+  return NULL;
+}
+
+/* ================================================================= */
+/* Takes a parked child from the pool. The filler is only woken up   */
+/* by ptylie_spawn once the child has executed its program so as not */
+/* to compete with it.                                               */
+/* The children parked before a change of the environment, current   */
+/* directory or resource limits are released and replaced.          */
+/* Returns 1 if e has been filled, 0 if there is no suitable child.  */
+/* ================================================================= */
+static int
+pool_take(pool_entry_t * e)
+{
+  unsigned long long context = pool_context();
+  int                found   = 0;
+  int                stale   = 0;
+
+  pthread_mutex_lock(&pool_lock);
+
+  while (!found && pool_nb > 0)
+  {
+    *e = pool[--pool_nb];
+    if (e->context == context)
+      found = 1;
+    else
+    {
+      pthread_mutex_unlock(&pool_lock);
+      pool_release(e);
+      pthread_mutex_lock(&pool_lock);
+      stale = 1;
+    }
+  }
+
+  if (stale)
+    pthread_cond_signal(&pool_cond);
+
+  pthread_mutex_unlock(&pool_lock);
+
+  return found;
+}
+
+/* -------------------------------------------------------------- */
+/* Public interface, see ptylie.h                                 */
+/* -------------------------------------------------------------- */
+
+/* ======================================================= */
+/* Sets the default values of the session creation options */
+/* ======================================================= */
+void
+ptylie_opts_init(ptylie_opts_t * opts)
+{
+  memset(opts, 0, sizeof(ptylie_opts_t));
+
+  opts->srt_file = "ptylog.srt";
+  opts->duration = default_duration;
+}
+
+/* ================================================================== */
+/* Writes to fd_out the log stored by a session with opts.log_dedup   */
+/* in fd_in, which must be a regular file. The timing file and its    */
+/* index give the offsets in the log rebuilt.                         */
+/* Returns PTYLIE_OK, PTYLIE_ESYS or PTYLIE_EINVAL if fd_in is not a  */
+/* deduplicated log.                                                  */
+/* ================================================================== */
+int
+ptylie_unpack(int fd_in, int fd_out)
+{
+  switch (cdc_unpack(fd_in, fd_out))
+  {
+    case 0:
+      return PTYLIE_OK;
+
+    case -1:
+      return PTYLIE_ESYS;
+
+    default:
+      return PTYLIE_EINVAL;
+  }
+}
+
+/* ================================================================== */
+/* Opens in d the log file, its store if dedup is 1 and the timing    */
+/* file with its index, named after it, if timing_file is not NULL.   */
+/* d->fd must be -1 and the other fields 0, log_close closes what has */
+/* been opened even on error.                                         */
+/* ================================================================== */
+static int
+log_open(log_dest_t * d, const char * log_file, const char * timing_file,
+         int dedup)
+{
+  char * idx_file;
+
+  d->fd = open(log_file, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+               S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+  if (d->fd == -1)
+    return PTYLIE_ESYS;
+
+  chown(log_file, getuid(), getgid());
+
+  if (dedup && (d->cdc = cdc_new(d->fd)) == NULL)
+    return PTYLIE_ESYS;
+
+  if (timing_file == NULL)
+    return PTYLIE_OK;
+
+  if ((idx_file = malloc(strlen(timing_file) + 5)) == NULL)
+    return PTYLIE_ESYS;
+
+  strcpy(idx_file, timing_file);
+  strcat(idx_file, ".idx");
+
+  d->tim = fopen(timing_file, "we");
+  d->idx = fopen(idx_file, "we");
+  if (d->tim == NULL || d->idx == NULL)
+  {
+    free(idx_file);
+    return PTYLIE_ESYS;
+  }
+
+  chown(timing_file, getuid(), getgid());
+  chown(idx_file, getuid(), getgid());
+  free(idx_file);
+
+  return PTYLIE_OK;
+}
+
+static void
+log_close(log_dest_t * d)
+{
+  if (d->cdc != NULL)
+    cdc_free(d->cdc);
+  if (d->fd != -1)
+    close(d->fd);
+  if (d->tim != NULL)
+    fclose(d->tim);
+  if (d->idx != NULL)
+    fclose(d->idx);
+
+  d->cdc = NULL;
+  d->fd  = -1;
+  d->tim = NULL;
+  d->idx = NULL;
+}
+
+/* ================================================================== */
+/* Returns the us elapsed since the previous chunk of the log.        */
+/* ================================================================== */
+static long long
+log_delay(ptylie_t * s)
+{
+  struct timespec now;
+  long long       delay;
+
+  clock_now(s, &now);
+  delay = (now.tv_sec - s->log_last.tv_sec) * 1000000LL
+          + (now.tv_nsec - s->log_last.tv_nsec) / 1000;
+  s->log_last = now;
+
+  return delay < 0 ? 0 : delay;
+}
+
+/* ================================================================== */
+/* Appends len bytes to the log and, if requested, the corresponding  */
+/* line to the timing file in the scriptreplay format: the delay in   */
+/* seconds since the previous chunk and the size of the chunk.        */
+/* An index entry giving the recording time and the offsets of the    */
+/* next chunk in both files is added every PTYLIE_IDX_STEP us.        */
+/* ================================================================== */
+static void
+log_put(log_dest_t * d, const void * buf, size_t len, long long delay)
+{
+  if (d->tim != NULL)
+  {
+    d->time += delay;
+
+    if (d->time >= d->idx_next)
+    {
+      fprintf(d->idx, PTYLIE_IDX_FORMAT, d->time, d->size,
+              (long long)ftello(d->tim));
+      d->idx_next = d->time - d->time % PTYLIE_IDX_STEP + PTYLIE_IDX_STEP;
+    }
+
+    fprintf(d->tim, "%lld.%06lld %zu\n", delay / 1000000, delay % 1000000,
+            len);
+  }
+
+  if (d->cdc != NULL)
+    cdc_write(d->cdc, buf, len);
+  else
+    write(d->fd, buf, len);
+  d->size += len;
+}
+
+/* ================================================================== */
+/* Logs len bytes read from or written to the child: in the ring with */
+/* their time when the log is kept in memory, else in the files.      */
+/* Only called by the output side, the only writer of the ring.       */
+/* ================================================================== */
+static void
+log_chunk(ptylie_t * s, const void * buf, size_t len)
+{
+  if (s->ring != NULL)
+  {
+    s->ring_time += log_delay(s);
+    ring_put(s->ring, s->ring_time, buf, len);
+  }
+  else if (s->log.tim == NULL)
+    log_put(&s->log, buf, len, 0);
+  else
+  {
+    pthread_mutex_lock(&s->log_lock);
+    log_put(&s->log, buf, len, log_delay(s));
+    pthread_mutex_unlock(&s->log_lock);
+  }
+}
+
+/* ================================================================== */
+/* ring_read callback of ptylie_dump: the dumped log starts with its  */
+/* oldest record kept.                                                */
+/* ================================================================== */
+static int
+dump_record(void * ctx, long long time, const void * buf, size_t len)
+{
+  dump_t * dump = ctx;
+
+  log_put(&dump->dest, buf, len, dump->prev < 0 ? 0 : time - dump->prev);
+  dump->prev = time;
+
+  return 0;
+}
+
+/* ================================================================== */
+/* Writes the ring of s in its log and timing files (ptylie_dump).    */
+/* ================================================================== */
+static int
+dump_ring(ptylie_t * s)
+{
+  dump_t dump;
+  int    rc;
+
+  memset(&dump, 0, sizeof dump);
+  dump.dest.fd = -1;
+  dump.prev    = -1;
+
+  pthread_mutex_lock(&s->log_lock);
+
+  rc = log_open(&dump.dest, s->ring_log, s->ring_timing, s->ring_dedup);
+  if (rc == PTYLIE_OK && ring_read(s->ring, dump_record, &dump) != 0)
+    rc = PTYLIE_ESYS;
+  if (rc != PTYLIE_OK)
+    error(s, rc, "Error %d on the dump of %s", errno, s->ring_log);
+
+  log_close(&dump.dest);
+  s->dumps++;
+
+  pthread_mutex_unlock(&s->log_lock);
+
+  return rc;
+}
+
+/* ================================================================== */
+/* Appends the plain text of len bytes of output to the transcript,   */
+/* through a buffer on the stack.                                     */
+/* ================================================================== */
+static void
+transcript_chunk(ptylie_t * s, const unsigned char * buf, size_t len)
+{
+  unsigned char text[4096];
+  size_t        n, l;
+
+  while (len > 0)
+  {
+    n = len < sizeof text ? len : sizeof text;
+    if ((l = vt_strip(&s->strip, buf, n, text)) > 0)
+      write(s->fdx, text, l);
+    buf += n;
+    len -= n;
+  }
+}
+
+/* ===================================================================== */
+/* Allocates a new session in *ps, opens its log file and initializes    */
+/* terminfo if not already done. opts can be NULL to use the defaults.   */
+/* With opts->virtual_time, ptylie_step only waits for the child to be   */
+/* idle instead of sleeping and the timestamps of the session follow a   */
+/* clock advanced by the skipped sleeps, as if they had been real.       */
+/* ===================================================================== */
+int
+ptylie_new(ptylie_t ** ps, const ptylie_opts_t * opts)
+{
+  ptylie_t *    s;
+  ptylie_opts_t defaults;
+  long          offset;
+
+  if (opts == NULL)
+  {
+    ptylie_opts_init(&defaults);
+    opts = &defaults;
+  }
+
+  /* Resolve the terminfo data used by \T and \K once */
+  /* """""""""""""""""""""""""""""""""""""""""""""""" */
+  pthread_once(&ti_once, init_terminfo);
+
+  if ((s = calloc(1, sizeof(ptylie_t))) == NULL)
+    return PTYLIE_ESYS;
+
+  s->pid         = -1;
+  s->fd_master   = -1;
+  s->fd_slave    = -1;
+  s->log.fd      = -1;
+  s->fdx         = -1;
+  s->fdc         = -1;
+  s->fd_exec     = -1;
+  s->fd_pid      = -1;
+  s->fd_ctl      = -1;
+  s->fd_client   = -1;
+  s->clock       = s;
+  s->target      = s;
+  s->width       = opts->width;
+  s->height      = opts->height;
+  s->duration    = opts->duration > 0 ? opts->duration : default_duration;
+  s->srt_count   = 1;
+  s->srt_file    = strdup(opts->srt_file != NULL ? opts->srt_file
+                                                 : "ptylog.srt");
+  s->map_tree    = new_rb_tree(map_elem_comp);
+  s->offset_sign = 1;
+
+  pthread_mutex_init(&s->vt_lock, NULL);
+  pthread_mutex_init(&s->log_lock, NULL);
+  pthread_mutex_init(&s->clock_lock, NULL);
+  pthread_mutex_init(&s->trace_lock, NULL);
+  pthread_cond_init(&s->trace_cond, NULL);
+  pthread_mutex_init(&s->lat_lock, NULL);
+  pthread_mutex_init(&s->render_lock, NULL);
+  pthread_mutex_init(&s->sample_lock, NULL);
+  {
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s->sample_cond, &attr);
+    pthread_condattr_destroy(&attr);
+  }
+  s->virtual_time = opts->virtual_time;
+  s->start_wait   = opts->start_wait;
+
+  offset = opts->srt_offset;
+  if (offset < 0)
+  {
+    offset         = -offset;
+    s->offset_sign = -1;
+  }
+  s->srt_offset.tv_sec  = offset / 1000;
+  s->srt_offset.tv_usec = (offset - s->srt_offset.tv_sec * 1000) * 1000;
+
+  stk_init(&s->fd_stack);
+
+  /* The log kept in memory is only written by ptylie_dump */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (opts->log_file != NULL && opts->ring_size > 0)
+  {
+    s->ring       = ring_new(opts->ring_size);
+    s->ring_log   = strdup(opts->log_file);
+    s->ring_dedup = opts->log_dedup;
+    if (opts->timing_file != NULL)
+      s->ring_timing = strdup(opts->timing_file);
+
+    if (s->ring == NULL || s->ring_log == NULL
+        || (opts->timing_file != NULL && s->ring_timing == NULL))
+    {
+      ptylie_free(s);
+      return PTYLIE_ESYS;
+    }
+  }
+  else if (opts->log_file != NULL
+           && log_open(&s->log, opts->log_file, opts->timing_file,
+                       opts->log_dedup)
+                != PTYLIE_OK)
+  {
+    ptylie_free(s);
+    return PTYLIE_ESYS;
+  }
+
+  *ps = s;
+
+  return PTYLIE_OK;
+}
+
+/* ===================================================================== */
+/* Opens the PTY of the session and starts argv[0] with its arguments in */
+/* it. Only returns once the program has been successfully executed.     */
+/* ===================================================================== */
+int
+ptylie_spawn(ptylie_t * s, char * const argv[])
+{
+  int          fds[2];
+  int          err;
+  int          rc;
+  pid_t        pid;
+  const char * call;
+  pool_entry_t e;
+
+  if (s->pid != -1 || argv == NULL || argv[0] == NULL)
+    return error(s, PTYLIE_EINVAL, "Invalid argument");
+
+  /* Fastest path: a child is already waiting in a PTY of its own */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (pool_take(&e))
+  {
+    size_t i, len;
+
+    s->fd_master = e.fd_master;
+    s->fd_slave  = e.fd_slave;
+    s->pid       = e.pid;
+    s->fd_exec   = e.fd_err;
+
+    ptylie_resize(s, s->width, s->height);
+    ready_init(s);
+
+    /* Send the NUL separated arguments, the child executes them */
+    /* as soon as the pipe is closed.                            */
+    /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    for (i = 0; argv[i] != NULL; i++)
+    {
+      len = strlen(argv[i]) + 1;
+      if (write(e.fd_argv, argv[i], len) != (ssize_t)len)
+        break;
+    }
+    close(e.fd_argv);
+
+    /* Do not wait for the execvp result, it is checked by ptylie_wait */
+    /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    pthread_mutex_lock(&pool_lock);
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+
+    init_etime(s);
+
+    return PTYLIE_OK;
+  }
+
+  pthread_mutex_lock(&spawn_lock);
+
+  if ((call = open_pty(&s->fd_master, &s->fd_slave)) != NULL)
+  {
+    pthread_mutex_unlock(&spawn_lock);
+    return error(s, PTYLIE_ESYS, "Error %d on %s", errno, call);
+  }
+
+  ptylie_resize(s, s->width, s->height);
+  ready_init(s);
+
+#if HAVE_DECL_POSIX_SPAWN_SETSID
+  /* Fast path: posix_spawn does not duplicate the address space of */
+  /* the parent. The new session leader acquires the slave side of  */
+  /* the PTY as its controlling terminal by opening it.             */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t          attr;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, ptsname(s->fd_master),
+                                     O_RDWR | O_APPEND, 0);
+    posix_spawn_file_actions_adddup2(&actions, 0, 1);
+    posix_spawn_file_actions_adddup2(&actions, 0, 2);
+
+    /* POSIX_SPAWN_RESETIDS replaces the seteuid(getuid()) of slave */
+    /* '''''''''''''''''''''''''''''''''''''''''''''''''''''''''''' */
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr,
+                             POSIX_SPAWN_SETSID | POSIX_SPAWN_RESETIDS);
+
+    rc = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    pthread_mutex_unlock(&spawn_lock);
+
+    if (rc != 0)
+    {
+      errno = rc;
+      return error(s, PTYLIE_ESYS, "Error %d on execvp(%s)", rc, argv[0]);
+    }
+
+    s->pid = pid;
+
+    init_etime(s);
+
+    return PTYLIE_OK;
+  }
+#endif
+
+  /* This pipe will be closed by a successful execvp */
+  /* """"""""""""""""""""""""""""""""""""""""""""""" */
+  if (pipe(fds) == -1)
+  {
+    pthread_mutex_unlock(&spawn_lock);
+    return error(s, PTYLIE_ESYS, "Error %d on pipe()", errno);
+  }
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+  pid = fork();
+  if (pid == 0)
+    slave(s->fd_slave, argv, fds[1]);
+
+  err = errno;
+  pthread_mutex_unlock(&spawn_lock);
+  close(fds[1]);
+
+  if (pid == -1)
+  {
+    close(fds[0]);
+    errno = err;
+    return error(s, PTYLIE_ESYS, "Error %d on fork()", errno);
+  }
+
+  s->pid = pid;
+
+  /* Wait for the execvp result */
+  /* """""""""""""""""""""""""" */
+  while ((rc = read(fds[0], &err, sizeof err)) == -1 && errno == EINTR)
+    ;
+  close(fds[0]);
+
+  if (rc == sizeof err)
+  {
+    waitpid(pid, NULL, 0);
+    s->reaped = 1;
+    errno     = err;
+    return error(s, PTYLIE_ESYS, "Error %d on execvp(%s)", err, argv[0]);
+  }
+
+  init_etime(s);
+
+  return PTYLIE_OK;
+}
+
+/* ================================================================== */
+/* Keeps size children parked in PTYs of their own, ready to execute  */
+/* the programs of the next ptylie_spawn calls. The pool is refilled  */
+/* in the background, size 0 releases the parked children.            */
+/* The parked children inherit none of the file descriptors of the    */
+/* process. A parked child is only used if the environment, current   */
+/* directory and resource limits of the process are those it has      */
+/* inherited when it was created, it is replaced otherwise.           */
+/* ptylie_spawn does not wait for a pooled child to execute its       */
+/* program: an execvp failure is only reported by ptylie_wait, with   */
+/* the exit status 127.                                               */
+/* ================================================================== */
+int
+ptylie_pool(unsigned size)
+{
+  pthread_t    tid;
+  pool_entry_t e;
+
+  pthread_mutex_lock(&pool_lock);
+
+  if (size > pool_max)
+  {
+    pool_entry_t * p = realloc(pool, size * sizeof(pool_entry_t));
+
+    if (p == NULL)
+    {
+      pthread_mutex_unlock(&pool_lock);
+      return PTYLIE_ESYS;
+    }
+
+    pool     = p;
+    pool_max = size;
+  }
+
+  pool_size = size;
+
+  if (!pool_thread_on && size > 0)
+  {
+    if (pthread_create(&tid, NULL, pool_filler, NULL) != 0)
+    {
+      pthread_mutex_unlock(&pool_lock);
+      return PTYLIE_ESYS;
+    }
+    pthread_detach(tid);
+    pool_thread_on = 1;
+  }
+
+  /* Release the children which are no longer wanted */
+  /* """"""""""""""""""""""""""""""""""""""""""""""" */
+  while (pool_nb > pool_size)
+  {
+    e = pool[--pool_nb];
+    pthread_mutex_unlock(&pool_lock);
+    pool_release(&e);
+    pthread_mutex_lock(&pool_lock);
+  }
+
+  pthread_cond_signal(&pool_cond);
+  pthread_mutex_unlock(&pool_lock);
+
+  return PTYLIE_OK;
+}
+
+/* ================================================================== */
+/* Sets the command file of the session, fd will be closed at its end */
+/* or when the session is freed.                                      */
+/* ================================================================== */
+int
+ptylie_script(ptylie_t * s, int fd)
+{
+  if (fd < 0)
+    return error(s, PTYLIE_EINVAL, "Invalid argument");
+
+  if (s->fdc != -1)
+    close(s->fdc);
+
+  s->fdc     = fd;
+  s->special = s->meta = s->control = s->pending = 0;
+
+  return PTYLIE_OK;
+}
+
+/* ================================================================== */
+/* Executes the next step of the command file of a session without   */
+/* ever sleeping, the caller is responsible for waiting *delay before */
+/* calling it again.                                                  */
+/* Returns 0 when the command file is exhausted, 1 if it must be      */
+/* called again or a negative error code.                             */
+/* ================================================================== */
+int
+ptylie_step(ptylie_t * s, struct timespec * delay)
+{
+  int rc;
+
+  s->inj_stats.steps++;
+
+  /* A virtual sleep ends when the child has finished to process what */
+  /* precedes it, the clock then jumps to the end of the sleep.       */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (s->vsleep > 0)
+  {
+    long long elapsed;
+
+    if (!targets_idle(s))
+    {
+      if (s->trace != NULL && s->trace_drain == 0)
+        s->trace_drain = trace_now(s);
+      if (s->drain_from == 0)
+        s->drain_from = real_ns();
+
+      delay->tv_sec  = 0;
+      delay->tv_nsec = 1000000L;
+      return 1;
+    }
+
+    drain_end(s);
+
+    if (s->trace_drain > 0)
+    {
+      trace_event(s, &s->trace_inj, "idle wait", s->trace_drain,
+                  trace_now(s) - s->trace_drain, NULL, 0, NULL, 0);
+      s->trace_drain = 0;
+    }
+
+    elapsed = real_ns() - s->vsleep_start;
+    if (elapsed < s->vsleep)
+    {
+      pthread_mutex_lock(&s->clock_lock);
+      s->clock_offset += s->vsleep - elapsed;
+      pthread_mutex_unlock(&s->clock_lock);
+    }
+    s->vsleep = 0;
+  }
+
+  /* \w or start gate in progress */
+  /* """""""""""""""""""""""""""" */
+  if (s->wait_mode != READY_NONE && ready_wait(s, delay))
+    return 1;
+
+  if (!s->pending)
+    control_accept(s);
+
+  if (s->fdc == -1)
+    goto idle;
+
+  if (!s->pending)
+  {
+    switch (rc = inject_parse(s))
+    {
+      case UNIT_EOF:
+      case UNIT_NONE:
+        goto idle;
+
+      case UNIT_SLEEP:
+        *delay = s->sleep_once;
+        s->inj_stats.sleep_ns += delay->tv_sec * 1000000000ULL
+                                 + delay->tv_nsec;
+        rc = clock_sleep(s, delay);
+        trace_event(s, &s->trace_inj, "sleep", trace_now(s),
+                    delay->tv_sec * 1000000LL + delay->tv_nsec / 1000,
+                    "ms", s->sleep_once.tv_sec * 1000LL
+                            + s->sleep_once.tv_nsec / 1000000,
+                    NULL, 0);
+        return rc;
+
+      case UNIT_WAIT:
+        if (ready_wait(s, delay))
+          return 1;
+        goto loop;
+
+      case UNIT_PAUSE:
+        goto loop;
+
+      case UNIT_INJECT:
+        break;
+
+      default:
+        return rc;
+    }
+
+    s->pending = 1;
+
+    if (s->srt_on && s->map_on)
+    {
+      map_elem_t   elem;
+      map_elem_t * pelem;
+
+      elem.key = (char *)s->buf;
+      mb_interpret(elem.key);
+      if ((pelem = rb_tree_search(s->map_tree, &elem)) != NULL)
+        strcpy((char *)s->vbuf, pelem->repl);
+    }
+  }
+
+  /* Wait for an empty input queue to continue, completely in adaptive */
+  /* mode where the time taken by the child to empty it sets the pace  */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  {
+    int chars;
+
+    ioctl(s->target->fd_slave, FIONREAD, &chars);
+    if (chars > !s->adaptive)
+    {
+      if (s->trace != NULL && s->trace_drain == 0)
+        s->trace_drain = trace_now(s);
+      if (s->adaptive && s->adapt_late == 0)
+        s->adapt_late = real_ns();
+      if (s->drain_from == 0)
+        s->drain_from = real_ns();
+
+      delay->tv_sec  = 0;
+      delay->tv_nsec = 50000L;
+      return 1;
+    }
+  }
+
+  drain_end(s);
+
+  if (s->trace_drain > 0)
+  {
+    trace_event(s, &s->trace_inj, "drain wait", s->trace_drain,
+                trace_now(s) - s->trace_drain, NULL, 0, NULL, 0);
+    s->trace_drain = 0;
+  }
+
+  if (s->adaptive)
+  {
+    adapt_pace(s, s->adapt_late > 0 ? real_ns() - s->adapt_late : 0);
+    s->adapt_late = 0;
+  }
+
+  s->pending = 0;
+  {
+    long long t = trace_now(s);
+
+    /* The profiles follow the output of the session only */
+    /* '''''''''''''''''''''''''''''''''''''''''''''''''' */
+    if (s->lat != NULL && s->target == s)
+      latency_key(s);
+
+    if (s->render != NULL && s->target == s)
+      render_unit(s, 1);
+
+    if ((rc = inject_unit(s)) != PTYLIE_OK)
+      return rc;
+
+    trace_event(s, &s->trace_inj, "inject", t, trace_now(s) - t, "bytes",
+                s->l, NULL, 0);
+  }
+
+  /* inter injection loop 1/20 s min to leave the application */
+  /* the time to read the keyboard.                           */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+
+loop:
+
+  /* default to 1/20 s when sleep_time is set to 0, the adaptive */
+  /* inter-key time only has its own bounds.                     */
+  /* ''''''''''''''''''''''''''''''''''''''''''''''''''''''''''' */
+  if (s->adaptive)
+  {
+    delay->tv_sec  = s->adapt_ns / 1000000000LL;
+    delay->tv_nsec = s->adapt_ns % 1000000000LL;
+  }
+  else
+  {
+    if (s->sleep_time < 20)
+    {
+      s->sleep_time       = 20;
+      s->sleep_ts.tv_sec  = 0;
+      s->sleep_ts.tv_nsec = 50000000L;
+    }
+
+    *delay = s->sleep_ts;
+  }
+  s->inj_stats.sleep_ns += delay->tv_sec * 1000000000ULL + delay->tv_nsec;
+
+  {
+    long ms = delay->tv_sec * 1000L + delay->tv_nsec / 1000000;
+
+    rc = clock_sleep(s, delay);
+    trace_event(s, &s->trace_inj, "pause", trace_now(s),
+                delay->tv_sec * 1000000LL + delay->tv_nsec / 1000, "ms", ms,
+                NULL, 0);
+  }
+
+  return rc;
+
+idle:
+
+  /* Nothing more to play, keep polling the control socket if any */
+  /* or the control connection until it sends its next directive  */
+  /* '''''''''''''''''''''''''''''''''''''''''''''''''''''''''''' */
+  if (s->fd_ctl == -1)
+    return 0;
+
+  delay->tv_sec  = 0;
+  delay->tv_nsec = 50000000L;
+
+  return 1;
+}
+
+/* ================================================================== */
+/* Creates a UNIX domain socket at path through which other programs  */
+/* can send directives to the session while it is running. Each       */
+/* connection is played as a command file included at the current    */
+/* position (see control_accept).                                     */
+/* ================================================================== */
+int
+ptylie_control(ptylie_t * s, const char * path)
+{
+  struct sockaddr_un addr;
+  int                fd;
+
+  if (s->fd_ctl != -1 || path == NULL
+      || strlen(path) >= sizeof addr.sun_path)
+    return error(s, PTYLIE_EINVAL, "Invalid argument");
+
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  pthread_mutex_lock(&spawn_lock);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd != -1)
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  pthread_mutex_unlock(&spawn_lock);
+
+  if (fd == -1)
+    return error(s, PTYLIE_ESYS, "Error %d on socket()", errno);
+
+  if (control_unlink(path) == -1)
+  {
+    close(fd);
+    return error(s, PTYLIE_EINVAL, "%s exists and is not a socket of yours",
+                 path);
+  }
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof addr) == -1
+      || listen(fd, 8) == -1)
+  {
+    close(fd);
+    return error(s, PTYLIE_ESYS, "Error %d on bind(%s)", errno, path);
+  }
+
+  /* The socket is only usable by the real user */
+  /* """""""""""""""""""""""""""""""""""""""""" */
+  chmod(path, S_IRUSR | S_IWUSR);
+  chown(path, getuid(), getgid());
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  s->fd_ctl   = fd;
+  s->ctl_path = strdup(path);
+
+  return PTYLIE_OK;
+}
+
+/* ================================================================= */
+/* Maintains a model of the screen of the child fed with its output  */
+/* and writes snapshots of it in file: at each \P marker, every      */
+/* interval ms if the screen has changed (never if interval is 0)    */
+/* and when the session is freed. format is PTYLIE_SNAP_TEXT or      */
+/* PTYLIE_SNAP_JSON (one JSON object per line with the list of the   */
+/* lines changed since the previous snapshot).                       */
+/* ================================================================= */
+int
+ptylie_screen(ptylie_t * s, const char * file, int format, long interval)
+{
+  if (s->vt != NULL || file == NULL || interval < 0
+      || (format != PTYLIE_SNAP_TEXT && format != PTYLIE_SNAP_JSON))
+    return error(s, PTYLIE_EINVAL, "Invalid argument");
+
+  if ((s->snap = fopen(file, "we")) == NULL)
+    return error(s, PTYLIE_ESYS, "Cannot open snapshot file %s", file);
+
+  chown(file, getuid(), getgid());
+
+  s->vt = vt_new(s->width > 0 ? s->width : 80, s->height > 0 ? s->height : 24);
+  if (s->vt == NULL)
+  {
+    fclose(s->snap);
+    s->snap = NULL;
+    return error(s, PTYLIE_ESYS, "Cannot allocate the screen model");
+  }
+
+  s->snap_json     = format == PTYLIE_SNAP_JSON;
+  s->snap_interval = interval;
+  s->snap_last     = 0;
+  clock_now(s, &s->snap_start);
+
+  return PTYLIE_OK;
+}
+
+/* ================================================================ */
+/* Writes a snapshot of the screen now, marker can be NULL.         */
+/* ================================================================ */
+int
+ptylie_snapshot(ptylie_t * s, const char * marker)
+{
+  if (s->vt == NULL)
+    return error(s, PTYLIE_EINVAL, "The screen is not modeled");
+
+  pthread_mutex_lock(&s->vt_lock);
+  screen_dump(s, marker);
+  pthread_mutex_unlock(&s->vt_lock);
+
+  return PTYLIE_OK;
+}
+
+/* ================================================================== */
+/* Writes the counters of the session to out as key=value lines      */
+/* (PTYLIE_STATS_TEXT) or as OpenMetrics families prefixed by ptylie_ */
+/* (PTYLIE_STATS_OPENMETRICS). The caller can add its own metrics     */
+/* after them and must end an OpenMetrics exposition with "# EOF".    */
+/* It can be called from any thread: the counters are read without    */
+/* lock and may miss the latest updates of the other threads.         */
+/* ================================================================== */
+int
+ptylie_stats(ptylie_t * s, FILE * out, int format)
+{
+  out_stats_t        o = s->out_stats;
+  inj_stats_t        i = s->inj_stats;
+  unsigned long long sum;
+  unsigned           b;
+
+  if (format != PTYLIE_STATS_TEXT && format != PTYLIE_STATS_OPENMETRICS)
+    return error(s, PTYLIE_EINVAL, "Unknown statistics format %d", format);
+
+  stats_counter(out, format, "output_bytes", "Bytes read from the child",
+                o.read_bytes);
+  stats_counter(out, format, "reads", "Reads returning data", o.reads);
+  stats_counter(out, format, "empty_reads", "Reads or polls without data",
+                o.read_empty);
+
+  /* Read sizes histogram, the buckets are cumulative in both formats */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (format == PTYLIE_STATS_OPENMETRICS)
+    fprintf(out,
+            "# TYPE ptylie_read_size histogram\n"
+            "# HELP ptylie_read_size Sizes of the reads in bytes\n");
+
+  for (sum = 0, b = 0; b < READ_BUCKETS; b++)
+  {
+    sum += o.read_size[b];
+    if (format == PTYLIE_STATS_OPENMETRICS && b < READ_BUCKETS - 1)
+      fprintf(out, "ptylie_read_size_bucket{le=\"%zd\"} %llu\n",
+              read_bounds[b], sum);
+    else if (format == PTYLIE_STATS_OPENMETRICS)
+      fprintf(out, "ptylie_read_size_bucket{le=\"+Inf\"} %llu\n", sum);
+    else if (b < READ_BUCKETS - 1)
+      fprintf(out, "read_size_le_%zd=%llu\n", read_bounds[b], sum);
+    else
+      fprintf(out, "read_size_le_inf=%llu\n", sum);
+  }
+
+  if (format == PTYLIE_STATS_OPENMETRICS)
+    fprintf(out, "ptylie_read_size_count %llu\nptylie_read_size_sum %llu\n",
+            sum, o.read_bytes);
+
+  stats_counter(out, format, "input_bytes", "Bytes written to the child",
+                o.write_bytes);
+  stats_counter(out, format, "writes", "Writes to the child", o.writes);
+  stats_counter(out, format, "partial_writes",
+                "Writes to the child shorter than requested",
+                o.write_partial);
+  stats_counter(out, format, "write_stalls",
+                "Writes to the child refused with EAGAIN", o.write_stalls);
+  stats_counter(out, format, "tty_packets",
+                "Line discipline changes reported in packet mode",
+                o.packets);
+
+  if (s->ring != NULL)
+    stats_counter(out, format, "log_dumps",
+                  "Dumps of the log kept in memory", s->dumps);
+
+  if (s->log.cdc != NULL)
+  {
+    cdc_stats_t c;
+
+    cdc_stats(s->log.cdc, &c);
+    stats_counter(out, format, "log_bytes", "Bytes logged", c.bytes_in);
+    stats_counter(out, format, "log_store_bytes",
+                  "Bytes of the deduplicated log", c.bytes_out);
+    stats_counter(out, format, "log_chunks", "Chunks cut in the log",
+                  c.chunks);
+    stats_counter(out, format, "log_unique_chunks",
+                  "Distinct chunks stored with their data", c.unique);
+  }
+
+  stats_counter(out, format, "steps", "Calls of ptylie_step", i.steps);
+  stats_counter(out, format, "injected_units",
+                "Units injected by the command files", i.units);
+  stats_counter(out, format, "injected_bytes", "Bytes injected", i.bytes);
+  stats_seconds(out, format, "sleep", "Sleeps asked by the command files",
+                i.sleep_ns);
+  stats_seconds(out, format, "wait",
+                "Waits for the child to read its input", i.wait_ns);
+  stats_counter(out, format, "ready_timeouts",
+                "Waits for the readiness of the child ended by timeout",
+                i.ready_late);
+  stats_counter(out, format, "subtitles", "Subtitles entries written",
+                i.srt_entries);
+
+  /* Latency profile: the keys without answer only count in the bytes */
+  /* '''''''''''''''''''''''''''''''''''''''''''''''''''''''''''''''' */
+  pthread_mutex_lock(&s->lat_lock);
+  if (s->lat_nb > 0)
+  {
+    long long * first = malloc(s->lat_nb * sizeof(long long));
+    long long * quiet = malloc(s->lat_nb * sizeof(long long));
+    long long * bytes = malloc(s->lat_nb * sizeof(long long));
+    size_t      k, n = 0;
+
+    if (first != NULL && quiet != NULL && bytes != NULL)
+    {
+      for (k = 0; k < s->lat_nb; k++)
+      {
+        lat_key_t * key = &s->lat_keys[k];
+
+        bytes[k] = key->bytes;
+        if (key->first > 0)
+        {
+          first[n]   = key->first - key->inject;
+          quiet[n++] = key->last - key->inject;
+        }
+      }
+
+      stats_counter(out, format, "profiled_keys",
+                    "Units injected during the latency profile",
+                    s->lat_nb);
+      stats_counter(out, format, "silent_keys",
+                    "Profiled units without output", s->lat_nb - n);
+      stats_quantiles(out, format, "key_first_byte",
+                      "Time from a key to the first byte of its output",
+                      first, n, 1);
+      stats_quantiles(out, format, "key_quiet",
+                      "Time from a key to the end of its output burst",
+                      quiet, n, 1);
+      stats_quantiles(out, format, "key_output_bytes",
+                      "Bytes of the output burst of a key", bytes,
+                      s->lat_nb, 0);
+    }
+
+    free(first);
+    free(quiet);
+    free(bytes);
+  }
+  pthread_mutex_unlock(&s->lat_lock);
+
+  /* Render cost, the efficiency is the share of text in the output */
+  /* '''''''''''''''''''''''''''''''''''''''''''''''''''''''''''''' */
+  pthread_mutex_lock(&s->render_lock);
+  if (s->render_start > 0)
+  {
+    vt_cost_t * c = &s->render_cost;
+
+    stats_counter(out, format, "render_text_bytes",
+                  "Printable bytes in the output", c->text);
+    stats_counter(out, format, "render_control_bytes",
+                  "Bytes of controls and escape sequences in the output",
+                  c->control);
+    stats_counter(out, format, "render_clears", "Full screen clears",
+                  c->clears);
+    stats_counter(out, format, "render_erases",
+                  "Partial erases of the screen", c->erases);
+    stats_counter(out, format, "render_moves", "Cursor positionings",
+                  c->moves);
+    stats_counter(out, format, "render_scrolls", "Scroll operations",
+                  c->scrolls);
+    stats_counter(out, format, "render_sgr", "Graphic rendition changes",
+                  c->sgr);
+  }
+  pthread_mutex_unlock(&s->render_lock);
+
+  return PTYLIE_OK;
+}
+
+/* ================================================================== */
+/* Records the timeline of the session in file in the Chrome trace    */
+/* event format (JSON array), readable by chrome://tracing and        */
+/* Perfetto: injections, sleeps, waits for the child to read its      */
+/* input, included files, resizes, map loads and the output and input */
+/* chunks relayed. Each side of the session buffers its events, a     */
+/* background thread writes them. file NULL ends the trace, which is  */
+/* otherwise completed by ptylie_free.                                */
+/* Must be called when neither side of the session is running.        */
+/* ================================================================== */
+int
+ptylie_trace(ptylie_t * s, const char * file)
+{
+  if (s->trace != NULL)
+    trace_end(s);
+
+  if (file == NULL)
+    return PTYLIE_OK;
+
+  s->trace_out  = malloc(sizeof(trace_buf_t));
+  s->trace_inj  = malloc(sizeof(trace_buf_t));
+  s->trace_head = s->trace_tail = s->trace_free = NULL;
+  if (s->trace_out == NULL || s->trace_inj == NULL)
+  {
+    free(s->trace_out);
+    free(s->trace_inj);
+    return error(s, PTYLIE_ESYS, "Cannot allocate the trace buffers");
+  }
+
+  if ((s->trace = fopen(file, "we")) == NULL)
+  {
+    free(s->trace_out);
+    free(s->trace_inj);
+    return error(s, PTYLIE_ESYS, "Error %d on fopen(%s)", errno, file);
+  }
+  chown(file, getuid(), getgid());
+
+  s->trace_out->tid = trace_out_tid;
+  s->trace_out->nb  = 0;
+  s->trace_inj->tid = trace_inj_tid;
+  s->trace_inj->nb  = 0;
+  s->trace_stop     = 0;
+  s->trace_drain    = 0;
+  s->trace_start    = real_ns();
+
+  fprintf(s->trace,
+          "[\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+          "\"args\":{\"name\":\"output\"}},\n"
+          "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+          "\"args\":{\"name\":\"injection\"}}",
+          trace_out_tid, trace_inj_tid);
+
+  if (pthread_create(&s->trace_thread, NULL, trace_writer, s) != 0)
+  {
+    fclose(s->trace);
+    s->trace = NULL;
+    free(s->trace_out);
+    free(s->trace_inj);
+    return error(s, PTYLIE_ESYS, "Cannot start the trace thread");
+  }
+
+  return PTYLIE_OK;
+}
+
+/* ================================================================== */
+/* Profiles the responsiveness of the child: each unit injected by    */
+/* the command file is timed along with the burst of output which     */
+/* follows it, until the output has been quiet for 10 ms or the next  */
+/* unit. ptylie_stats then gives the percentiles of the times to the  */
+/* first byte and to the quiescence and of the bytes per unit, file   */
+/* receives the per unit CSV when the profile ends: when file is NULL */
+/* or when the session is freed.                                      */
+/* Must be called when neither side of the session is running.        */
+/* ================================================================== */
+int
+ptylie_latency(ptylie_t * s, const char * file)
+{
+  if (s->lat != NULL)
+    latency_end(s);
+
+  if (file == NULL)
+    return PTYLIE_OK;
+
+  if ((s->lat = fopen(file, "we")) == NULL)
+    return error(s, PTYLIE_ESYS, "Error %d on fopen(%s)", errno, file);
+  chown(file, getuid(), getgid());
+
+  s->lat_nb = 0;
+
+  return PTYLIE_OK;
+}
+
+/* ================================================================== */
+/* Writes in file, as it is read, the plain text of the output of the */
+/* child: its escape sequences (CSI, OSC, DCS...) and control chars   */
+/* but LF and HT are removed. file NULL ends the transcript, which is */
+/* otherwise closed by ptylie_free.                                   */
+/* Must be called when neither side of the session is running.        */
+/* ================================================================== */
+int
+ptylie_transcript(ptylie_t * s, const char * file)
+{
+  if (s->fdx != -1)
+    close(s->fdx);
+  s->fdx = -1;
+
+  if (file == NULL)
+    return PTYLIE_OK;
+
+  s->fdx = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+  if (s->fdx == -1)
+    return error(s, PTYLIE_ESYS, "Error %d on open(%s)", errno, file);
+  chown(file, getuid(), getgid());
+
+  vt_strip_init(&s->strip);
+
+  return PTYLIE_OK;
+}
+
+/* ================================================================== */
+/* Writes the log kept in memory with opts.ring_size, the last chunks */
+/* of the session, in opts.log_file and its timing in timing_file as  */
+/* without opts.ring_size, a previous dump is overwritten. Done when  */
+/* a \w or the start gate times out, otherwise the caller decides     */
+/* (end of the child on error, signal...). The logs of the targets    */
+/* kept in memory are also written.                                   */
+/* Can be called by any thread while both sides are running.          */
+/* ================================================================== */
+int
+ptylie_dump(ptylie_t * s)
+{
+  unsigned i;
+  int      rc;
+
+  if (s->ring == NULL)
+    return error(s, PTYLIE_EINVAL, "No log kept in memory");
+
+  rc = dump_ring(s);
+
+  for (i = 0; i < s->targets_nb; i++)
+  {
+    ptylie_t * t = s->targets[i].s;
+
+    if (t->ring != NULL && dump_ring(t) != PTYLIE_OK && rc == PTYLIE_OK)
+      rc = error(s, PTYLIE_ESYS, "%s", t->errmsg);
+  }
+
+  return rc;
+}
+
+/* ================================================================== */
+/* Makes the session t, with its own PTY, child and log, a target of  */
+/* the command file of s named name: after a \@[name] the units are   */
+/* injected in the PTY of t until the next \@, \@[] goes back to s.   */
+/* The command file keeps a single timeline: t uses the clock of s,   */
+/* \w and \W apply to the current target and the virtual sleeps wait  */
+/* for all the targets to be idle. The output of t must still be read */
+/* with ptylie_read, t must not have a command file of its own nor    */
+/* be used once s is freed.                                           */
+/* Must be called when neither side of s is running.                  */
+/* ================================================================== */
+int
+ptylie_target(ptylie_t * s, const char * name, ptylie_t * t)
+{
+  target_t * targets;
+  unsigned   i;
+
+  if (t == s || t->clock != t || t->targets_nb > 0 || *name == '\0'
+      || strlen(name) >= sizeof targets->name || strchr(name, ']') != NULL)
+    return error(s, PTYLIE_EINVAL, "Invalid target %s", name);
+
+  for (i = 0; i < s->targets_nb; i++)
+    if (strcmp(s->targets[i].name, name) == 0)
+      return error(s, PTYLIE_EINVAL, "Duplicate target %s", name);
+
+  targets = realloc(s->targets, (s->targets_nb + 1) * sizeof *targets);
+  if (targets == NULL)
+    return error(s, PTYLIE_ESYS, "Cannot allocate the target %s", name);
+
+  s->targets = targets;
+  strcpy(targets[s->targets_nb].name, name);
+  targets[s->targets_nb++].s = t;
+  t->clock                   = s;
+
+  return PTYLIE_OK;
+}
+
+/* ================================================================== */
+/* Analyses the render cost of the output of the child: the escape    */
+/* sequences are parsed and counted (full clears, partial erases,     */
+/* cursor moves, scrolls and SGR changes) along with the printable    */
+/* and control bytes. file receives one CSV line per unit injected by */
+/* the command file with the cost of the output which followed it up  */
+/* to the next unit, the first line has the output before the first   */
+/* unit. ptylie_stats gives the totals. file NULL ends the analysis,  */
+/* which is otherwise ended by ptylie_free.                           */
+/* Must be called when neither side of the session is running.        */
+/* ================================================================== */
+int
+ptylie_render(ptylie_t * s, const char * file)
+{
+  if (s->render != NULL)
+    render_end(s);
+
+  if (file == NULL)
+    return PTYLIE_OK;
+
+  if ((s->render = fopen(file, "we")) == NULL)
+    return error(s, PTYLIE_ESYS, "Error %d on fopen(%s)", errno, file);
+  chown(file, getuid(), getgid());
+
+  fprintf(s->render, "key,time,bytes_in,bytes_out,text_bytes,control_bytes,"
+                     "clears,erases,moves,scrolls,sgr,efficiency\n");
+
+  vt_cost_init(&s->render_cost);
+  s->render_base   = s->render_cost;
+  s->render_start  = real_ns();
+  s->render_inject = s->render_start;
+  s->render_len    = 0;
+
+  return PTYLIE_OK;
+}
+
+/* ================================================================== */
+/* Samples every interval ms the resources used by the process tree   */
+/* of the child (CPU time and usage, RSS, context switches and I/O    */
+/* bytes, from /proc on Linux) in a background thread. The samples    */
+/* and the \P markers reached are written in file as JSON lines whose */
+/* "t" is the time of the recording clock since the spawn, as in the  */
+/* timing file. file NULL stops the sampling, which is otherwise      */
+/* stopped by ptylie_free.                                            */
+/* ================================================================== */
+int
+ptylie_sample(ptylie_t * s, const char * file, long interval)
+{
+  if (s->sample != NULL)
+    sample_end(s);
+
+  if (file == NULL)
+    return PTYLIE_OK;
+
+  if (interval <= 0)
+    return error(s, PTYLIE_EINVAL, "Invalid sampling interval %ld",
+                 interval);
+
+  if ((s->sample = fopen(file, "we")) == NULL)
+    return error(s, PTYLIE_ESYS, "Error %d on fopen(%s)", errno, file);
+  chown(file, getuid(), getgid());
+
+  s->sample_every = interval;
+  s->sample_stop  = 0;
+
+  if (pthread_create(&s->sample_thread, NULL, sampler, s) != 0)
+  {
+    fclose(s->sample);
+    s->sample = NULL;
+    return error(s, PTYLIE_ESYS, "Cannot start the sampling thread");
+  }
+
+  return PTYLIE_OK;
+}
+
+/* ================================================================ */
+/* Injects len bytes in the keyboard buffer of the child as the     */
+/* command file does (root privileges are needed).                  */
+/* ================================================================ */
+int
+ptylie_inject(ptylie_t * s, const void * buf, size_t len)
+{
+  const char * p = buf;
+  long long    t = trace_now(s);
+
+  if (s->fd_slave == -1)
+    return error(s, PTYLIE_EINVAL, "The session has not been spawned");
+
+  while (len-- > 0)
+  {
+    if (ioctl(s->fd_slave, TIOCSTI, p++) < 0)
+      return error(s, PTYLIE_ESYS, "Error %d on ioctl(TIOCSTI)", errno);
+    s->inj_stats.bytes++;
+  }
+
+  trace_event(s, &s->trace_inj, "inject", t, trace_now(s) - t, "bytes",
+              p - (const char *)buf, NULL, 0);
+
+  return PTYLIE_OK;
+}
+
+/* ================================================================== */
+/* Sends len bytes to the child as if they were typed on its terminal */
+/* and logs them.                                                     */
+/* Returns the number of bytes written or a negative error code.      */
+/* ================================================================== */
+ssize_t
+ptylie_write(ptylie_t * s, const void * buf, size_t len)
+{
+  ssize_t   rc;
+  long long t = trace_now(s);
+
+  if (s->fd_master == -1)
+    return error(s, PTYLIE_EINVAL, "The session has not been spawned");
+
+  rc = write(s->fd_master, buf, len);
+  if (rc == -1 && errno == EAGAIN)
+    s->out_stats.write_stalls++;
+  if (rc == -1)
+    return error(s, PTYLIE_ESYS, "Error %d on write master pty", errno);
+
+  s->out_stats.writes++;
+  s->out_stats.write_bytes += rc;
+  if ((size_t)rc < len)
+    s->out_stats.write_partial++;
+
+  if (s->log.fd != -1 || s->ring != NULL)
+    log_chunk(s, buf, rc);
+
+  trace_event(s, &s->trace_out, "input", t, trace_now(s) - t, "bytes", rc,
+              NULL, 0);
+
+  return rc;
+}
+
+/* ===================================================================== */
+/* Reads at most len bytes of the output of the child and logs them.     */
+/* timeout is given in ms, a negative value means no timeout. In packet  */
+/* mode the status only packets are skipped, PTYLIE_ETIMEOUT always      */
+/* means that no output is pending.                                      */
+/* Returns the number of bytes read or PTYLIE_ETIMEOUT, PTYLIE_ECLOSED   */
+/* or another negative error code.                                       */
+/* ===================================================================== */
+ssize_t
+ptylie_read(ptylie_t * s, void * buf, size_t len, int timeout)
+{
+  struct pollfd pfd;
+  struct iovec  iov[2];
+  unsigned char pkt = TIOCPKT_DATA;
+  ssize_t       rc;
+  long long     t, now;
+
+  if (s->fd_master == -1)
+    return error(s, PTYLIE_EINVAL, "The session has not been spawned");
+
+  pfd.fd     = s->fd_master;
+  pfd.events = POLLIN;
+
+again:
+  rc = poll(&pfd, 1, timeout);
+  if (rc == 0 || (rc == -1 && errno == EINTR))
+  {
+    s->out_stats.read_empty++;
+    return PTYLIE_ETIMEOUT;
+  }
+  if (rc == -1)
+    return error(s, PTYLIE_ESYS, "Error %d on poll()", errno);
+
+  t = trace_now(s);
+
+  /* In packet mode each read begins with a status byte */
+  /* '''''''''''''''''''''''''''''''''''''''''''''''''' */
+  if (s->packet)
+  {
+    iov[0].iov_base = &pkt;
+    iov[0].iov_len  = 1;
+    iov[1].iov_base = buf;
+    iov[1].iov_len  = len;
+    rc              = readv(s->fd_master, iov, 2);
+  }
+  else
+    rc = read(s->fd_master, buf, len);
+
+  if (rc == 0 || (rc == -1 && errno == EIO))
+    return PTYLIE_ECLOSED;
+  if (rc == -1 && (errno == EAGAIN || errno == EINTR))
+  {
+    s->out_stats.read_empty++;
+    return PTYLIE_ETIMEOUT;
+  }
+  if (rc == -1)
+    return error(s, PTYLIE_ESYS, "Error %d on read master pty", errno);
+
+  if (s->packet)
+  {
+    rc--;
+    if (pkt != TIOCPKT_DATA)
+    {
+      s->out_stats.packets++;
+      trace_event(s, &s->trace_out, "tty status", t, -1, "flags", pkt, NULL,
+                  0);
+    }
+
+    /* Data may be queued behind a status only packet */
+    /* '''''''''''''''''''''''''''''''''''''''''''''' */
+    if (rc == 0)
+    {
+      timeout = 0;
+      goto again;
+    }
+  }
+
+  s->out_stats.reads++;
+  s->out_stats.read_bytes += rc;
+  s->out_stats.read_size[read_bucket(rc)]++;
+
+  now = real_ns();
+  pthread_mutex_lock(&s->clock_lock);
+  s->last_output = now;
+  pthread_mutex_unlock(&s->clock_lock);
+
+  if (s->lat != NULL)
+    latency_output(s, now, rc);
+
+  if (s->render != NULL)
+  {
+    pthread_mutex_lock(&s->render_lock);
+    vt_cost_feed(&s->render_cost, buf, rc);
+    pthread_mutex_unlock(&s->render_lock);
+  }
+
+  if (s->log.fd != -1 || s->ring != NULL)
+    log_chunk(s, buf, rc);
+
+  if (s->fdx != -1)
+    transcript_chunk(s, buf, rc);
+
+  if (s->vt != NULL)
+  {
+    pthread_mutex_lock(&s->vt_lock);
+    vt_feed(s->vt, buf, rc);
+    if (s->snap_interval > 0 && vt_damaged(s->vt)
+        && screen_time(s) - s->snap_last >= s->snap_interval)
+      screen_dump(s, s->marker[0] != '\0' ? s->marker : NULL);
+    pthread_mutex_unlock(&s->vt_lock);
+  }
+
+  trace_event(s, &s->trace_out, "output", t, trace_now(s) - t, "bytes", rc,
+              NULL, 0);
+
+  return rc;
+}
+
+/* ================================================================== */
+/* Sets the geometry of the terminal of the child, 80x24 if both the  */
+/* width and the height are 0.                                        */
+/* ================================================================== */
+int
+ptylie_resize(ptylie_t * s, unsigned width, unsigned height)
+{
+  struct winsize ws = { 24, 80, 0, 0 };
+
+  /* Set the default terminal geometry */
+  /* """"""""""""""""""""""""""""""""" */
+  if (height == 0 && width == 0)
+  {
+    height = 24;
+    width  = 80;
+  }
+
+  s->width  = width;
+  s->height = height;
+
+  if (s->vt != NULL)
+  {
+    pthread_mutex_lock(&s->vt_lock);
+    if (vt_resize(s->vt, width, height) == -1)
+    {
+      pthread_mutex_unlock(&s->vt_lock);
+      return error(s, PTYLIE_ESYS, "Cannot resize the screen model");
+    }
+    pthread_mutex_unlock(&s->vt_lock);
+  }
+
+  if (s->fd_slave == -1)
+    return PTYLIE_OK;
+
+  /* Set terminal size to the pty. */
+  /* """"""""""""""""""""""""""""" */
+  ws.ws_row = height;
+  ws.ws_col = width;
+  if (ioctl(s->fd_slave, TIOCSWINSZ, &ws) == -1)
+    return error(s, PTYLIE_ESYS, "Error %d on ioctl(TIOCSWINSZ)", errno);
+
+  return PTYLIE_OK;
+}
+
+/* ===================================================================== */
+/* Waits at most timeout ms (no limit if negative) for the end of the    */
+/* child and stores its exit code in *status: its exit status or 128     */
+/* plus the signal number if it has been killed.                         */
+/* ===================================================================== */
+int
+ptylie_wait(ptylie_t * s, int * status, int timeout)
+{
+  int   wstatus;
+  pid_t rc;
+
+  if (s->pid == -1 || s->reaped)
+    return error(s, PTYLIE_EINVAL, "No child to wait for");
+
+  for (;;)
+  {
+    rc = wait4(s->pid, &wstatus, timeout < 0 ? 0 : WNOHANG, &s->rusage);
+    if (rc == s->pid)
+      break;
+    if (rc == -1 && errno != EINTR)
+      return error(s, PTYLIE_ESYS, "Error %d on wait4()", errno);
+    if (rc == 0)
+    {
+      if (timeout == 0)
+        return PTYLIE_ETIMEOUT;
+
+      /* The pidfd becomes readable when the child ends */
+      /* '''''''''''''''''''''''''''''''''''''''''''''' */
+      if (ptylie_exit_fd(s) != -1)
+      {
+        struct pollfd pfd = { s->fd_pid, POLLIN, 0 };
+
+        rc = poll(&pfd, 1, timeout);
+        if (rc == 0)
+          return PTYLIE_ETIMEOUT;
+        if (rc > 0)
+          timeout = 0;
+        continue;
+      }
+
+      nanosleep((const struct timespec[]){ { 0, 1000000L } }, NULL);
+      timeout--;
+    }
+  }
+
+  s->reaped = 1;
+
+  /* A pooled child reports a failed execvp after ptylie_spawn */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (s->fd_exec != -1)
+  {
+    int err;
+
+    if (read(s->fd_exec, &err, sizeof err) == sizeof err)
+      error(s, PTYLIE_ESYS, "Error %d on execvp", err);
+
+    close(s->fd_exec);
+    s->fd_exec = -1;
+  }
+
+  if (status != NULL)
+  {
+    if (WIFEXITED(wstatus))
+      *status = WEXITSTATUS(wstatus);
+    else if (WIFSIGNALED(wstatus))
+      *status = 128 + WTERMSIG(wstatus);
+    else
+      *status = 0;
+  }
+
+  return PTYLIE_OK;
+}
+
+/* ================================================================ */
+/* Returns the master side of the PTY, to be used in poll or select */
+/* ================================================================ */
+int
+ptylie_fd(ptylie_t * s)
+{
+  return s->fd_master;
+}
+
+/* ================================================================ */
+/* Returns a descriptor which becomes readable when the child ends, */
+/* to be watched along with ptylie_fd, ptylie_wait then collects    */
+/* the child at once. Returns -1 if the system does not provide     */
+/* such a descriptor (Linux pidfd), the child status must then be   */
+/* polled with ptylie_wait.                                         */
+/* ================================================================ */
+int
+ptylie_exit_fd(ptylie_t * s)
+{
+#ifdef SYS_pidfd_open
+  /* Opened on demand: a child not yet waited for keeps its pid */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (s->fd_pid == -1 && s->pid != -1 && !s->reaped)
+    s->fd_pid = syscall(SYS_pidfd_open, s->pid, 0);
+#endif
+
+  return s->fd_pid;
+}
+
+/* ================================================================== */
+/* Gives the resources used by the child and its waited for children  */
+/* once ptylie_wait has returned its status.                          */
+/* ================================================================== */
+int
+ptylie_rusage(ptylie_t * s, struct rusage * usage)
+{
+  if (!s->reaped)
+    return error(s, PTYLIE_EINVAL, "The child has not been waited for");
+
+  *usage = s->rusage;
+
+  return PTYLIE_OK;
+}
+
+/* ================================================================== */
+/* Gives the name of the i-th \P marker reached by the command file   */
+/* and the time in ns between the spawn of the child and this marker. */
+/* Must not be called while the injection side is running.            */
+/* Returns PTYLIE_EINVAL if there are fewer markers.                  */
+/* ================================================================== */
+int
+ptylie_marker(ptylie_t * s, unsigned i, const char ** name, long long * ns)
+{
+  if (i >= s->marks_nb)
+    return PTYLIE_EINVAL;
+
+  *name = s->marks[i].name;
+  *ns   = s->marks[i].ns;
+
+  return PTYLIE_OK;
+}
+
+pid_t
+ptylie_pid(ptylie_t * s)
+{
+  return s->pid;
+}
+
+/* ================================================================== */
+/* Releases the resources held by a session, a child still running is */
+/* killed.                                                            */
+/* ================================================================== */
+void
+ptylie_free(ptylie_t * s)
+{
+  if (s->trace != NULL)
+    trace_end(s);
+  pthread_mutex_destroy(&s->trace_lock);
+  pthread_cond_destroy(&s->trace_cond);
+  if (s->lat != NULL)
+    latency_end(s);
+  free(s->lat_keys);
+  if (s->render != NULL)
+    render_end(s);
+  pthread_mutex_destroy(&s->render_lock);
+  free(s->marks);
+  if (s->sample != NULL)
+    sample_end(s);
+  pthread_mutex_destroy(&s->sample_lock);
+  pthread_cond_destroy(&s->sample_cond);
+  pthread_mutex_destroy(&s->lat_lock);
+
+  if (s->fdc != -1)
+    close(s->fdc);
+  while ((s->fdc = stk_pop(&s->fd_stack)) != -1)
+    close(s->fdc);
+  log_close(&s->log);
+  if (s->ring != NULL)
+    ring_free(s->ring);
+  free(s->ring_log);
+  free(s->ring_timing);
+  if (s->fdx != -1)
+    close(s->fdx);
+  pthread_mutex_destroy(&s->log_lock);
+  pthread_mutex_destroy(&s->clock_lock);
+  if (s->fd_exec != -1)
+    close(s->fd_exec);
+  if (s->fd_pid != -1)
+    close(s->fd_pid);
+  if (s->fd_slave != -1)
+    close(s->fd_slave);
+  if (s->fd_master != -1)
+    close(s->fd_master);
+  if (s->srt != NULL)
+    fclose(s->srt);
+  if (s->fd_ctl != -1)
+  {
+    close(s->fd_ctl);
+    control_unlink(s->ctl_path);
+    free(s->ctl_path);
+  }
+  if (s->vt != NULL)
+  {
+    /* Last snapshot: the final state of the screen */
+    /* """""""""""""""""""""""""""""""""""""""""""" */
+    screen_dump(s, "end");
+    fclose(s->snap);
+    vt_free(s->vt);
+  }
+  pthread_mutex_destroy(&s->vt_lock);
+
+  if (s->pid != -1 && !s->reaped)
+  {
+    if (waitpid(s->pid, NULL, WNOHANG) == 0)
+    {
+      kill(s->pid, SIGKILL);
+      waitpid(s->pid, NULL, 0);
+    }
+  }
+
+  rb_tree_remove_all(s->map_tree, map_elem_free);
+  free(s->map_tree);
+  free(s->srt_file);
+  free(s->targets);
+  free(s);
+}
+
+/* ================================================= */
+/* Returns a static message describing an error code */
+/* ================================================= */
+const char *
+ptylie_strerror(int err)
+{
+  switch (err)
+  {
+    case PTYLIE_OK:
+      return "Success";
+    case PTYLIE_ESYS:
+      return "System error";
+    case PTYLIE_EINVAL:
+      return "Invalid argument";
+    case PTYLIE_ESCRIPT:
+      return "Invalid command file";
+    case PTYLIE_ETIMEOUT:
+      return "Timeout";
+    case PTYLIE_ECLOSED:
+      return "PTY closed";
+    default:
+      return "Unknown error";
+  }
+}
+
+/* ============================================================ */
+/* Returns the message describing the last error of the session */
+/* ============================================================ */
+const char *
+ptylie_errmsg(ptylie_t * s)
+{
+  return s->errmsg;
+}
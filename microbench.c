@@ -0,0 +1,420 @@
+/* ################################################################### */
+/* microbench: micro-benchmarks of the helpers of libptylie (the       */
+/* red-black tree, the map loader, mb_interpret and mb_validate) on    */
+/* generated datasets.                                                 */
+/* libptylie.c and tree.c are included so that their static functions  */
+/* can be reached and their allocations counted.                       */
+/* Each benchmark writes a JSON object on its own line on stdout.      */
+/* ################################################################### */
+
+#define _XOPEN_SOURCE 700
+#include "config.h"
+#if HAVE_DECL_POSIX_SPAWN_SETSID || HAVE_DECL_CLOSE_RANGE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+/* ---------- */
+/* Prototypes */
+/* ---------- */
+
+static void *
+count_malloc(size_t size);
+
+static void *
+count_calloc(size_t nmemb, size_t size);
+
+static void *
+count_realloc(void * ptr, size_t size);
+
+static char *
+count_strdup(const char * str);
+
+/* ------------------------------------------------------------ */
+/* The code measured, its allocations go through the counters.  */
+/* ------------------------------------------------------------ */
+
+#define malloc(n) count_malloc(n)
+#define calloc(n, s) count_calloc(n, s)
+#define realloc(p, n) count_realloc(p, n)
+#define strdup(p) count_strdup(p)
+
+#include "libptylie.c"
+#include "tree.c"
+
+#undef malloc
+#undef calloc
+#undef realloc
+#undef strdup
+
+static long long
+now_ns(void);
+
+static void
+perf_open(void);
+
+static long long
+perf_read(void);
+
+static void
+bench_begin(void);
+
+static void
+bench_end(const char * name, long n, long ops, long long bytes);
+
+static void
+shuffle(long * v, long n);
+
+static char *
+utf8_corpus(size_t size);
+
+static void
+bench_tree(long n);
+
+static void
+bench_map_load(long n);
+
+static void
+bench_interpret(void);
+
+static void
+bench_validate(void);
+
+int
+main(int argc, char * argv[]);
+
+/* ----------- */
+/* Definitions */
+/* ----------- */
+
+static long allocs;          /* number of allocations so far          */
+static int  perf_fd = -1;    /* cache misses counter, -1 if not usable */
+static long long t_begin;    /* state of the counters at bench_begin   */
+static long      a_begin;    /*                                        */
+static long long m_begin;    /*                                        */
+static int       sink;       /* defeats the optimizer                  */
+
+static void *
+count_malloc(size_t size)
+{
+  allocs++;
+  return malloc(size);
+}
+
+static void *
+count_calloc(size_t nmemb, size_t size)
+{
+  allocs++;
+  return calloc(nmemb, size);
+}
+
+static void *
+count_realloc(void * ptr, size_t size)
+{
+  allocs++;
+  return realloc(ptr, size);
+}
+
+static char *
+count_strdup(const char * str)
+{
+  allocs++;
+  return strdup(str);
+}
+
+/* ================================================ */
+/* Returns the monotonic clock value in nanoseconds */
+/* ================================================ */
+static long long
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* ================================================================= */
+/* Opens the hardware cache misses counter of this thread if the     */
+/* kernel allows it (see /proc/sys/kernel/perf_event_paranoid).      */
+/* ================================================================= */
+static void
+perf_open(void)
+{
+#ifdef __linux__
+  struct perf_event_attr pe;
+
+  memset(&pe, 0, sizeof pe);
+  pe.type           = PERF_TYPE_HARDWARE;
+  pe.size           = sizeof pe;
+  pe.config         = PERF_COUNT_HW_CACHE_MISSES;
+  pe.exclude_kernel = 1;
+  pe.exclude_hv     = 1;
+
+  perf_fd = syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+#endif
+}
+
+static long long
+perf_read(void)
+{
+  long long count = 0;
+
+  if (perf_fd != -1 && read(perf_fd, &count, sizeof count) != sizeof count)
+    count = 0;
+
+  return count;
+}
+
+static void
+bench_begin(void)
+{
+  a_begin = allocs;
+  m_begin = perf_read();
+  t_begin = now_ns();
+}
+
+/* ================================================================= */
+/* Writes the result of a benchmark of ops operations started by     */
+/* bench_begin. n is the size of the dataset and bytes the number of */
+/* bytes processed (0 if not meaningful).                            */
+/* ================================================================= */
+static void
+bench_end(const char * name, long n, long ops, long long bytes)
+{
+  long long t = now_ns() - t_begin;
+  long long m = perf_read() - m_begin;
+  long      a = allocs - a_begin;
+
+  printf("{\"bench\":\"%s\",\"version\":\"%s\",\"n\":%ld,\"ops\":%ld,"
+         "\"ns_per_op\":%.2f,\"allocs_per_op\":%.2f,",
+         name, VERSION, n, ops, (double)t / ops, (double)a / ops);
+
+  if (perf_fd != -1)
+    printf("\"cache_misses_per_op\":%.2f", (double)m / ops);
+  else
+    printf("\"cache_misses_per_op\":null");
+
+  if (bytes > 0)
+    printf(",\"mb_per_s\":%.2f", bytes / 1e6 / (t / 1e9));
+
+  printf("}\n");
+  fflush(stdout);
+}
+
+static void
+shuffle(long * v, long n)
+{
+  long i, j, t;
+
+  for (i = n - 1; i > 0; i--)
+  {
+    j    = rand() % (i + 1);
+    t    = v[i];
+    v[i] = v[j];
+    v[j] = t;
+  }
+}
+
+/* ================================================================= */
+/* Returns size bytes of valid UTF-8 text mixing 1 to 4 bytes chars. */
+/* ================================================================= */
+static char *
+utf8_corpus(size_t size)
+{
+  static const char * chars[] = { "a", "b", " ", "e", "\xc3\xa9",
+                                  "\xd0\x96", "\xe4\xb8\xad",
+                                  "\xe2\x82\xac", "\xf0\x9f\x98\x80" };
+  char *              p       = malloc(size + 1);
+  size_t              i = 0, l;
+  const char *        c;
+
+  while (i < size)
+  {
+    c = chars[rand() % (sizeof chars / sizeof *chars)];
+    l = strlen(c);
+    if (i + l > size)
+      c = "x", l = 1;
+    memcpy(p + i, c, l);
+    i += l;
+  }
+  p[size] = '\0';
+
+  return p;
+}
+
+/* ================================================================= */
+/* Inserts n keys in random order in a map tree then looks them up,  */
+/* as done with the entries of a \m map file and the injected keys.  */
+/* ================================================================= */
+static void
+bench_tree(long n)
+{
+  rb_tree *    tree = new_rb_tree(map_elem_comp);
+  map_elem_t * elems;
+  map_elem_t   elem;
+  char         key[32];
+  long *       order;
+  long         i;
+
+  elems = malloc(n * sizeof *elems);
+  order = malloc(n * sizeof *order);
+  for (i = 0; i < n; i++)
+  {
+    snprintf(key, sizeof key, "key%09ld", i);
+    elems[i].key  = strdup(key);
+    elems[i].repl = elems[i].key;
+    order[i]      = i;
+  }
+  shuffle(order, n);
+
+  bench_begin();
+  for (i = 0; i < n; i++)
+    rb_tree_insert(tree, &elems[order[i]]);
+  bench_end("tree_insert", n, n, 0);
+
+  shuffle(order, n);
+
+  bench_begin();
+  for (i = 0; i < n; i++)
+  {
+    elem.key = elems[order[i]].key;
+    sink += rb_tree_search(tree, &elem) != NULL;
+  }
+  bench_end("tree_search", n, n, 0);
+
+  rb_tree_remove_all(tree, NULL);
+  free(tree);
+  for (i = 0; i < n; i++)
+    free(elems[i].key);
+  free(elems);
+  free(order);
+}
+
+/* ================================================================= */
+/* Loads a generated map file of n entries with map_load (\m).       */
+/* ================================================================= */
+static void
+bench_map_load(long n)
+{
+  char     path[] = "/tmp/microbenchXXXXXX";
+  FILE *   map;
+  ptylie_t s;
+  long     i;
+  int      fd;
+
+  if ((fd = mkstemp(path)) == -1 || (map = fdopen(fd, "w+")) == NULL)
+  {
+    perror("microbench");
+    return;
+  }
+  unlink(path);
+
+  for (i = 0; i < n; i++)
+    fprintf(map, "k%ld\\u%02lx \\uc3\\ua9t\\ue2\\u82\\uac%ld\n", i,
+            0x41 + i % 26, i);
+  rewind(map);
+
+  memset(&s, 0, sizeof s);
+  s.map_tree = new_rb_tree(map_elem_comp);
+
+  bench_begin();
+  map_load(&s, map);
+  bench_end("map_load", n, n, ftello(map));
+
+  rb_tree_remove_all(s.map_tree, map_elem_free);
+  free(s.map_tree);
+  fclose(map);
+}
+
+/* ================================================================= */
+/* mb_interpret on escape-heavy strings: 256 \u sequences per string */
+/* ================================================================= */
+static void
+bench_interpret(void)
+{
+  static const char * seqs[] = { "\\u41", "\\uc3a9", "\\ue282ac",
+                                 "\\uf09f9880", "\\uzz" };
+  char                src[4096], dst[4096];
+  size_t              l = 0;
+  long                i, ops = 20000;
+
+  for (i = 0; i < 256; i++)
+  {
+    const char * seq = seqs[i % 5];
+
+    l += sprintf(src + l, "a%s", seq);
+  }
+
+  bench_begin();
+  for (i = 0; i < ops; i++)
+  {
+    memcpy(dst, src, l + 1);
+    mb_interpret(dst);
+    sink += dst[0];
+  }
+  bench_end("mb_interpret", (long)l, ops, (long long)l * ops);
+}
+
+/* ================================================================= */
+/* mb_validate on a 16 MB UTF-8 corpus, then on 64 bytes strings as  */
+/* those of the injected units.                                      */
+/* ================================================================= */
+static void
+bench_validate(void)
+{
+  size_t size   = 16 << 20;
+  char * corpus = utf8_corpus(size);
+  long   i, ops = 16;
+
+  bench_begin();
+  for (i = 0; i < ops; i++)
+    sink += mb_validate(corpus, size);
+  bench_end("mb_validate_large", (long)size, ops, (long long)size * ops);
+
+  ops = 1000000;
+  bench_begin();
+  for (i = 0; i < ops; i++)
+    sink += mb_validate(corpus + (i * 64) % (size - 128), 64);
+  bench_end("mb_validate_small", 64, ops, 64LL * ops);
+
+  free(corpus);
+}
+
+/* ============= */
+/* Main function */
+/* ============= */
+int
+main(int argc, char * argv[])
+{
+  long sizes[] = { 10, 1000, 100000, 1000000 };
+  int  i;
+
+  (void)argc;
+  (void)argv;
+
+  srand(42);
+  perf_open();
+  if (perf_fd == -1)
+    fprintf(stderr, "microbench: no access to the cache misses counter\n");
+
+  for (i = 0; i < (int)(sizeof sizes / sizeof *sizes); i++)
+    bench_tree(sizes[i]);
+
+  for (i = 0; i < (int)(sizeof sizes / sizeof *sizes); i++)
+    bench_map_load(sizes[i]);
+
+  bench_interpret();
+  bench_validate();
+
+  return sink == -1;
+}
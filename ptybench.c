@@ -0,0 +1,542 @@
+/* ################################################################### */
+/* ptybench: end-to-end benchmarks of libptylie. The synthetic child   */
+/* programs are modes of this same binary (see child_main).            */
+/* Each benchmark writes a JSON object on its own line on stdout.      */
+/* ################################################################### */
+
+#define _XOPEN_SOURCE 700
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "ptylie.h"
+
+/* ---------- */
+/* Prototypes */
+/* ---------- */
+
+static long long
+now_ns(void);
+
+static double
+cpu_s(void);
+
+static void
+raw_stdio(void);
+
+static int
+child_main(int argc, char * argv[]);
+
+static ptylie_t *
+start(char * const argv[], long long * t0);
+
+static int
+read_until(ptylie_t * s, long long size, const char * tag, long long * first);
+
+static int
+cmp_double(const void * a, const void * b);
+
+static void
+report(const char * name, double * v, int n, const char * unit,
+       const char * extra);
+
+static int
+bench_relay(int runs, long long size, int screen);
+
+static int
+bench_inject(int runs, int keys);
+
+static int
+bench_slow(int runs, long long size);
+
+static void
+usage(void);
+
+int
+main(int argc, char * argv[]);
+
+/* ----------- */
+/* Definitions */
+/* ----------- */
+
+#define MAX_RUNS 64
+
+static char self[4096]; /* path of this program, used to start the children */
+
+/* ================================================ */
+/* Returns the monotonic clock value in nanoseconds */
+/* ================================================ */
+static long long
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* ========================================================= */
+/* Returns the CPU time (user + system) used by this process */
+/* ========================================================= */
+static double
+cpu_s(void)
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+         + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/* ================================================================= */
+/* Puts the terminal of a child in raw mode so that the bytes are    */
+/* neither echoed, buffered by line nor translated.                  */
+/* ================================================================= */
+static void
+raw_stdio(void)
+{
+  struct termios t;
+
+  if (tcgetattr(0, &t) == 0)
+  {
+    t.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL
+                   | IXON);
+    t.c_oflag &= ~OPOST;
+    t.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    t.c_cc[VMIN]  = 1;
+    t.c_cc[VTIME] = 0;
+    tcsetattr(0, TCSANOW, &t);
+  }
+}
+
+/* ===================================================================== */
+/* Synthetic children:                                                   */
+/*   gen SIZE     writes SIZE bytes of text lines as fast as possible    */
+/*   echo KEYS    writes back each of the KEYS bytes it reads            */
+/*   slow SIZE    reads SIZE bytes 256 at a time with 100 us pauses,     */
+/*                then writes DONE                                       */
+/* ===================================================================== */
+static int
+child_main(int argc, char * argv[])
+{
+  static char buf[65536];
+  long long   size, done = 0;
+  ssize_t     n;
+  int         i;
+
+  if (argc < 3)
+    return EXIT_FAILURE;
+
+  size = atoll(argv[2]);
+  raw_stdio();
+
+  if (strcmp(argv[1], "gen") == 0)
+  {
+    for (i = 0; i < (int)sizeof buf; i++)
+      buf[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+
+    while (done < size)
+    {
+      n = write(1, buf,
+                size - done < (long long)sizeof buf ? size - done
+                                                    : (long long)sizeof buf);
+      if (n <= 0)
+        return EXIT_FAILURE;
+      done += n;
+    }
+    return EXIT_SUCCESS;
+  }
+
+  if (strcmp(argv[1], "echo") == 0)
+  {
+    while (done < size)
+    {
+      n = read(0, buf, sizeof buf);
+      if (n <= 0 || write(1, buf, n) != n)
+        return EXIT_FAILURE;
+      done += n;
+    }
+    return EXIT_SUCCESS;
+  }
+
+  if (strcmp(argv[1], "slow") == 0)
+  {
+    while (done < size)
+    {
+      n = read(0, buf, 256);
+      if (n <= 0)
+        return EXIT_FAILURE;
+      done += n;
+      nanosleep((const struct timespec[]){ { 0, 100000L } }, NULL);
+    }
+    write(1, "DONE", 4);
+
+    /* Leave the time to the parent to read DONE */
+    /* """"""""""""""""""""""""""""""""""""""""" */
+    read(0, buf, 1);
+    return EXIT_SUCCESS;
+  }
+
+  return EXIT_FAILURE;
+}
+
+/* ================================================================= */
+/* Creates a session running argv, *t0 receives the time just before */
+/* the spawn.                                                        */
+/* ================================================================= */
+static ptylie_t *
+start(char * const argv[], long long * t0)
+{
+  ptylie_t * s;
+
+  if (ptylie_new(&s, NULL) != PTYLIE_OK)
+    return NULL;
+
+  *t0 = now_ns();
+  if (ptylie_spawn(s, argv) != PTYLIE_OK)
+  {
+    fprintf(stderr, "ptybench: %s\n", ptylie_errmsg(s));
+    ptylie_free(s);
+    return NULL;
+  }
+
+  return s;
+}
+
+/* ================================================================== */
+/* Reads the output of the child until size bytes have been read or,  */
+/* if tag is not NULL, until tag appears. *first receives the time of */
+/* the first byte if first is not NULL.                               */
+/* Returns 0 or a negative PTYLIE_E* code.                            */
+/* ================================================================== */
+static int
+read_until(ptylie_t * s, long long size, const char * tag, long long * first)
+{
+  static char buf[65536];
+  long long   total = 0;
+  size_t      tag_len = tag != NULL ? strlen(tag) : 0;
+  char        tail[16] = "";
+  ssize_t     n;
+
+  for (;;)
+  {
+    n = ptylie_read(s, buf, sizeof buf - 1, 10000);
+    if (n < 0)
+      return n;
+
+    if (total == 0 && first != NULL)
+      *first = now_ns();
+    total += n;
+
+    if (tag != NULL)
+    {
+      /* The tag can be split between two reads */
+      /* """""""""""""""""""""""""""""""""""""" */
+      char   joined[sizeof tail + sizeof buf];
+      size_t l = strlen(tail);
+
+      memcpy(joined, tail, l);
+      memcpy(joined + l, buf, n);
+      joined[l + n] = '\0';
+      if (strstr(joined, tag) != NULL)
+        return 0;
+
+      l += n;
+      if (l > tag_len)
+      {
+        memcpy(tail, joined + l - tag_len, tag_len);
+        tail[tag_len] = '\0';
+      }
+      else
+        strcpy(tail, joined);
+    }
+    else if (total >= size)
+      return 0;
+  }
+}
+
+static int
+cmp_double(const void * a, const void * b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* ================================================================= */
+/* Writes the result line of a benchmark: the minimum, median and    */
+/* maximum of the n values of its main metric followed by the other  */
+/* fields already formatted in extra.                                */
+/* ================================================================= */
+static void
+report(const char * name, double * v, int n, const char * unit,
+       const char * extra)
+{
+  qsort(v, n, sizeof *v, cmp_double);
+
+  printf("{\"bench\":\"%s\",\"version\":\"%s\",\"runs\":%d,\"unit\":\"%s\","
+         "\"min\":%.3f,\"median\":%.3f,\"max\":%.3f%s}\n",
+         name, VERSION, n, unit, v[0], v[n / 2], v[n - 1], extra);
+  fflush(stdout);
+}
+
+/* ================================================================= */
+/* Relay: the child writes size bytes, measures the throughput, the  */
+/* time to the first byte and the CPU used per MB. With screen, the  */
+/* screen model is fed as well.                                      */
+/* ================================================================= */
+static int
+bench_relay(int runs, long long size, int screen)
+{
+  double     mbs[MAX_RUNS], ttfb = 0, cpu = 0;
+  char       extra[256], arg[32];
+  char *     argv[] = { self, "gen", arg, NULL };
+  long long  t0, first, end;
+  double     c0;
+  ptylie_t * s;
+  int        i, rc;
+
+  snprintf(arg, sizeof arg, "%lld", size);
+
+  for (i = 0; i < runs; i++)
+  {
+    c0 = cpu_s();
+    if ((s = start(argv, &t0)) == NULL)
+      return -1;
+
+    if (screen)
+      ptylie_screen(s, "/dev/null", PTYLIE_SNAP_TEXT, 0);
+
+    if ((rc = read_until(s, size, NULL, &first)) < 0)
+    {
+      fprintf(stderr, "ptybench: relay: %s\n", ptylie_strerror(rc));
+      ptylie_free(s);
+      return -1;
+    }
+    end = now_ns();
+    ptylie_wait(s, NULL, -1);
+    ptylie_free(s);
+
+    mbs[i] = size / 1e6 / ((end - first) / 1e9);
+    ttfb += (first - t0) / 1e6;
+    cpu += cpu_s() - c0;
+  }
+
+  snprintf(extra, sizeof extra,
+           ",\"bytes\":%lld,\"ttfb_ms\":%.3f,\"cpu_ms_per_mb\":%.3f", size,
+           ttfb / runs, cpu * 1000 / (size / 1e6 * runs));
+  report(screen ? "relay_screen" : "relay", mbs, runs, "MB/s", extra);
+
+  return 0;
+}
+
+/* ================================================================= */
+/* Injection: keys bytes are injected with ptylie_inject (TIOCSTI)   */
+/* by blocks of INJECT_BLOCK, each block must have been echoed by    */
+/* the child before the next one (the input queue of a terminal is   */
+/* limited), so that the round trip is measured.                     */
+/* ================================================================= */
+#define INJECT_BLOCK 256
+
+static int
+bench_inject(int runs, int keys)
+{
+  double     kps[MAX_RUNS];
+  char       extra[64], arg[32], buf[INJECT_BLOCK];
+  char *     argv[] = { self, "echo", arg, NULL };
+  long long  t0, t1;
+  ptylie_t * s;
+  int        i, n, done, rc;
+
+  snprintf(arg, sizeof arg, "%d", keys);
+  memset(buf, 'k', sizeof buf);
+
+  for (i = 0; i < runs; i++)
+  {
+    if ((s = start(argv, &t0)) == NULL)
+      return -1;
+
+    /* Let the child set its terminal in raw mode */
+    /* """""""""""""""""""""""""""""""""""""""""" */
+    nanosleep((const struct timespec[]){ { 0, 50000000L } }, NULL);
+
+    t0 = now_ns();
+    for (done = 0; done < keys; done += n)
+    {
+      n = keys - done < INJECT_BLOCK ? keys - done : INJECT_BLOCK;
+      if ((rc = ptylie_inject(s, buf, n)) != PTYLIE_OK
+          || (rc = read_until(s, n, NULL, NULL)) < 0)
+      {
+        fprintf(stderr, "ptybench: inject: %s\n", ptylie_strerror(rc));
+        ptylie_free(s);
+        return -1;
+      }
+    }
+    t1 = now_ns();
+
+    ptylie_wait(s, NULL, -1);
+    ptylie_free(s);
+
+    kps[i] = keys / ((t1 - t0) / 1e9);
+  }
+
+  snprintf(extra, sizeof extra, ",\"keys\":%d", keys);
+  report("inject", kps, runs, "keys/s", extra);
+
+  return 0;
+}
+
+/* ================================================================= */
+/* Slow reader: size bytes are written to a child reading slowly,    */
+/* measures the throughput and how often ptylie_write is partial.    */
+/* ================================================================= */
+static int
+bench_slow(int runs, long long size)
+{
+  static char buf[4096];
+  double      mbs[MAX_RUNS];
+  char        extra[128], arg[32];
+  char *      argv[] = { self, "slow", arg, NULL };
+  long long   t0, t1, done;
+  long        writes = 0, partial = 0;
+  ssize_t     n;
+  ptylie_t *  s;
+  int         i, rc;
+
+  snprintf(arg, sizeof arg, "%lld", size);
+  memset(buf, 'w', sizeof buf);
+
+  for (i = 0; i < runs; i++)
+  {
+    if ((s = start(argv, &t0)) == NULL)
+      return -1;
+
+    nanosleep((const struct timespec[]){ { 0, 50000000L } }, NULL);
+
+    t0 = now_ns();
+    for (done = 0; done < size; done += n)
+    {
+      size_t len = size - done < (long long)sizeof buf ? size - done
+                                                       : (long long)sizeof buf;
+
+      n = ptylie_write(s, buf, len);
+      if (n < 0)
+      {
+        fprintf(stderr, "ptybench: slow: %s\n", ptylie_errmsg(s));
+        ptylie_free(s);
+        return -1;
+      }
+      writes++;
+      if ((size_t)n < len)
+        partial++;
+    }
+
+    if ((rc = read_until(s, 0, "DONE", NULL)) < 0)
+    {
+      fprintf(stderr, "ptybench: slow: %s\n", ptylie_strerror(rc));
+      ptylie_free(s);
+      return -1;
+    }
+    t1 = now_ns();
+
+    ptylie_write(s, "q", 1);
+    ptylie_wait(s, NULL, -1);
+    ptylie_free(s);
+
+    mbs[i] = size / 1e6 / ((t1 - t0) / 1e9);
+  }
+
+  snprintf(extra, sizeof extra,
+           ",\"bytes\":%lld,\"writes\":%ld,\"partial_writes\":%ld", size,
+           writes, partial);
+  report("slow_reader", mbs, runs, "MB/s", extra);
+
+  return 0;
+}
+
+static void
+usage(void)
+{
+  fprintf(stderr, "Usage: ptybench [-n runs] [-s relay_MB] [-k keys] "
+                  "[-w slow_reader_KB]\n");
+  exit(EXIT_FAILURE);
+}
+
+/* ============= */
+/* Main function */
+/* ============= */
+int
+main(int argc, char * argv[])
+{
+  int       opt, rc = 0;
+  int       runs = 5, keys = 20000;
+  long long size = 64LL << 20, slow = 1LL << 20;
+  ssize_t   n;
+
+  /* Child mode */
+  /* """""""""" */
+  if (argc > 1 && argv[1][0] != '-')
+    return child_main(argc, argv);
+
+  while ((opt = getopt(argc, argv, "n:s:k:w:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n':
+        runs = atoi(optarg);
+        if (runs < 1 || runs > MAX_RUNS)
+          usage();
+        break;
+
+      case 's':
+        size = atoll(optarg) << 20;
+        break;
+
+      case 'k':
+        keys = atoi(optarg);
+        break;
+
+      case 'w':
+        slow = atoll(optarg) << 10;
+        break;
+
+      default:
+        usage();
+    }
+  }
+
+  if (size <= 0 || keys <= 0 || slow <= 0)
+    usage();
+
+  /* The children are started from our own executable */
+  /* """""""""""""""""""""""""""""""""""""""""""""""" */
+  n = readlink("/proc/self/exe", self, sizeof self - 1);
+  if (n > 0)
+    self[n] = '\0';
+  else
+    snprintf(self, sizeof self, "%s", argv[0]);
+
+  rc |= bench_relay(runs, size, 0);
+  rc |= bench_relay(runs, size, 1);
+
+  /* The injection needs root privileges */
+  /* """"""""""""""""""""""""""""""""""" */
+  if (geteuid() == 0)
+    rc |= bench_inject(runs, keys);
+  else
+    fprintf(stderr, "ptybench: not root, injection benchmark skipped\n");
+
+  rc |= bench_slow(runs, slow);
+
+  return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,8 +1,8 @@
-#define _XOPEN_SOURCE 600
+#define _XOPEN_SOURCE 700
 #include "config.h"
 #include <errno.h>
-#include <ctype.h>
 #include <fcntl.h>
+#include <math.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -10,93 +10,108 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
-/* For FIONREAD */
-#if defined(__sun)
-#include <sys/filio.h>
-#endif
-#include <sys/ioctl.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/select.h>
 #include <sys/time.h>
-#include <sys/wait.h>
 #include <termios.h>
-#include <term.h>
 #include <unistd.h>
 
-#include "tree.h"
+#include "ptylie.h"
 
-#define MAX_ETIME 86400
+typedef struct run_entry_s run_entry_t;
 
-typedef struct stk_s stk_t;
+typedef struct run_queue_s run_queue_t;
 
-typedef struct map_elem_s map_elem_t;
+typedef struct runner_s runner_t;
+
+typedef struct runner_arg_s runner_arg_t;
+
+typedef struct bench_s bench_t;
+
+typedef struct target_s target_t;
 
 /* ---------- */
 /* Prototypes */
 /* ---------- */
 
 void
-stk_init(stk_t * stack);
-
-int
-stk_empty(stk_t * stack);
+usage(char * prog);
 
-int
-stk_push(stk_t * stack, int fd);
+void
+cleanup(void);
 
-int
-stk_pop(stk_t * stack);
+void
+handler(int sig);
 
-static void
-tv_norm(struct timeval * tv);
+void
+stats_handler(int sig);
 
-static void
-tv_add(struct timeval * tv1, struct timeval * tv2);
+void
+dump_handler(int sig);
 
-static void
-tv_sub(struct timeval * tv1, struct timeval * tv2);
+void
+stats_dump(ptylie_t * s);
 
 void
-usage(char * prog);
+write_out(const char * buf, ssize_t len);
 
 void
-cleanup(void);
+out_push(const char * buf, size_t len);
 
 void
-handler(int sig);
+out_flush(void);
 
 void
-msg(int type, const char * message, ...);
+out_drain(void);
 
-int
-tty_raw(struct termios * attr, int fd);
+static long long
+now_ns(void);
 
 int
-open_master(void);
+in_send(ptylie_t * s, long long * wait);
 
 void
-read_write(const char * name, int in, int out, int log);
+msg(int type, const char * message, ...);
 
-void
-set_terminal_size(int fd, unsigned width, unsigned height);
+int
+tty_raw(struct termios * attr, int fd);
 
 void
-set_terminal(int fd, struct termios * old_termios);
+set_terminal(void);
 
 void *
 manage_io(void * args);
 
-void
-get_arg(int fd, unsigned char * buf, int * len);
+int
+keys_pause(const struct timespec * delay);
 
 void *
 inject_keys(void * args);
 
 void
-master(int fd_master, int fd_slave, int fdl, int fdc);
+master(ptylie_t * s);
+
+ptylie_t *
+session_new(ptylie_opts_t * opts, int fdc);
+
+void
+target_add(const char * arg);
+
+void
+targets_start(ptylie_t * s, const ptylie_opts_t * opts);
 
 void
-slave(int fd_slave, char ** argv);
+targets_end(void);
+
+void
+bench_record(bench_t * b, ptylie_t * s, long long wall);
+
+static int
+double_comp(const void * ptr1, const void * ptr2);
+
+void
+bench_report(bench_t * b, int warmups);
 
 int
 badopt(const char * mess, int ch);
@@ -104,11 +119,21 @@ badopt(const char * mess, int ch);
 int
 my_getopt(int argc, char * argv[], const char * optstring);
 
-void
-init_etime(void);
+int
+runner_load(const char * file, run_entry_t ** entries);
 
-void
-add_srt_entry(char * buf);
+int
+run_manifest(const char * file, int jobs);
+
+static void *
+replay_unpack(void * args);
+
+int
+replay(const char * log_file, const char * timing_file, double speed,
+       double max_gap, double seek);
+
+int
+unpack(const char * log_file);
 
 int
 main(int argc, char * argv[]);
@@ -117,472 +142,179 @@ main(int argc, char * argv[]);
 /* Definitions */
 /* ----------- */
 
-struct timeval first; /* real time */
-
-/* Terminal settings backups */
-/* """"""""""""""""""""""""" */
-struct termios old_termios_master;
-struct termios old_termios_slave;
+/* Terminal settings backup */
+/* """""""""""""""""""""""" */
+struct termios old_termios;
 
-int fd_termios;
+int fd_termios = -1;
 
 char * my_optarg;     /* global argument pointer. */
 int    my_optind = 0; /* global argv index. */
 int    my_opterr = 1; /* for compatibility, should error be printed? */
 int    my_optopt;     /* for compatibility, option character checked */
 
-struct timeval srt_offset  = { 0 };
-long           offset      = 0;
-int            offset_sign = 1;
-
 enum
 {
   WARN,
   FATAL
 };
 
-/* Structure to pass to thread functions */
-/* """"""""""""""""""""""""""""""""""""" */
-struct args_s
+/* What manage_io does with the output of the child when out_buf is full */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+enum
 {
-  int fd1;
-  int fd2;
+  OUT_BLOCK,   /* stop reading the child until stdout catches up   */
+  OUT_DROP,    /* drop the new output, it is still logged          */
+  OUT_COALESCE /* drop the oldest output to show the latest one    */
 };
 
-/* 255 int positions stack */
-/* """"""""""""""""""""""" */
-struct stk_s
+/* One line of a runner manifest and the result of its execution */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct run_entry_s
 {
-  int nb;
-  int stack[255];
+  char *   cmd_file;
+  char *   log_file;
+  char **  argv;
+  unsigned width;
+  unsigned height;
+
+  long long start;       /* monotonic ns                       */
+  long long due;         /* next injection step (monotonic ns) */
+  long long elapsed;     /* ns                                 */
+  int       script_done; /* 1 when the command file is over    */
+  int       exit_code;
 };
 
-struct map_elem_s
+/* Queue of manifest indexes owned by a worker, the other workers */
+/* can steal from its tail.                                       */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct run_queue_s
 {
-  char * key;
-  char * repl;
+  pthread_mutex_t lock;
+  int *           items;
+  int             head;
+  int             tail;
 };
 
-rb_tree * map_tree;
-
-const char * prog = "ptylie";
-char *       scan = NULL; /* Private scan pointer. */
-
-FILE * srt = NULL;
-FILE * map = NULL;
-
-int srt_on           = 0;
-int default_duration = 300; /* ms */
-int duration;
-
-char * log_file = NULL;
-char * srt_file = NULL;
-
-/* ------------------------------ */
-/* int stack management functions */
-/* ------------------------------ */
-
-void
-stk_init(stk_t * stack)
-{
-  stack->nb = 0;
-}
-
-int
-stk_empty(stk_t * stack)
-{
-  return (stack->nb == 0);
-}
-
-int
-stk_push(stk_t * stack, int fd)
-{
-  if (stack->nb == 255)
-    return -1;
-
-  stack->stack[stack->nb] = fd;
-  stack->nb++;
-
-  return fd;
-}
-
-int
-stk_pop(stk_t * stack)
-{
-  if (stack->nb == 0)
-    return -1;
-
-  stack->nb--;
-
-  return stack->stack[stack->nb];
-}
-
-/* ----------------------------- */
-/* Timeval management functions. */
-/* ----------------------------- */
-
-/* ==================================== */
-/* Ensures that 0 <= tv_usec < 1000000. */
-/* ==================================== */
-static void
-tv_norm(struct timeval * tv)
+struct runner_s
 {
-  if (tv->tv_usec >= 1000000)
-  {
-    tv->tv_sec += tv->tv_usec / 1000000;
-    tv->tv_usec %= 1000000;
-  }
-  else if (tv->tv_usec < 0)
-  {
-    tv->tv_usec = 0;
-  }
-}
+  run_entry_t * entries;
+  int           nb_entries;
+  run_queue_t * queues;
+  int           nb_workers;
+  int           max_active; /* sessions per worker */
+};
 
-/* ======================= */
-/* timeval add tv2 to tv1. */
-/* ======================= */
-static void
-tv_add(struct timeval * tv1, struct timeval * tv2)
+struct runner_arg_s
 {
-  /* Ensures that 0 <= usec < 1000000. */
-  /* """"""""""""""""""""""""""""""""" */
-  tv_norm(tv1);
-  tv_norm(tv2);
-
-  tv1->tv_sec += tv2->tv_sec;
-  tv1->tv_usec += tv2->tv_usec;
-
-  if (tv1->tv_usec >= 1000000)
-  {
-    tv1->tv_sec++;
-    tv1->tv_usec -= 1000000;
-  }
-}
+  runner_t * runner;
+  int        worker;
+};
 
-/* ========================= */
-/* timeval sub tv2 from tv1. */
-/* ========================= */
-static void
-tv_sub(struct timeval * tv1, struct timeval * tv2)
+/* Another program driven by the command file (-a), in its own PTY */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct target_s
 {
-  /* Ensures that 0 <= usec < 1000000. */
-  /* """"""""""""""""""""""""""""""""" */
-  tv_norm(tv1);
-  tv_norm(tv2);
-
-  tv1->tv_sec -= tv2->tv_sec;
-  tv1->tv_usec -= tv2->tv_usec;
-
-  if (tv1->tv_usec < 0)
-  {
-    tv1->tv_sec--;
-    tv1->tv_usec += 1000000;
-  }
-}
+  char *     name;
+  char **    argv;
+  ptylie_t * s;  /* session of the current run         */
+  int        fd; /* master side of its PTY, -1 if over */
+};
 
-/* =============== */
-/* init the timer. */
-/* =============== */
-void
-init_etime(void)
-{
-  gettimeofday(&first, NULL);
-  if (offset_sign > 0)
-    tv_sub(&first, &srt_offset);
-  else
-    tv_add(&first, &srt_offset);
-}
+#define BENCH_METRICS 35 /* wall time, CPU time, RSS then 32 phases */
 
-/* ================================================ */
-/* return elapsed seconds since call to init_etime. */
-/* ================================================ */
-void
-add_srt_entry(char * buf)
+/* Samples of the measured runs of -N, one column per metric, -1 */
+/* when a metric is not available for a run.                     */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct bench_s
 {
-  static unsigned c = 1;
-  int             h1, m1;
-  int             h2, m2;
-  long            s1, ms1;
-  long            s2, ms2;
-
-  long etime;
-
-  struct timeval curr;
-
-  gettimeofday(&curr, NULL);
-  etime =
-    (curr.tv_sec - first.tv_sec) * 1000000L + (curr.tv_usec - first.tv_usec);
-
-  etime /= 1000;
-
-  h1  = (int)(etime / 3600000);
-  m1  = (int)((etime - h1 * 3600000) / 60000);
-  s1  = (etime - h1 * 3600000 - m1 * 60000) / 1000;
-  ms1 = etime - h1 * 3600000 - m1 * 60000 - s1 * 1000;
-
-  etime += duration;
-
-  h2  = (int)(etime / 3600000);
-  m2  = (int)((etime - h2 * 3600000) / 60000);
-  s2  = (etime - h2 * 3600000 - m2 * 60000) / 1000;
-  ms2 = etime - h2 * 3600000 - m2 * 60000 - s2 * 1000;
+  int      runs;   /* runs recorded so far          */
+  int      nb;     /* metrics named in names        */
+  int      warmup; /* 1 if a warmup run was added   */
+  char *   names[BENCH_METRICS];
+  double * samples; /* runs x BENCH_METRICS values */
+};
 
-  fprintf(srt,
-          "%u\n"
-          "%02d:%02d:%02ld,%03ld --> "
-          "%02d:%02d:%02ld,%03ld\n"
-          "%s\n\n",
-          c++, h1, m1, s1, ms1, h2, m2, s2, ms2, buf);
-}
+const char * prog = "ptylie";
+char *       scan = NULL; /* Private scan pointer. */
 
-/* ----------------- */
-/* Utility functions */
-/* ----------------- */
+char * log_file = NULL;
+char * srt_file = NULL;
+char * ctl_path = NULL;
 
-/* ========================================================= */
-/* Decode the number of bytes taken by a character (UTF-8)   */
-/* It is the length of the leading sequence of bits set to 1 */
-/* (Count Leading Ones)                                      */
-/* ========================================================= */
-static int
-mb_get_length(unsigned char c)
-{
-  if (c >= 0xf0)
-    return 4;
-  else if (c >= 0xe0)
-    return 3;
-  else if (c >= 0xc2)
-    return 2;
-  else
-    return 1;
-}
+char * timing_file = NULL; /* timing of the log (-t) */
 
-static const char trailing_bytes_for_utf8[256] = {
-  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
-  2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5
-};
+long start_wait = 5000; /* max ms waited for the child to be ready (-G) */
 
-/* ================================================================= */
-/* UTF8 validation routine inspired by Jeff Bezanson                 */
-/*   placed in the public domain Fall 2005                           */
-/*   (https://github.com/JeffBezanson/cutef8)                        */
-/*                                                                   */
-/* Returns 1 if str contains a valid UTF8 byte sequence, 0 otherwise */
-/* ================================================================= */
-static int
-mb_validate(const char * str, int length)
-{
-  const unsigned char *p, *pend = (unsigned char *)str + length;
-  unsigned char        c;
-  int                  ab;
+char * snap_file     = NULL; /* screen snapshots (-D)             */
+int    snap_format   = PTYLIE_SNAP_TEXT;
+long   snap_interval = 0; /* ms between two snapshots (-I) */
 
-  for (p = (unsigned char *)str; p < pend; p++)
-  {
-    c = *p;
-    if (c < 128)
-      continue;
-    if ((c & 0xc0) != 0xc0)
-      return 0;
-    ab = trailing_bytes_for_utf8[c];
-    if (length < ab)
-      return 0;
-    length -= ab;
-
-    p++;
-    /* Check top bits in the second byte */
-    /* """"""""""""""""""""""""""""""""" */
-    if ((*p & 0xc0) != 0x80)
-      return 0;
+char * trace_file = NULL; /* timeline of the session (-T) */
 
-    /* Check for overlong sequences for each different length */
-    /* """""""""""""""""""""""""""""""""""""""""""""""""""""" */
-    switch (ab)
-    {
-      /* Check for xx00 000x */
-      /* """"""""""""""""""" */
-      case 1:
-        if ((c & 0x3e) == 0)
-          return 0;
-        continue; /* We know there aren't any more bytes to check */
-
-      /* Check for 1110 0000, xx0x xxxx */
-      /* """""""""""""""""""""""""""""" */
-      case 2:
-        if (c == 0xe0 && (*p & 0x20) == 0)
-          return 0;
-        break;
+char * latency_file = NULL; /* per key latency profile (-L) */
 
-      /* Check for 1111 0000, xx00 xxxx */
-      /* """""""""""""""""""""""""""""" */
-      case 3:
-        if (c == 0xf0 && (*p & 0x30) == 0)
-          return 0;
-        break;
+char * render_file = NULL; /* per key render cost (-A) */
 
-      /* Check for 1111 1000, xx00 0xxx */
-      /* """""""""""""""""""""""""""""" */
-      case 4:
-        if (c == 0xf8 && (*p & 0x38) == 0)
-          return 0;
-        break;
+char * transcript_file = NULL; /* plain text of the output (-X) */
 
-      /* Check for leading 0xfe or 0xff,   */
-      /* and then for 1111 1100, xx00 00xx */
-      /* """"""""""""""""""""""""""""""""" */
-      case 5:
-        if (c == 0xfe || c == 0xff || (c == 0xfc && (*p & 0x3c) == 0))
-          return 0;
-        break;
-    }
+char * sample_file     = NULL; /* resources of the child (-P) */
+long   sample_interval = 100;  /* ms between two samples (-Q) */
 
-    /* Check for valid bytes after the 2nd, if any; all must start 10 */
-    /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
-    while (--ab > 0)
-    {
-      if ((*(++p) & 0xc0) != 0x80)
-        return 0;
-    }
-  }
+char * cmd_file = NULL; /* reopened for each repeated run */
+int    runs     = 1;    /* -N */
+int    warmups  = 0;    /* -W */
 
-  return 1;
-}
+char * stats_file   = NULL; /* counters dumps (-S), - for stderr */
+int    stats_format = PTYLIE_STATS_TEXT;
 
-/* ======================================================================== */
-/* unicode (UTF-8) ascii representation interprer.                          */
-/* The string passed will be altered but will not move in memory            */
-/* All sequence of \uxx, \uxxxx, \uxxxxxx and \uxxxxxxxx will be replace by */
-/* the corresponding UTF-8 character.                                       */
-/* ======================================================================== */
-void
-mb_interpret(char * s)
-{
-  char * utf8_str;          /* \uxx...                                        */
-  size_t utf8_to_eos_len;   /* bytes in s starting from the first             *
-                             * occurrence of \u                               */
-  size_t init_len;          /* initial lengths of the string to interpret     */
-  size_t utf8_ascii_len;    /* 2,4,6 or 8 bytes                               */
-  size_t len_to_remove = 0; /* number of bytes to remove after the conversion */
-  char   tmp[9];            /* temporary string                               */
-
-  /* Guard against the case where s is NULL */
-  /* """""""""""""""""""""""""""""""""""""" */
-  if (s == NULL)
-    return;
+volatile sig_atomic_t stats_asked = 0; /* set by SIGUSR1 */
 
-  init_len = strlen(s);
+size_t                ring_size  = 0; /* log kept in memory (-C), bytes */
+volatile sig_atomic_t dump_asked = 0; /* set by SIGUSR2                 */
 
-  while ((utf8_str = strstr(s, "\\u")) != NULL)
-  {
-    utf8_to_eos_len = strlen(utf8_str);
-    if (utf8_to_eos_len
-        < 4) /* string too short to contain a valid UTF-8 char */
-    {
-      *utf8_str       = '.';
-      *(utf8_str + 1) = '\0';
-    }
-    else /* s is long enough */
-    {
-      unsigned byte;
-      char *   utf8_seq_offset = utf8_str + 2;
+target_t * targets    = NULL; /* -a */
+int        targets_nb = 0;
 
-      /* Get the first 2 utf8 bytes */
-      *tmp       = *utf8_seq_offset;
-      *(tmp + 1) = *(utf8_seq_offset + 1);
-      *(tmp + 2) = '\0';
+/* Counters of manage_io, they are only updated by its thread */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+unsigned long long wakeups        = 0; /* returns of pselect       */
+unsigned long long stdout_bytes   = 0; /* bytes written on stdout  */
+unsigned long long stdout_partial = 0; /* partial writes on stdout */
+unsigned long long stdout_stalls  = 0; /* times out_buf was full   */
+unsigned long long stdout_dropped = 0; /* bytes not shown (-O)     */
 
-      /* If they are invalid, replace the \u sequence by a dot */
-      /* """"""""""""""""""""""""""""""""""""""""""""""""""""" */
-      if (!isxdigit(tmp[0]) || !isxdigit(tmp[1]))
-      {
-        *utf8_str = '.';
-        if (4 >= utf8_to_eos_len)
-          *(utf8_str + 1) = '\0';
-        else
-          memmove(utf8_str, utf8_str + 4, utf8_to_eos_len - 4);
-        return;
-      }
-      else
-      {
-        /* They are valid, deduce from them the length of the sequence */
-        /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
-        sscanf(tmp, "%2x", &byte);
-        utf8_ascii_len = mb_get_length(byte) * 2;
-
-        /* Check again if the inputs string is long enough */
-        /* """"""""""""""""""""""""""""""""""""""""""""""" */
-        if (utf8_to_eos_len - 2 < utf8_ascii_len)
-        {
-          *utf8_str       = '.';
-          *(utf8_str + 1) = '\0';
-        }
-        else
-        {
-          /* replace the \u sequence by the bytes forming the UTF-8 char */
-          /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
-          size_t i;
-          *tmp = byte;
-
-          /* Put the bytes in the tmp string */
-          /* ''''''''''''''''''''''''''''''' */
-          for (i = 1; i < utf8_ascii_len / 2; i++)
-          {
-            sscanf(utf8_seq_offset + 2 * i, "%2x", &byte);
-            *(tmp + i) = byte;
-          }
-          tmp[utf8_ascii_len / 2] = '\0';
-
-          /* Does they form a valid UTF-8 char? */
-          /* '''''''''''''''''''''''''''''''''' */
-          if (mb_validate(tmp, utf8_ascii_len / 2))
-          {
-            /* Put them back in the original string and move */
-            /* the remaining bytes after them                */
-            /* ''''''''''''''''''''''''''''''''''''''''''''' */
-            memmove(utf8_str, tmp, utf8_ascii_len / 2);
-
-            if (utf8_to_eos_len < utf8_ascii_len)
-              *(utf8_str + utf8_ascii_len / 2 + 1) = '\0';
-            else
-              memmove(utf8_str + utf8_ascii_len / 2,
-                      utf8_seq_offset + utf8_ascii_len,
-                      utf8_to_eos_len - utf8_ascii_len - 2 + 1);
-          }
-          else
-          {
-            /* The invalid sequence is replaced by a dot */
-            /* ''''''''''''''''''''''''''''''''''''''''' */
-            *utf8_str = '.';
-            if (utf8_to_eos_len < utf8_ascii_len)
-              *(utf8_str + 1) = '\0';
-            else
-              memmove(utf8_str + 1, utf8_seq_offset + utf8_ascii_len,
-                      utf8_to_eos_len - utf8_ascii_len - 2 + 1);
-            utf8_ascii_len = 2;
-          }
-        }
+/* The output of the child waits in this ring buffer until the non */
+/* blocking stdout accepts it, so that a slow terminal does not    */
+/* slow the child down (see out_policy).                           */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+int    out_policy = OUT_BLOCK; /* -O                                 */
+size_t out_size   = 1 << 20;   /* -B, in bytes                       */
+char * out_buf    = NULL;
+size_t out_head   = 0;  /* first pending byte                        */
+size_t out_len    = 0;  /* number of pending bytes                   */
+int    out_flags  = -1; /* stdout flags to restore, -1 if unchanged  */
 
-        /* Update the number of bytes to remove at the end */
-        /* of the initial string                           */
-        /* """"""""""""""""""""""""""""""""""""""""""""""" */
-        len_to_remove += 2 + utf8_ascii_len / 2;
-      }
-    }
-  }
+/* Standard input waiting to be sent to the child, read only when the */
+/* previous chunk has been sent so that -R can pace it.               */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+char      in_buf[BUFSIZ];
+size_t    in_pos    = 0; /* first byte to send                       */
+size_t    in_len    = 0; /* end of the pending bytes                 */
+double    in_rate   = 0; /* bytes or lines per second, 0: no limit   */
+int       in_lines  = 0; /* 1 if in_rate counts lines                */
+int       in_eot    = 0; /* 1 to send EOT at the end of stdin (-E)   */
+double    in_credit = 0; /* bytes or lines which can be sent now     */
+long long in_last   = 0; /* time of the last in_credit update        */
 
-  /* Make sure that the string is well terminated */
-  /* """""""""""""""""""""""""""""""""""""""""""" */
-  *(s + init_len - len_to_remove) = '\0';
+/* End of the child, set by manage_io. done_cond uses the monotonic */
+/* clock (see master).                                              */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  done_cond;
+int             child_done   = 0;
+int             child_status = 0; /* exit code, 128 + signal if killed */
 
-  return;
-}
 /* =============================================== */
 /* Displays a small help and terminate the program */
 /* =============================================== */
@@ -590,12 +322,25 @@ void
 usage(char * prog)
 {
   fprintf(stderr,
-          "Usage: %s [-l log_file] "
+          "Usage: %s [-l log_file [-z]] "
           "[-w terminal_width] "
           "[-h terminal_height] \\\n"
-          "         -i command_file program_to_launch "
-          "program_arguments\n",
-          prog);
+          "         [-c control_socket] "
+          "[-D snapshot_file [-f text|json] [-I interval]] \\\n"
+          "         [-t timing_file] [-v] "
+          "[-S stats_file [-F text|openmetrics]] \\\n"
+          "         [-T trace_file] [-B KB] [-O block|drop|coalesce] "
+          "[-E] [-R rate[l]] \\\n"
+          "         [-G ms] [-L latency_file] [-N runs [-W warmups]] "
+          "[-P sample_file [-Q ms]] \\\n"
+          "         [-A render_file] [-X transcript_file] [-C MB] "
+          "[-a name=program ...] \\\n"
+          "         -i command_file program_to_launch program_arguments\n"
+          "       %s [-j jobs] [-p pool_size] [-G ms] -M manifest\n"
+          "       %s [-x speed] [-g max_gap] [-k seek] "
+          "-t timing_file -r log_file\n"
+          "       %s -U log_file\n",
+          prog, prog, prog, prog);
   exit(EXIT_FAILURE);
 }
 
@@ -605,8 +350,16 @@ usage(char * prog)
 void
 cleanup(void)
 {
-  tcsetattr(fd_termios, TCSANOW, &old_termios_master);
-  tcsetattr(fd_termios, TCSANOW, &old_termios_slave);
+  if (fd_termios != -1)
+    tcsetattr(fd_termios, TCSANOW, &old_termios);
+
+  if (out_flags != -1)
+    fcntl(1, F_SETFL, out_flags);
+
+  /* The process may exit without freeing the session */
+  /* """""""""""""""""""""""""""""""""""""""""""""""" */
+  if (ctl_path != NULL)
+    unlink(ctl_path);
 }
 
 /* ===================== */
@@ -615,10 +368,108 @@ cleanup(void)
 void
 handler(int sig)
 {
+  (void)sig;
+
   cleanup();
   exit(EXIT_FAILURE);
 }
 
+/* ============================================================= */
+/* SIGUSR1 signal handler, the dump is done by manage_io as only */
+/* its thread accepts the signal (see master).                   */
+/* ============================================================= */
+void
+stats_handler(int sig)
+{
+  (void)sig;
+
+  stats_asked = 1;
+}
+
+/* ============================================================ */
+/* SIGUSR2 signal handler, the log kept in memory is written by */
+/* manage_io as for SIGUSR1.                                    */
+/* ============================================================ */
+void
+dump_handler(int sig)
+{
+  (void)sig;
+
+  dump_asked = 1;
+}
+
+/* ================================================================= */
+/* Writes the counters of the session and those of manage_io in the */
+/* stats file. The file is replaced atomically so that it can be    */
+/* read at any time by a collector. As the program can be setuid,   */
+/* the temporary file must be a new file, a stale one is only       */
+/* removed if it is a regular file of the real user.                */
+/* ================================================================= */
+void
+stats_dump(ptylie_t * s)
+{
+  FILE *      out;
+  char *      tmp = NULL;
+  int         om  = stats_format == PTYLIE_STATS_OPENMETRICS;
+  int         fd;
+  struct stat st;
+
+  if (strcmp(stats_file, "-") == 0)
+    out = stderr;
+  else
+  {
+    tmp = malloc(strlen(stats_file) + 5);
+    sprintf(tmp, "%s.tmp", stats_file);
+
+    if (lstat(tmp, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == getuid())
+      unlink(tmp);
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+              S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1 || (out = fdopen(fd, "w")) == NULL)
+    {
+      msg(WARN, "Cannot open %s\r", tmp);
+      if (fd != -1)
+        close(fd);
+      free(tmp);
+      return;
+    }
+
+    fchown(fd, getuid(), getgid());
+  }
+
+  ptylie_stats(s, out, stats_format);
+
+  fprintf(out,
+          om ? "# TYPE ptylie_wakeups counter\n"
+               "ptylie_wakeups_total %llu\n"
+               "# TYPE ptylie_stdout_bytes counter\n"
+               "ptylie_stdout_bytes_total %llu\n"
+               "# TYPE ptylie_stdout_partial_writes counter\n"
+               "ptylie_stdout_partial_writes_total %llu\n"
+               "# TYPE ptylie_stdout_stalls counter\n"
+               "ptylie_stdout_stalls_total %llu\n"
+               "# TYPE ptylie_stdout_dropped_bytes counter\n"
+               "ptylie_stdout_dropped_bytes_total %llu\n"
+               "# EOF\n"
+             : "wakeups=%llu\n"
+               "stdout_bytes=%llu\n"
+               "stdout_partial_writes=%llu\n"
+               "stdout_stalls=%llu\n"
+               "stdout_dropped_bytes=%llu\n",
+          wakeups, stdout_bytes, stdout_partial, stdout_stalls,
+          stdout_dropped);
+
+  if (out == stderr)
+    fflush(out);
+  else
+  {
+    if (fclose(out) != 0 || rename(tmp, stats_file) == -1)
+      msg(WARN, "Cannot write %s\r", stats_file);
+    free(tmp);
+  }
+}
+
 /* ================================================================ */
 /* printf like function to display fatal messages and terminate the */
 /* program.                                                         */
@@ -654,77 +505,12 @@ tty_raw(struct termios * attr, int fd)
   return tcsetattr(fd, TCSANOW, attr);
 }
 
-/* ================================= */
-/* Obtain the master file descriptor */
-/* ================================= */
-int
-open_master(void)
-{
-  int rc, fd_master;
-
-  fd_master = posix_openpt(O_RDWR);
-  if (fd_master < 0)
-    msg(FATAL, "Error %d on posix_openpt()", errno);
-
-  rc = grantpt(fd_master);
-  if (rc != 0)
-    msg(FATAL, "Error %d on grantpt()", errno);
-
-  rc = unlockpt(fd_master);
-  if (rc != 0)
-    msg(FATAL, "Error %d on unlockpt()", errno);
-
-  return fd_master;
-}
-
 /* ======================================================= */
-/* Utility function that Reads bytes from in an write them */
-/* to out and log                                          */
+/* Terminal initialization: puts the user's terminal in    */
+/* raw mode after having saved its settings for cleanup(). */
 /* ======================================================= */
 void
-read_write(const char * name, int in, int out, int log)
-{
-  char input[128];
-  int  rc;
-
-  rc = read(in, input, sizeof input);
-  if (rc < 0)
-  {
-    if (errno == EIO)
-      exit(0);
-
-    msg(FATAL, "Error %d on read %s", errno, name);
-  }
-
-  write(out, input, rc);
-  write(log, input, rc);
-}
-
-void
-set_terminal_size(int fd, unsigned width, unsigned height)
-{
-  struct winsize ws = { 24, 80, 0, 0 };
-
-  /* Set the default terminal geometry */
-  /* """"""""""""""""""""""""""""""""" */
-  if (height == 0 && width == 0)
-  {
-    height = 24;
-    width  = 80;
-  }
-
-  /* Set terminal size to the pty. */
-  /* """"""""""""""""""""""""""""" */
-  ws.ws_row = height;
-  ws.ws_col = width;
-  ioctl(fd, TIOCSWINSZ, &ws);
-}
-
-/* ======================= */
-/* Terminal initialization */
-/* ======================= */
-void
-set_terminal(int fd, struct termios * old_termios)
+set_terminal(void)
 {
   struct termios   new_termios;
   int              rc;
@@ -739,7 +525,7 @@ set_terminal(int fd, struct termios * old_termios)
 
   /* Save the defaults parameters to be able to restore then on exit */
   /* and in case of reception of an INT signal.                      */
-  rc = tcgetattr(fd, old_termios);
+  rc = tcgetattr(fd_termios, &old_termios);
   if (rc == -1)
     msg(FATAL, "Error %d on tcgetattr()", errno);
 
@@ -752,705 +538,1426 @@ set_terminal(int fd, struct termios * old_termios)
 
   /* Set RAW mode */
   /* """""""""""" */
-  new_termios = *old_termios;
-  if (tty_raw(&new_termios, 0) == -1)
-    msg(FATAL, "Cannot set %s in raw mode", fd);
+  new_termios = old_termios;
+  if (tty_raw(&new_termios, fd_termios) == -1)
+    msg(FATAL, "Cannot set %d in raw mode", fd_termios);
 }
 
 /* ================================================================= */
-/* This function is responsible to send and receive io in the master */
-/* part. The hard work is done by the read_write function.           */
+/* Copies len bytes on the standard output, waiting for it to become */
+/* writable when it is full.                                         */
 /* ================================================================= */
-void *
-manage_io(void * args)
+void
+write_out(const char * buf, ssize_t len)
 {
+  struct pollfd pfd = { 1, POLLOUT, 0 };
+  ssize_t       rc;
 
-  fd_set fd_in;
-  int    fd_master = ((struct args_s *)args)->fd1;
-  int    fdl       = ((struct args_s *)args)->fd2;
-
-  for (;;)
+  while (len > 0)
   {
-    /* Wait for data from standard input and master side of PTY */
-    /* """""""""""""""""""""""""""""""""""""""""""""""""""""""" */
-    FD_ZERO(&fd_in);
-    FD_SET(0, &fd_in);
-    FD_SET(fd_master, &fd_in);
-
-    if (select(fd_master + 1, &fd_in, NULL, NULL, NULL) == -1)
-      msg(FATAL, "Error %d on select()", errno);
-
-    /* If data on standard input */
-    /* """"""""""""""""""""""""" */
-    if (FD_ISSET(0, &fd_in))
-      read_write("standard input", 0, fd_master, fdl);
+    rc = write(1, buf, len);
+    if (rc == -1 && errno == EAGAIN)
+    {
+      poll(&pfd, 1, -1);
+      continue;
+    }
+    if (rc == -1 && errno == EINTR)
+      continue;
+    if (rc == -1)
+      return;
 
-    /* If data on master side of PTY */
-    /* """"""""""""""""""""""""""""" */
-    if (FD_ISSET(fd_master, &fd_in))
-      read_write("master pty", fd_master, 1, fdl);
+    if (rc < len)
+      stdout_partial++;
+    stdout_bytes += rc;
+    buf += rc;
+    len -= rc;
   }
-
-  return NULL;
 }
 
-/* ===================================================================== */
-/* get the directive argument that must be found starting at the current */
-/* fd position and ending before the next ']'.                           */
-/*                                                                       */
-/* fd  (IN)  file desctiptor to work on.                                 */
-/* buf (OUT) output null terminated buffer.                              */
-/* len (OUT) size in byte of the argument found.                         */
-/*                                                                       */
-/* NOTE: a missing trailing ']' is silently ignored and at most 4096     */
-/*       byte will be read.                                              */
-/*                                                                       */
-/* TODO: Make this more robust and generic                               */
-/* ===================================================================== */
+/* ================================================================= */
+/* Appends len bytes of output of the child to out_buf. When they do */
+/* not fit, out_policy tells what to drop, manage_io guarantees the  */
+/* room in the OUT_BLOCK case.                                       */
+/* ================================================================= */
 void
-get_arg(int fd, unsigned char * buf, int * len)
+out_push(const char * buf, size_t len)
 {
-  int data = '\0';
-  int rc   = 0;
+  size_t room = out_size - out_len;
+  size_t tail, n;
 
-  *len = 0;
-
-  while (rc != -1 && data != ']' && *len < 4096)
+  if (len > room)
   {
-    rc = read(fd, &data, 1);
-    if (rc == -1 || rc == 0)
-      break;
-    buf[(*len)++] = (unsigned char)data;
-  }
-  buf[*len] = '\0';
-}
-
-int
-map_elem_comp(const void * ptr1, const void * ptr2)
-{
-  map_elem_t * d1 = (map_elem_t *)ptr1;
-  map_elem_t * d2 = (map_elem_t *)ptr2;
-  return strcmp(d1->key, d2->key);
-}
+    stdout_stalls++;
 
+    if (out_policy == OUT_DROP)
+    {
+      stdout_dropped += len;
+      return;
+    }
+    else if (out_policy == OUT_COALESCE)
+    {
+      size_t cut = len - room; /* oldest pending bytes to drop */
+
+      if (len > out_size)
+      {
+        stdout_dropped += len - out_size;
+        buf += len - out_size;
+        len = out_size;
+        cut = out_len;
+      }
+
+      /* Resume the display at the beginning of a line if possible */
+      /* ''''''''''''''''''''''''''''''''''''''''''''''''''''''''' */
+      while (cut < out_len && out_buf[(out_head + cut - 1) % out_size] != '\n')
+        cut++;
+
+      stdout_dropped += cut;
+      out_head = (out_head + cut) % out_size;
+      out_len -= cut;
+    }
+    else
+    {
+      out_drain();
+      write_out(buf, len);
+      return;
+    }
+  }
+
+  tail = (out_head + out_len) % out_size;
+  n    = len < out_size - tail ? len : out_size - tail;
+  memcpy(out_buf + tail, buf, n);
+  memcpy(out_buf, buf + n, len - n);
+  out_len += len;
+}
+
+/* ================================================================ */
+/* Writes as much of out_buf as stdout accepts without blocking.    */
+/* ================================================================ */
+void
+out_flush(void)
+{
+  ssize_t rc;
+  size_t  n;
+
+  while (out_len > 0)
+  {
+    n  = out_len < out_size - out_head ? out_len : out_size - out_head;
+    rc = write(1, out_buf + out_head, n);
+    if (rc == -1 && errno == EINTR)
+      continue;
+    if (rc == -1 && errno == EAGAIN)
+      return;
+    if (rc == -1)
+    {
+      /* stdout is unusable, forget the pending output */
+      /* ''''''''''''''''''''''''''''''''''''''''''''' */
+      stdout_dropped += out_len;
+      out_len = 0;
+      return;
+    }
+
+    if ((size_t)rc < n)
+      stdout_partial++;
+    stdout_bytes += rc;
+    out_head = (out_head + rc) % out_size;
+    out_len -= rc;
+    if ((size_t)rc < n)
+      return;
+  }
+}
+
+/* ================================================================ */
+/* Writes all the pending content of out_buf, waiting if needed.    */
+/* ================================================================ */
 void
-map_elem_free(void * ptr)
+out_drain(void)
 {
-  map_elem_t * d = (map_elem_t *)ptr;
-  free(d->key);
-  free(d->repl);
+  size_t n;
+
+  while (out_len > 0)
+  {
+    n = out_len < out_size - out_head ? out_len : out_size - out_head;
+    write_out(out_buf + out_head, n);
+    out_head = (out_head + n) % out_size;
+    out_len -= n;
+  }
 }
 
 /* ================================================================= */
-/* Injects keys in the slave's keyboard buffer, we need to have root */
-/* privileges to do that.                                            */
-/* Manages also some special additional directives (\s, \S, ...)     */
+/* Sends to the child the part of in_buf allowed by the rate given  */
+/* with -R. When bytes remain, *wait is set to the ns to wait before */
+/* calling again, otherwise to -1.                                   */
+/* Returns the ptylie_write error code or 0.                         */
+/* ================================================================= */
+int
+in_send(ptylie_t * s, long long * wait)
+{
+  size_t  n = in_len - in_pos;
+  ssize_t rc;
+
+  if (in_rate > 0)
+  {
+    long long now   = now_ns();
+    double    burst = in_rate / 10 > 1 ? in_rate / 10 : 1; /* 100 ms */
+
+    in_credit += (now - in_last) / 1e9 * in_rate;
+    if (in_credit > burst)
+      in_credit = burst;
+    in_last = now;
+
+    if (in_lines)
+    {
+      /* A line without its newline yet counts as a full line */
+      /* '''''''''''''''''''''''''''''''''''''''''''''''''''' */
+      char * eol;
+
+      for (n = 0; in_credit >= 1 && in_pos + n < in_len; in_credit -= 1)
+      {
+        eol = memchr(in_buf + in_pos + n, '\n', in_len - in_pos - n);
+        n   = eol != NULL ? (size_t)(eol - in_buf) + 1 - in_pos
+                          : in_len - in_pos;
+      }
+    }
+    else
+    {
+      if (n > in_credit)
+        n = (size_t)in_credit;
+      in_credit -= n;
+    }
+  }
+
+  if (n > 0)
+  {
+    if ((rc = ptylie_write(s, in_buf + in_pos, n)) < 0)
+      return rc;
+    in_pos += rc;
+  }
+
+  if (in_pos == in_len)
+  {
+    in_pos = in_len = 0;
+    *wait  = -1;
+  }
+  else if (in_rate > 0 && in_credit < 1)
+    *wait = (1 - in_credit) / in_rate * 1e9;
+  else
+    *wait = 1000000; /* the child does not read fast enough */
+
+  return 0;
+}
+
+/* ================================================================= */
+/* This function is responsible to send and receive io in the master */
+/* part: the standard input is sent to the child and its output is   */
+/* copied on the standard output, both are logged by libptylie.      */
+/* The output of the targets (-a) is only logged.                    */
+/* It ends as soon as the child ends, after having relayed its last  */
+/* output, and wakes inject_keys up.                                 */
 /* ================================================================= */
 void *
-inject_keys(void * args)
+manage_io(void * args)
 {
-  int           data;
-  int           rc;
-  int           i;
-  int           l, len;
-  int           n;
-  unsigned char c;
-  unsigned char buf[4096];
-  unsigned char vbuf[4096];
-  unsigned char scanf_buf[4096];
-  char          tmp[256];
-  char          rows[4], cols[4];
-  int           special      = 0;
-  int           meta         = 0;
-  int           control      = 0;
-  long          sleep_time   = 0;
-  time_t        sleep_time_s = 0;
-  long          sleep_time_n = 0;
-
-  char * v_empty = "";
-  char * v_space = "\xe2\x90\xa3";
-  char * v_ht    = "\xe2\x87\xa5";
-  char * v_lf    = "\xe2\x8f\x8e";
-  char * v_cr    = "\xe2\x90\x8d";
-  char * v_bs    = "\xe2\x8c\xab";
-  char * v_esc   = "ESC";
-
-  char * format;
-
-  char * srt_buf_prt = v_empty;
-
-  stk_t fd_stack; /* int stack to remember nested file descriptors *
-                   * used by the 'R' command                       */
-
-  int fd  = ((struct args_s *)args)->fd1;
-  int fdc = ((struct args_s *)args)->fd2;
-
-  struct winsize ws;
-
-  rb_tree *  map_tree = new_rb_tree(map_elem_comp);
-  map_elem_t elem;
-
-  stk_init(&fd_stack);
-
-  /* Sleep for 1/10 s to let a chance to the child program to start.  */
-  /* If it is not enough you can always begin the command file with a */
-  /* appropriate sleep directive (\S[...].                            */
+  fd_set          fd_in;
+  fd_set          fd_out;
+  ptylie_t *      s        = args;
+  int             fd       = ptylie_fd(s);
+  int             fd_exit  = ptylie_exit_fd(s);
+  int             nfds     = (fd > fd_exit ? fd : fd_exit) + 1;
+  int             reaped   = 0;
+  int             stdin_on = 1;  /* 0 once the end of stdin is reached */
+  int             full     = 0;  /* 1 while the child is not read      */
+  long long       wait     = -1; /* ns before in_send, -1 if idle      */
+  char            buf[BUFSIZ];
+  ssize_t         rc;
+  sigset_t        mask;
+  struct timespec ts;
+  int             i;
+
+  /* SIGUSR1 and SIGUSR2 are blocked in all the threads (see master), */
+  /* pselect unblocks them only while waiting.                        */
   /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
-  nanosleep((const struct timespec[]){ { 0, 100000000L } }, NULL);
+  pthread_sigmask(SIG_BLOCK, NULL, &mask);
+  sigdelset(&mask, SIGUSR1);
+  sigdelset(&mask, SIGUSR2);
+
+  if (nfds < 2)
+    nfds = 2;
+  for (i = 0; i < targets_nb; i++)
+    if (targets[i].fd >= nfds)
+      nfds = targets[i].fd + 1;
 
-  /* parse the command file and send keystokes to the child or sleep */
-  /* for an amount of time.                                          */
-  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
   for (;;)
   {
-    rc = read(fdc, &data, 1);
+    long long timeout = wait;
+    /* Wait for data from standard input and master side of PTY and */
+    /* for stdout to accept the pending output. In OUT_BLOCK mode   */
+    /* the child is not read while out_buf cannot take a full read. */
+    /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    FD_ZERO(&fd_in);
+    FD_ZERO(&fd_out);
+    if (stdin_on && in_len == 0)
+      FD_SET(0, &fd_in);
+    if (out_policy != OUT_BLOCK || out_size - out_len >= sizeof buf)
+      FD_SET(fd, &fd_in);
+    else if (!full)
+    {
+      full = 1;
+      stdout_stalls++;
+    }
+    if (out_len > 0)
+      FD_SET(1, &fd_out);
+    for (i = 0; i < targets_nb; i++)
+      if (targets[i].fd != -1)
+        FD_SET(targets[i].fd, &fd_in);
+
+    /* Without pidfd the end of the child is checked every 50 ms */
+    /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    if (fd_exit != -1)
+      FD_SET(fd_exit, &fd_in);
+    else if (timeout < 0 || timeout > 50000000LL)
+      timeout = 50000000LL;
+
+    ts.tv_sec  = timeout / 1000000000LL;
+    ts.tv_nsec = timeout % 1000000000LL;
+
+    rc = pselect(nfds, &fd_in, &fd_out, NULL, timeout >= 0 ? &ts : NULL,
+                 &mask);
+    if (rc == -1 && errno != EINTR)
+      msg(FATAL, "Error %d on select()", errno);
+
+    if (stats_asked)
+    {
+      stats_asked = 0;
+      stats_dump(s);
+    }
+
+    if (dump_asked)
+    {
+      dump_asked = 0;
+      if (ptylie_dump(s) != PTYLIE_OK)
+        msg(WARN, "\r\n%s\r", ptylie_errmsg(s));
+    }
+
     if (rc == -1)
+      continue;
+
+    wakeups++;
+
+    /* If the child has ended */
+    /* """""""""""""""""""""" */
+    if ((fd_exit == -1 || FD_ISSET(fd_exit, &fd_in))
+        && ptylie_wait(s, &child_status, 0) == PTYLIE_OK)
+    {
+      reaped = 1;
       break;
-    if (rc == 0)
+    }
+
+    /* If stdout can take more output */
+    /* """""""""""""""""""""""""""""" */
+    if (FD_ISSET(1, &fd_out))
     {
-      close(fdc);
-      fdc = stk_pop(&fd_stack);
-      if (fdc == -1)
-        break;
-      else
-        continue;
+      out_flush();
+      if (out_size - out_len >= sizeof buf)
+        full = 0;
     }
 
-    c = (unsigned char)data;
+    /* If data on standard input: it is no more watched after its end, */
+    /* the child can then be sent an EOT (-E).                         */
+    /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    if (FD_ISSET(0, &fd_in))
+    {
+      rc = read(0, in_buf, sizeof in_buf);
+      if (rc == 0)
+      {
+        stdin_on = 0;
+        if (in_eot && ptylie_write(s, "\x04", 1) < 0)
+          break;
+      }
+      else if (rc > 0)
+        in_len = rc;
+      else if (errno != EAGAIN && errno != EINTR)
+        msg(FATAL, "Error %d on read standard input", errno);
+    }
 
-    if (srt_on)
-      vbuf[0] = '\0';
+    if (in_len > 0 && in_send(s, &wait) < 0)
+      break;
 
-    if (!special)
+    /* If data on master side of PTY */
+    /* """"""""""""""""""""""""""""" */
+    if (FD_ISSET(fd, &fd_in))
     {
-      if (c == '\\')
+      rc = ptylie_read(s, buf, sizeof buf, 0);
+      if (rc == PTYLIE_ECLOSED)
+        break;
+      if (rc > 0)
       {
-        special = 1;
-        continue;
+        out_push(buf, rc);
+        out_flush();
       }
+      else if (rc != PTYLIE_ETIMEOUT)
+        msg(FATAL, "%s", ptylie_errmsg(s));
+    }
 
-      if (meta)
+    /* The PTY of a target is no more watched once closed */
+    /* """""""""""""""""""""""""""""""""""""""""""""""""" */
+    for (i = 0; i < targets_nb; i++)
+      if (targets[i].fd != -1 && FD_ISSET(targets[i].fd, &fd_in))
       {
-        meta   = 0;
-        buf[0] = 0x1b;
-        buf[1] = c;
+        rc = ptylie_read(targets[i].s, buf, sizeof buf, 0);
+        if (rc < 0 && rc != PTYLIE_ETIMEOUT)
+          targets[i].fd = -1;
+      }
+  }
 
-        if (srt_on)
-        {
-          strcpy((char *)vbuf, "ALT-");
-          vbuf[4] = toupper(c);
-          vbuf[5] = '\0';
-        }
+  /* The child may have written just before ending */
+  /* """"""""""""""""""""""""""""""""""""""""""""" */
+  while ((rc = ptylie_read(s, buf, sizeof buf, 0)) > 0)
+    out_push(buf, rc);
 
-        l = 2;
-      }
-      else if (control)
-      {
-        control = 0;
-        buf[0]  = toupper(c) - '@';
+  if (!reaped)
+    ptylie_wait(s, &child_status, -1);
 
-        if (srt_on)
-        {
-          vbuf[0] = '^';
-          vbuf[1] = toupper(c);
-          vbuf[2] = '\0';
-        }
+  pthread_mutex_lock(&done_lock);
+  child_done = 1;
+  pthread_cond_broadcast(&done_cond);
+  pthread_mutex_unlock(&done_lock);
+
+  return NULL;
+}
+
+/* ================================================================== */
+/* Sleeps for delay unless the child ends in the meantime.            */
+/* Returns 1 if the child has ended.                                  */
+/* ================================================================== */
+int
+keys_pause(const struct timespec * delay)
+{
+  struct timespec end;
+  int             done;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  end.tv_sec += delay->tv_sec;
+  end.tv_nsec += delay->tv_nsec;
+  if (end.tv_nsec >= 1000000000L)
+  {
+    end.tv_sec++;
+    end.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&done_lock);
+  while (!child_done
+         && pthread_cond_timedwait(&done_cond, &done_lock, &end) != ETIMEDOUT)
+    ;
+  done = child_done;
+  pthread_mutex_unlock(&done_lock);
+
+  return done;
+}
+
+/* ================================================================== */
+/* Thread function feeding the command file of a session to its      */
+/* child at the pace requested by the directives.                     */
+/* ================================================================== */
+void *
+inject_keys(void * args)
+{
+  ptylie_t *      s = args;
+  struct timespec delay;
+  int             rc;
+
+  /* The first steps wait for the child to be ready to read its keys */
+  /* (see -G), then parse the command file and send keystokes to the */
+  /* child or sleep for an amount of time, the rest of the command   */
+  /* file is skipped if the child ends.                              */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  while ((rc = ptylie_step(s, &delay)) > 0)
+    if (keys_pause(&delay))
+      return NULL;
+
+  /* The log kept in memory is written before exiting */
+  /* """""""""""""""""""""""""""""""""""""""""""""""" */
+  if (rc < 0)
+  {
+    msg(WARN, "\r\n%s\r", ptylie_errmsg(s));
+    if (ring_size > 0)
+      ptylie_dump(s);
+    exit(EXIT_FAILURE);
+  }
+
+  return NULL;
+}
+
+/* ================================================================= */
+/* Master side of the PTY: relays the I/O and runs the command file  */
+/* until the child ends.                                             */
+/* ================================================================= */
+void
+master(ptylie_t * s)
+{
+  pthread_t          t1;
+  pthread_t          t2;
+  sigset_t           mask;
+  pthread_condattr_t attr;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&done_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  child_done = 0;
+
+  /* Only manage_io takes SIGUSR1 and SIGUSR2, in pselect */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""" */
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  pthread_create(&t1, NULL, manage_io, s);
+  pthread_create(&t2, NULL, inject_keys, s);
+
+  pthread_join(t1, NULL);
+  pthread_join(t2, NULL);
+
+  pthread_cond_destroy(&done_cond);
+}
+
+/* ================================================================== */
+/* Creates a session playing the command file fdc with the options    */
+/* given on the command line.                                         */
+/* ================================================================== */
+ptylie_t *
+session_new(ptylie_opts_t * opts, int fdc)
+{
+  ptylie_t * s;
+
+  if (ptylie_new(&s, opts) != PTYLIE_OK)
+    msg(FATAL, "Cannot open %s", opts->log_file);
+
+  ptylie_script(s, fdc);
+
+  if (ctl_path != NULL && ptylie_control(s, ctl_path) != PTYLIE_OK)
+  {
+    /* The path is not our socket, cleanup must leave it alone */
+    /* """"""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    ctl_path = NULL;
+    msg(FATAL, "%s", ptylie_errmsg(s));
+  }
+
+  if (snap_file != NULL
+      && ptylie_screen(s, snap_file, snap_format, snap_interval) != PTYLIE_OK)
+    msg(FATAL, "%s", ptylie_errmsg(s));
+
+  if (trace_file != NULL && ptylie_trace(s, trace_file) != PTYLIE_OK)
+    msg(FATAL, "%s", ptylie_errmsg(s));
+
+  if (latency_file != NULL && ptylie_latency(s, latency_file) != PTYLIE_OK)
+    msg(FATAL, "%s", ptylie_errmsg(s));
+
+  if (render_file != NULL && ptylie_render(s, render_file) != PTYLIE_OK)
+    msg(FATAL, "%s", ptylie_errmsg(s));
+
+  if (transcript_file != NULL
+      && ptylie_transcript(s, transcript_file) != PTYLIE_OK)
+    msg(FATAL, "%s", ptylie_errmsg(s));
+
+  if (sample_file != NULL
+      && ptylie_sample(s, sample_file, sample_interval) != PTYLIE_OK)
+    msg(FATAL, "%s", ptylie_errmsg(s));
+
+  return s;
+}
+
+/* ================================================================== */
+/* Adds the target given by -a name=program [arguments...], the       */
+/* program and its arguments are separated by blanks.                 */
+/* ================================================================== */
+void
+target_add(const char * arg)
+{
+  target_t * t;
+  char *     tok;
+  char *     save;
+  char *     cmd;
+  int        argc = 0;
+
+  targets = realloc(targets, (targets_nb + 1) * sizeof *targets);
+  if (targets == NULL || (cmd = strdup(arg)) == NULL)
+    msg(FATAL, "Cannot allocate the target %s", arg);
+
+  t = &targets[targets_nb++];
+  memset(t, 0, sizeof *t);
+  t->fd = -1;
+
+  if ((tok = strchr(cmd, '=')) == NULL || tok == cmd)
+    msg(FATAL, "Invalid target %s, name=program expected", arg);
+  *tok++  = '\0';
+  t->name = cmd;
+
+  t->argv = malloc(sizeof(char *));
+  for (tok = strtok_r(tok, " \t", &save); tok != NULL;
+       tok = strtok_r(NULL, " \t", &save))
+  {
+    t->argv         = realloc(t->argv, (argc + 2) * sizeof(char *));
+    t->argv[argc++] = tok;
+  }
+  if (argc == 0)
+    msg(FATAL, "Invalid target %s, name=program expected", arg);
+  t->argv[argc] = NULL;
+}
 
-        l = 1;
+/* ================================================================== */
+/* Starts the targets of the session s, each in its own PTY with its  */
+/* log and timing files named after those of s with a .name suffix.   */
+/* ================================================================== */
+void
+targets_start(ptylie_t * s, const ptylie_opts_t * opts)
+{
+  ptylie_opts_t o = *opts;
+  int           i;
+
+  o.start_wait = 0;
+
+  for (i = 0; i < targets_nb; i++)
+  {
+    target_t * t        = &targets[i];
+    size_t     len      = strlen(t->name) + 2;
+    char *     log_file = malloc(strlen(opts->log_file) + len);
+    char *     timing   = NULL;
+
+    sprintf(log_file, "%s.%s", opts->log_file, t->name);
+    o.log_file = log_file;
+    if (opts->timing_file != NULL)
+    {
+      timing = malloc(strlen(opts->timing_file) + len);
+      sprintf(timing, "%s.%s", opts->timing_file, t->name);
+    }
+    o.timing_file = timing;
+
+    if (ptylie_new(&t->s, &o) != PTYLIE_OK)
+      msg(FATAL, "Cannot open %s", log_file);
+
+    if (ptylie_target(s, t->name, t->s) != PTYLIE_OK)
+      msg(FATAL, "%s", ptylie_errmsg(s));
+
+    if (ptylie_spawn(t->s, t->argv) != PTYLIE_OK)
+      msg(FATAL, "\r\n%s\r", ptylie_errmsg(t->s));
+
+    t->fd = ptylie_fd(t->s);
+    free(log_file);
+    free(timing);
+  }
+}
+
+/* ================================================================== */
+/* Ends the targets of the session which has just ended, those still  */
+/* running are killed. Must be called before freeing the session.     */
+/* ================================================================== */
+void
+targets_end(void)
+{
+  int i, status;
+
+  for (i = 0; i < targets_nb; i++)
+  {
+    target_t * t = &targets[i];
+
+    if (ptylie_wait(t->s, &status, 0) == PTYLIE_OK && status != 0)
+      msg(WARN, "Target %s exited with status %d", t->name, status);
+
+    ptylie_free(t->s);
+    t->s  = NULL;
+    t->fd = -1;
+  }
+}
+
+/* --------------------------------------------------------------- */
+/* Repeated runs (-N): statistics on the times and resources of    */
+/* several runs of the same session.                               */
+/* --------------------------------------------------------------- */
+
+/* ================================================================== */
+/* Records the metrics of a finished run lasting wall ns: its wall    */
+/* time, the CPU time and maximum RSS of the child and the time spent */
+/* between consecutive \P markers. The first run names the metrics.   */
+/* ================================================================== */
+void
+bench_record(bench_t * b, ptylie_t * s, long long wall)
+{
+  double *      v = b->samples + b->runs * BENCH_METRICS;
+  struct rusage ru;
+  const char *  name;
+  long long     ns, prev = 0;
+  unsigned      i;
+
+  if (b->runs == 0)
+  {
+    b->names[0] = "wall (s)";
+    b->names[1] = "cpu (s)";
+    b->names[2] = "max rss (KB)";
+    b->nb       = 3;
+  }
+
+  for (i = 0; i < BENCH_METRICS; i++)
+    v[i] = -1;
+
+  v[0] = wall / 1e9;
+  if (ptylie_rusage(s, &ru) == PTYLIE_OK)
+  {
+    v[1] = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+           + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+    v[2] = ru.ru_maxrss;
+  }
+
+  /* The phase i ends at the marker i */
+  /* '''''''''''''''''''''''''''''''' */
+  for (i = 0; i < BENCH_METRICS - 3 && ptylie_marker(s, i, &name, &ns) == 0;
+       i++)
+  {
+    if (b->runs == 0)
+    {
+      b->names[3 + i] = malloc(strlen(name) + 8);
+      sprintf(b->names[3 + i], "-> %s (s)", name);
+      b->nb = 4 + i;
+    }
+    v[3 + i] = (ns - prev) / 1e9;
+    prev     = ns;
+  }
+
+  b->runs++;
+}
+
+static int
+double_comp(const void * ptr1, const void * ptr2)
+{
+  double v1 = *(const double *)ptr1;
+  double v2 = *(const double *)ptr2;
+
+  return (v1 > v2) - (v1 < v2);
+}
+
+/* ================================================================== */
+/* Writes on stderr the mean, median, standard deviation, extremes    */
+/* and number of outliers of each metric. The outliers are the values */
+/* farther than 1.5 interquartile range from the quartiles.           */
+/* ================================================================== */
+void
+bench_report(bench_t * b, int warmups)
+{
+  double * x = malloc(b->runs * sizeof(double));
+  double   mean, var, q1, q3, iqr;
+  int      m, r, n, p, outliers;
+
+  fprintf(stderr, "\n%d runs after %d warmup runs%s\n", b->runs, warmups,
+          b->warmup ? " (added to fill the pool)" : "");
+  fprintf(stderr, "%-24s %10s %10s %10s %10s %10s %8s\n", "", "mean",
+          "median", "stddev", "min", "max", "outliers");
+
+  for (m = 0; m < b->nb; m++)
+  {
+    for (n = r = 0; r < b->runs; r++)
+      if (b->samples[r * BENCH_METRICS + m] >= 0)
+        x[n++] = b->samples[r * BENCH_METRICS + m];
+    if (n == 0)
+      continue;
+
+    qsort(x, n, sizeof *x, double_comp);
+
+    for (mean = 0, r = 0; r < n; r++)
+      mean += x[r];
+    mean /= n;
+
+    for (var = 0, r = 0; r < n; r++)
+      var += (x[r] - mean) * (x[r] - mean);
+    var = n > 1 ? var / (n - 1) : 0;
+
+    q1  = x[n / 4];
+    q3  = x[(3 * n) / 4];
+    iqr = q3 - q1;
+    for (outliers = 0, r = 0; r < n; r++)
+      if (x[r] < q1 - 1.5 * iqr || x[r] > q3 + 1.5 * iqr)
+        outliers++;
+
+    /* The RSS is in KB, the other metrics in seconds */
+    /* '''''''''''''''''''''''''''''''''''''''''''''' */
+    p = m == 2 ? 0 : 4;
+    fprintf(stderr,
+            "%-24.24s %10.*f %10.*f %10.*f %10.*f %10.*f %8d\n",
+            b->names[m], p, mean, p,
+            n % 2 ? x[n / 2] : (x[n / 2 - 1] + x[n / 2]) / 2, p, sqrt(var),
+            p, x[0], p, x[n - 1], outliers);
+  }
+
+  free(x);
+}
+
+/* --------------------------------------------------------------- */
+/* Runner: drives all the sessions described in a manifest file in */
+/* a single process.                                               */
+/* --------------------------------------------------------------- */
+
+/* ===================================================================== */
+/* Returns the current value of the monotonic clock in nanoseconds.      */
+/* ===================================================================== */
+static long long
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* ======================================================================= */
+/* Reads the manifest file. Each non empty line not beginning by a # gives */
+/* a session: command_file geometry log_file program [arguments...]        */
+/* Fields are separated by blanks, geometry is WxH or - for the default.   */
+/* Returns the number of entries stored in *entries.                       */
+/* ======================================================================= */
+int
+runner_load(const char * file, run_entry_t ** entries)
+{
+  FILE *        f;
+  char          line[4096];
+  int           nb = 0, size = 0;
+  int           lineno = 0;
+  run_entry_t * e;
+
+  if ((f = fopen(file, "re")) == NULL)
+    msg(FATAL, "Cannot open manifest %s", file);
+
+  *entries = NULL;
+
+  while (fgets(line, sizeof line, f) != NULL)
+  {
+    char * tok;
+    char * save;
+    int    argc = 0;
+
+    lineno++;
+
+    tok = strtok_r(line, " \t\r\n", &save);
+    if (tok == NULL || *tok == '#')
+      continue;
+
+    if (nb == size)
+    {
+      size     = size == 0 ? 64 : size * 2;
+      *entries = realloc(*entries, size * sizeof(run_entry_t));
+      if (*entries == NULL)
+        msg(FATAL, "Cannot allocate the manifest entries");
+    }
+
+    e = &(*entries)[nb];
+    memset(e, 0, sizeof(run_entry_t));
+
+    e->cmd_file = strdup(tok);
+
+    if ((tok = strtok_r(NULL, " \t\r\n", &save)) == NULL)
+      msg(FATAL, "%s:%d: missing geometry", file, lineno);
+
+    if (strcmp(tok, "-") != 0
+        && sscanf(tok, "%ux%u", &e->width, &e->height) != 2)
+      msg(FATAL, "%s:%d: invalid geometry %s", file, lineno, tok);
+
+    if ((tok = strtok_r(NULL, " \t\r\n", &save)) == NULL)
+      msg(FATAL, "%s:%d: missing log file", file, lineno);
+
+    e->log_file = strdup(tok);
+
+    e->argv = malloc(sizeof(char *));
+    while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+    {
+      e->argv         = realloc(e->argv, (argc + 2) * sizeof(char *));
+      e->argv[argc++] = strdup(tok);
+    }
+    e->argv[argc] = NULL;
+
+    if (argc == 0)
+      msg(FATAL, "%s:%d: missing program", file, lineno);
+
+    nb++;
+  }
+
+  fclose(f);
+
+  return nb;
+}
+
+/* ============================================================ */
+/* Takes the next entry to run for the worker w: its own queue  */
+/* is consumed from the front, when empty the last entry of the */
+/* queue of another worker is stolen.                           */
+/* Returns the entry index or -1 when no work is left.          */
+/* ============================================================ */
+static int
+runner_take(runner_t * r, int w)
+{
+  int            i, k;
+  int            idx = -1;
+  run_queue_t *  q;
+
+  q = &r->queues[w];
+  pthread_mutex_lock(&q->lock);
+  if (q->head < q->tail)
+    idx = q->items[q->head++];
+  pthread_mutex_unlock(&q->lock);
+
+  for (k = 1; idx == -1 && k < r->nb_workers; k++)
+  {
+    i = (w + k) % r->nb_workers;
+    q = &r->queues[i];
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail)
+      idx = q->items[--q->tail];
+    pthread_mutex_unlock(&q->lock);
+  }
+
+  return idx;
+}
+
+/* ================================================================ */
+/* Starts the session corresponding to the manifest entry e.        */
+/* Returns NULL if the session could not be started, the failure is */
+/* then recorded in e.                                              */
+/* ================================================================ */
+static ptylie_t *
+runner_start(run_entry_t * e)
+{
+  ptylie_t *    s;
+  ptylie_opts_t opts;
+  char *        srt;
+  int           fdc;
+  int           rc;
+
+  e->start = now_ns();
+
+  srt = malloc(strlen(e->log_file) + 5);
+  sprintf(srt, "%s.srt", e->log_file);
+
+  ptylie_opts_init(&opts);
+  opts.width    = e->width;
+  opts.height   = e->height;
+  opts.log_file   = e->log_file;
+  opts.srt_file   = srt;
+  opts.start_wait = start_wait;
+
+  rc = ptylie_new(&s, &opts);
+  free(srt);
+
+  if (rc != PTYLIE_OK)
+  {
+    msg(WARN, "Cannot open %s", e->log_file);
+    e->exit_code = 127;
+    return NULL;
+  }
+
+  /* Without its command file an interactive child would never end */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if ((fdc = open(e->cmd_file, O_RDONLY | O_CLOEXEC)) == -1)
+  {
+    msg(WARN, "Cannot open %s", e->cmd_file);
+    ptylie_free(s);
+    e->exit_code = 127;
+    return NULL;
+  }
+  ptylie_script(s, fdc);
+
+  if ((rc = ptylie_spawn(s, e->argv)) != PTYLIE_OK)
+  {
+    msg(WARN, "%s", ptylie_errmsg(s));
+    ptylie_free(s);
+    e->exit_code = 127;
+    return NULL;
+  }
+
+  fcntl(ptylie_fd(s), F_SETFL, fcntl(ptylie_fd(s), F_GETFL) | O_NONBLOCK);
+
+  /* The start gate of the session delays its first key, see -G */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  e->due = e->start;
+
+  return s;
+}
+
+/* ================================================================= */
+/* Worker thread: owns up to max_active sessions at once, relays the */
+/* output of their PTYs to their logs and runs their command files,  */
+/* all from a single poll loop.                                      */
+/* ================================================================= */
+static void *
+runner_worker(void * args)
+{
+  runner_t *      r = ((runner_arg_t *)args)->runner;
+  int             w = ((runner_arg_t *)args)->worker;
+  int             max_active = r->max_active;
+  ptylie_t **     sessions;
+  int *           active; /* manifest index of each session, -1 if free */
+  struct pollfd * pfds;
+  int             nb_active = 0;
+  int             no_more   = 0;
+  int             i;
+
+  sessions = calloc(max_active, sizeof(ptylie_t *));
+  active   = malloc(max_active * sizeof(int));
+  pfds     = malloc(max_active * sizeof(struct pollfd));
+
+  for (i = 0; i < max_active; i++)
+    active[i] = -1;
+
+  for (;;)
+  {
+    long long now;
+    long long timeout = -1;
+
+    /* Fill the free slots */
+    /* """"""""""""""""""" */
+    for (i = 0; !no_more && i < max_active; i++)
+    {
+      int idx;
+
+      if (active[i] != -1)
+        continue;
+
+      if ((idx = runner_take(r, w)) == -1)
+        no_more = 1;
+      else if ((sessions[i] = runner_start(&r->entries[idx])) != NULL)
+      {
+        active[i] = idx;
+        nb_active++;
       }
+    }
+
+    if (nb_active == 0)
+      break;
+
+    /* Compute the poll timeout from the next injection due */
+    /* """""""""""""""""""""""""""""""""""""""""""""""""""" */
+    now = now_ns();
+    for (i = 0; i < max_active; i++)
+    {
+      run_entry_t * e;
+      long long     t;
+
+      pfds[i].fd     = -1;
+      pfds[i].events = POLLIN;
+
+      if (active[i] == -1)
+        continue;
+
+      e          = &r->entries[active[i]];
+      pfds[i].fd = ptylie_fd(sessions[i]);
+
+      if (e->script_done)
+        t = 20000000LL; /* periodic check of the child status */
       else
-      {
-        int i;
+        t = e->due > now ? e->due - now : 0;
+
+      if (timeout == -1 || t < timeout)
+        timeout = t;
+    }
+
+    if (poll(pfds, max_active, (int)((timeout + 999999) / 1000000)) == -1
+        && errno != EINTR)
+      msg(FATAL, "Error %d on poll()", errno);
+
+    now = now_ns();
+
+    for (i = 0; i < max_active; i++)
+    {
+      ptylie_t *      s;
+      run_entry_t *   e;
+      struct timespec delay;
+      char            buf[4096];
+      int             rc;
+
+      if (active[i] == -1)
+        continue;
 
-        buf[0] = c;
-        l      = mb_get_length(c);
+      s = sessions[i];
+      e = &r->entries[active[i]];
 
-        if (l > 1)
+      /* Relay the output of the child to its log */
+      /* """""""""""""""""""""""""""""""""""""""" */
+      if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+        while (ptylie_read(s, buf, sizeof buf, 0) > 0)
+          ;
+
+      /* Run the command file steps which are due */
+      /* """""""""""""""""""""""""""""""""""""""" */
+      while (!e->script_done && e->due <= now)
+      {
+        if ((rc = ptylie_step(s, &delay)) <= 0)
         {
-          int bread;
-          int bsofar = 0;
-          do
-          {
-            bread = read(fdc, &buf[bsofar + 1], l - 1 - bsofar);
-            bsofar += bread;
-          } while (bsofar < l - 1 && bread > 0);
+          if (rc < 0)
+            msg(WARN, "%s: %s", e->cmd_file, ptylie_errmsg(s));
+          e->script_done = 1;
         }
-      }
-    }
-    else
-    {
-      l       = 1;
-      special = 0;
-      char * v[10 + 1];
-      long   q[9];
+        else
+          e->due = now + delay.tv_sec * 1000000000LL + delay.tv_nsec;
+      }
 
-      switch (c)
+      /* Collect the child when it ends, even if its command file is */
+      /* not exhausted.                                              */
+      /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+      if (ptylie_wait(s, &e->exit_code, 0) == PTYLIE_OK)
       {
-        case '\n':
-          goto loop;
+        while (ptylie_read(s, buf, sizeof buf, 0) > 0)
+          ;
 
-        case '\\':
-          buf[0] = '\\';
-          break;
+        e->elapsed = now_ns() - e->start;
 
-        case 's': /* set new seep time between keytrokes        */
-        case 'S': /* sleep for the given amount of milliseconds */
-          get_arg(fdc, scanf_buf, &len);
-          n = sscanf((char *)scanf_buf, "[%5[0-9]]%n", tmp, &l);
-          if (n != 1)
-            exit(EXIT_FAILURE);
-
-          if (c == 'S')
-          {
-            long   delay_ms = atol(tmp);       /* milliseconds */
-            time_t s        = delay_ms / 1000; /* seconds */
-
-            nanosleep((const struct timespec[]){ { s, delay_ms * 1000000L
-                                                        - s * 1000000000L } },
-                      NULL);
-            continue;
-          }
-          else
-          {
-            sleep_time   = atol(tmp);          /* milliseconds */
-            sleep_time_s = sleep_time / 1000L; /* seconds */
-            sleep_time_n = sleep_time * 1000000L
-                           - sleep_time_s * 1000000000L; /* remaining ns */
-            goto loop;
-          }
-
-        case 'W': /* for terminal resizing (ex: [80x24] */
-          get_arg(fdc, scanf_buf, &len);
-          n = sscanf((char *)scanf_buf, "[%3[0-9]x%3[0-9]]", cols, rows);
-          if (n != 2)
-            exit(EXIT_FAILURE);
-          memset(&ws, 0, sizeof ws);
-          ws.ws_row = atoi(rows);
-          ws.ws_col = atoi(cols);
-          ioctl(fd, TIOCSWINSZ, &ws);
-          goto loop;
-
-        case 'R': /* include a bytes sequence form a given file, beware *
-                   * to trailing newlines.                              */
-        {
-          int fd_include;
-          get_arg(fdc, scanf_buf, &len);
-          if (scanf_buf[0] != '\0')
-          {
-            if (scanf_buf[strlen((char *)scanf_buf + 1)] == ']')
-              scanf_buf[strlen((char *)scanf_buf + 1)] = '\0';
-
-            if ((fd_include = open((char *)scanf_buf + 1, O_RDONLY)) == -1)
-            {
-              msg(FATAL, "\r\nCannot open include file %s\r\n", scanf_buf + 1);
-            }
-            else
-            {
-              stk_push(&fd_stack, fdc);
-              fdc = fd_include;
-              continue;
-            }
-          }
-        }
-        break;
+        ptylie_free(s);
+        active[i] = -1;
+        nb_active--;
+      }
+    }
+  }
 
-        case 'm': /* consider a new map file */
-        {
-          get_arg(fdc, scanf_buf, &len);
-          if (scanf_buf[0] != '\0')
-          {
-            if (scanf_buf[strlen((char *)scanf_buf + 1)] == ']')
-              scanf_buf[strlen((char *)scanf_buf + 1)] = '\0';
-
-            if ((map = fopen((char *)scanf_buf + 1, "r")) == NULL)
-            {
-              msg(FATAL, "\r\nCannot open map file %s\r\n", scanf_buf + 1);
-            }
-            else
-            {
-              char line[256];
-              char key[256], repl[256];
-
-              rb_tree_remove_all(map_tree, map_elem_free);
-
-              while (!feof(map))
-              {
-                fscanf(map, "%255[^\n]\n", line);
-                line[255] = '\0';
-
-                if (sscanf(line, "%255[^ ] %255[^\n]\n", key, repl) != 2)
-                  continue;
-                else
-                {
-                  key[255] = repl[255] = '\0';
-
-                  map_elem_t * elem = malloc(sizeof(map_elem_t));
-                  elem->key         = strdup(key);
-                  mb_interpret(elem->key);
-                  elem->repl = strdup(repl);
-                  mb_interpret(elem->repl);
-                  rb_tree_insert(map_tree, elem);
-                }
-              }
-              continue;
-            }
-          }
-        }
+  free(sessions);
+  free(active);
+  free(pfds);
 
-        break;
+  return NULL;
+}
 
-        case 'x': /* Arbitrary hexadecimal sequence (max 256) */
-        case 'u': /* for raw hexadecimal UTF-8 injection \u[xx[yy[zz[tt]]]]*/
-          if (c == 'x')
-            format = "[%256[0-9a-fA-F]]%n";
-          else
-            format = "[%8[0-9a-fA-F]]%n";
+/* ===================================================================== */
+/* Runs all the sessions of the manifest file with a pool of workers     */
+/* sized to the number of processors, then prints one result line per   */
+/* session on stdout: exit_code elapsed_ms log_file program.             */
+/* Returns EXIT_SUCCESS if all the children have exited with a 0 status. */
+/* ===================================================================== */
+int
+run_manifest(const char * file, int jobs)
+{
+  runner_t       r;
+  runner_arg_t * args;
+  pthread_t *    threads;
+  int            i;
+  int            failed = 0;
+  long           cpus;
 
-          get_arg(fdc, scanf_buf, &len);
-          n = sscanf((char *)scanf_buf, format, tmp, &l);
+  memset(&r, 0, sizeof r);
 
-          if (n != 1)
-            msg(FATAL, "\r\nInvalid sequence.\r\n", scanf_buf + 1);
+  r.nb_entries = runner_load(file, &r.entries);
+  if (r.nb_entries == 0)
+    return EXIT_SUCCESS;
 
-          if (l < 2 || l % 2 == 1)
-            msg(FATAL, "\r\nInvalid hexadecimal sequence.\r\n", scanf_buf + 1);
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < 1)
+    cpus = 1;
 
-          for (i = 0; i < (l - 2) / 2; i++)
-          {
-            unsigned char charhex[3] = { tmp[i * 2], tmp[i * 2 + 1], 0 };
-            tmp[i] = (unsigned char)strtol((char *)charhex, NULL, 16);
-          }
+  if (jobs <= 0)
+    jobs = 4 * cpus;
 
-          l      = (l - 2) / 2;
-          tmp[l] = '\0';
-          memcpy(buf, tmp, l);
+  r.nb_workers = cpus < jobs ? cpus : jobs;
+  if (r.nb_workers > r.nb_entries)
+    r.nb_workers = r.nb_entries;
 
-          break;
+  r.max_active = (jobs + r.nb_workers - 1) / r.nb_workers;
 
-        case 'T':
-        {
-          char * p;
-          int    i = 0, j;
-
-          get_arg(fdc, scanf_buf, &len);
-          n = sscanf((char *)scanf_buf, "[%256[^]]]", tmp);
-          for (p = tmp; i < 10;)
-          {
-            while (isspace(*(unsigned char *)p))
-              p++;
-            if (*p == '\0')
-              break;
-            v[i++] = p;
-            while (!isspace(*(unsigned char *)p) && *p != '\0')
-              ++p;
-            if (*p == '\0')
-              break;
-            *p++ = '\0';
-          }
-          v[i] = NULL;
-
-          if ((p = (char *)tigetstr(v[0])) != (char *)-1)
-          {
-            char * end;
-
-            if (p == NULL)
-            {
-              buf[0] = '\0';
-              l      = 0;
-              break;
-            }
-            else
-            {
-              q[0] = q[1] = q[2] = q[3] = q[4] = q[5] = q[6] = q[7] = q[8] = 0L;
-
-              for (j = 1; j < i - 2; j++)
-              {
-                if (v[j] != NULL)
-                {
-                  q[j - 1] = strtol(v[j], &end, 0);
-                  if (*end != '\0')
-                    q[j - 1] = (long)v[j];
-                }
-              }
-              strcpy(buf, tparm(p, q[0], q[1], q[2], q[3], q[4], q[5], q[6],
-                                q[7], q[8]));
-              l = strlen(buf);
-            }
-          }
-          else
-          {
-            buf[0] = '\0';
-            l      = 0;
-          }
-        }
-        break;
+  /* Distribute the entries in a round robin way */
+  /* """"""""""""""""""""""""""""""""""""""""""" */
+  r.queues = calloc(r.nb_workers, sizeof(run_queue_t));
+  for (i = 0; i < r.nb_workers; i++)
+  {
+    pthread_mutex_init(&r.queues[i].lock, NULL);
+    r.queues[i].items = malloc(r.nb_entries * sizeof(int));
+  }
 
-        case 'c': /* colour setting \c[x;y;z] */
-          buf[0] = 0x1b;
-          buf[1] = '[';
-          l      = 2;
-          get_arg(fdc, scanf_buf, &len);
-          n = sscanf((char *)scanf_buf, "[%8[0-9;]]", tmp);
-          if (n != 1)
-            exit(EXIT_FAILURE);
-
-          while (l < len)
-          {
-            buf[l] = tmp[l - 2];
-            l++;
-          }
-          buf[l] = 'm';
-          l++;
-          break;
+  for (i = 0; i < r.nb_entries; i++)
+  {
+    run_queue_t * q = &r.queues[i % r.nb_workers];
+    q->items[q->tail++] = i;
+  }
 
-        case 'k': /* keys as subtitle on/off */
-          if (srt == NULL)
-            srt = fopen(srt_file, "w");
+  threads = malloc(r.nb_workers * sizeof(pthread_t));
+  args    = malloc(r.nb_workers * sizeof(runner_arg_t));
 
-          srt_on = !srt_on;
-          continue;
+  for (i = 0; i < r.nb_workers; i++)
+  {
+    args[i].runner = &r;
+    args[i].worker = i;
+    pthread_create(&threads[i], NULL, runner_worker, &args[i]);
+  }
 
-        case 'M':
-          meta = 1;
-          continue;
+  for (i = 0; i < r.nb_workers; i++)
+    pthread_join(threads[i], NULL);
 
-        case 'C':
-          control = 1;
-          continue;
+  for (i = 0; i < r.nb_entries; i++)
+  {
+    run_entry_t * e = &r.entries[i];
 
-        case '%':
-          break;
+    printf("%d\t%lld\t%s\t%s\n", e->exit_code, e->elapsed / 1000000LL,
+           e->log_file, e->argv[0]);
 
-        case 'r':
-          buf[0] = '\r';
-          break;
+    if (e->exit_code != 0)
+      failed++;
+  }
 
-        case '\"':
-          buf[0] = '"';
-          if (srt_on)
-            break;
+  fprintf(stderr, "%d session(s), %d failed\n", r.nb_entries, failed);
 
-        case '\'':
-          buf[0] = '\'';
-          if (srt_on)
-            break;
+  return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-        case 'a': /* ignored */
-          continue;
+/* --------------------------------------------------------------- */
+/* Replay: plays back a log recorded with a timing file (-t).      */
+/* --------------------------------------------------------------- */
 
-        case 't':
-          buf[0] = '\t';
-          break;
+/* ===================================================================== */
+/* Positions the log and the timing file on the last index entry whose   */
+/* time is not after target (us) and stores its time in *t.              */
+/* The index is searched in place so that its size does not matter.     */
+/* Returns 0 or -1 if the index cannot be used.                          */
+/* ===================================================================== */
+static int
+replay_seek(FILE * tim, FILE * log, const char * idx_file, long long target,
+            long long * t)
+{
+  FILE *      idx;
+  struct stat st;
+  char        rec[PTYLIE_IDX_SIZE + 1];
+  long long   lo, hi, mid, time, log_off, tim_off;
+  long long   found_time = 0, found_log = 0, found_tim = 0;
 
-        case 'n':
-          buf[0] = '\n';
-          break;
+  if ((idx = fopen(idx_file, "re")) == NULL)
+    return -1;
 
-        case 'e':
-          buf[0] = 0x1b;
-          break;
+  if (fstat(fileno(idx), &st) == -1)
+  {
+    fclose(idx);
+    return -1;
+  }
 
-        case 'b':
-        case 'h':
-          buf[0] = '\b';
-          break;
-      }
-    }
+  lo = 0;
+  hi = st.st_size / PTYLIE_IDX_SIZE - 1;
+  while (lo <= hi)
+  {
+    mid = (lo + hi) / 2;
+    if (fseeko(idx, mid * PTYLIE_IDX_SIZE, SEEK_SET) == -1
+        || fread(rec, PTYLIE_IDX_SIZE, 1, idx) != 1)
+      break;
 
-    /* Close the buffer and inject it */
-    /* """""""""""""""""""""""""""""" */
-    buf[l] = '\0';
+    rec[PTYLIE_IDX_SIZE] = '\0';
+    if (sscanf(rec, "%lld %lld %lld", &time, &log_off, &tim_off) != 3)
+      break;
 
-    if (srt_on)
+    if (time <= target)
     {
-      if (map != NULL)
-      {
-        map_elem_t * pelem;
-        elem.key = (char *)buf;
-        mb_interpret(elem.key);
-        if ((pelem = rb_tree_search(map_tree, &elem)) != NULL)
-          strcpy((char *)vbuf, pelem->repl);
-      }
+      found_time = time;
+      found_log  = log_off;
+      found_tim  = tim_off;
+      lo         = mid + 1;
     }
+    else
+      hi = mid - 1;
+  }
 
-    /* Wait for an empty input queue to continue */
-    /* ''''''''''''''''''''''''''''''''''''''''' */
-    {
-      int chars;
-
-      ioctl(fd, FIONREAD, &chars);
-      while (chars > 1)
-      {
-        nanosleep((const struct timespec[]){ { 0, 50000L } }, NULL);
-        ioctl(fd, FIONREAD, &chars);
-      }
-    }
+  fclose(idx);
 
-    if (l > 1)
-    {
-      unsigned char * p;
-      for (p = buf; *p; p++)
-        if (ioctl(fd, TIOCSTI, p) < 0)
-          exit(EXIT_FAILURE);
+  if (fseeko(tim, found_tim, SEEK_SET) == -1)
+    return -1;
 
-      if (srt_on)
-      {
-        if (*vbuf != '\0')
-          add_srt_entry((char *)vbuf);
-        else if (mb_validate((char *)buf, l))
-          add_srt_entry((char *)buf);
-      }
-    }
-    else
-    {
-      if (srt_on)
-      {
-        if (*vbuf != '\0')
-          add_srt_entry((char *)vbuf);
-        else if (isgraph(buf[0]))
-          add_srt_entry((char *)buf);
-        else
-        {
-          if (map == NULL)
-          {
-            switch (buf[0])
-            {
-              case ' ':
-                srt_buf_prt = v_space;
-                break;
-
-              case 0x09:
-                srt_buf_prt = v_ht;
-                break;
-
-              case 0x0d:
-                srt_buf_prt = v_cr;
-                break;
-
-              case 0x0a:
-                srt_buf_prt = v_lf;
-                break;
-
-              case 0x1b:
-                srt_buf_prt = v_esc;
-                break;
-
-              case '\b':
-              case 0x7f:
-                srt_buf_prt = v_bs;
-                break;
-
-              default:
-                sprintf((char *)vbuf, "<0x%2x>", c);
-                srt_buf_prt = (char *)vbuf;
-                break;
-            }
-            add_srt_entry(srt_buf_prt);
-          }
-        }
-      }
+  /* found_time already includes the delay of the chunk found, which */
+  /* will be read again from the timing file.                        */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  *t = 0;
+  if (found_tim > 0)
+  {
+    char   line[64];
+    double delay;
 
-      if (ioctl(fd, TIOCSTI, buf) < 0)
-        exit(EXIT_FAILURE);
-    }
+    if (fgets(line, sizeof line, tim) == NULL
+        || sscanf(line, "%lf", &delay) != 1)
+      return -1;
 
-    /* inter injection loop 1/20 s min to leave the application */
-    /* the time to read the keyboard.                           */
-    /* """""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    *t = found_time - (long long)(delay * 1000000.0 + 0.5);
+    fseeko(tim, found_tim, SEEK_SET);
+  }
 
-  loop:
+  /* A deduplicated log is read from a pipe (see replay), what */
+  /* precedes the position found is read and dropped.          */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (fseeko(log, found_log, SEEK_SET) == -1)
+  {
+    char   buf[4096];
+    size_t n;
 
-    /* default to 1/20 s when sleep_time is set to 0 */
-    /* ''''''''''''''''''''''''''''''''''''''''''''''' */
-    if (sleep_time < 20)
-    {
-      sleep_time   = 20;
-      sleep_time_s = 0;
-      sleep_time_n = 50000000L;
-    }
+    if (errno != ESPIPE)
+      return -1;
 
-    nanosleep((const struct timespec[]){ { sleep_time_s, sleep_time_n } },
-              NULL);
+    for (; found_log > 0; found_log -= n)
+      if ((n = fread(buf, 1, found_log < 4096 ? found_log : 4096, log)) == 0)
+        msg(FATAL, "The log is shorter than its index");
   }
 
+  return 0;
+}
+
+/* ===================================================================== */
+/* Thread function writing in a pipe the log rebuilt from a deduplicated */
+/* log. args points to the descriptors of the log and of the pipe.       */
+/* ===================================================================== */
+static void *
+replay_unpack(void * args)
+{
+  int *    fd = args;
+  sigset_t mask;
+
+  /* replay closes the pipe if it stops before the end of the log */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  if (ptylie_unpack(fd[0], fd[1]) != PTYLIE_OK && errno != EPIPE)
+    msg(FATAL, "Cannot rebuild the deduplicated log");
+
+  close(fd[1]);
+
   return NULL;
 }
 
-/* ====================== */
-/* Master side of the PTY */
-/* ====================== */
-void
-master(int fd_master, int fd_slave, int fdl, int fdc)
+/* ===================================================================== */
+/* Writes the log log_file on the standard output with the timing given  */
+/* by timing_file. The delays are divided by speed and limited to        */
+/* max_gap seconds if max_gap is positive. The output begins seek        */
+/* seconds after the start of the recording, what precedes is skipped   */
+/* thanks to the index (timing_file.idx) and then written without delay. */
+/* Only one chunk of the log is in memory at a time, a deduplicated log  */
+/* is rebuilt while it is played.                                        */
+/* ===================================================================== */
+int
+replay(const char * log_file, const char * timing_file, double speed,
+       double max_gap, double seek)
 {
+  FILE *          log, *tim;
+  FILE *          store = NULL;
+  static int      fd[2];
+  int             p[2];
+  pthread_t       tid;
+  char            line[64];
+  char            buf[65536];
+  char *          idx_file;
+  double          delay;
+  size_t          len, n;
+  long long       t      = 0;
+  long long       target = (long long)(seek * 1000000.0);
+  struct timespec ts;
+
+  if ((log = fopen(log_file, "re")) == NULL)
+    msg(FATAL, "Cannot open %s", log_file);
+
+  /* A deduplicated log (-z) is rebuilt by a thread in a pipe, the */
+  /* output then begins at once whatever the size of the log.      */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (fread(buf, 1, PTYLIE_STORE_MAGIC_SIZE, log) == PTYLIE_STORE_MAGIC_SIZE
+      && memcmp(buf, PTYLIE_STORE_MAGIC, PTYLIE_STORE_MAGIC_SIZE) == 0)
+  {
+    store = log;
+    fd[0] = fileno(store);
+    if (lseek(fd[0], 0, SEEK_SET) == -1 || pipe(p) == -1
+        || (log = fdopen(p[0], "r")) == NULL)
+      msg(FATAL, "Cannot rebuild %s", log_file);
+
+    fd[1] = p[1];
+    if (pthread_create(&tid, NULL, replay_unpack, fd) != 0)
+      msg(FATAL, "Cannot rebuild %s", log_file);
+  }
+  else
+    rewind(log);
 
-  pthread_t t1;
-  pthread_t t2;
+  if ((tim = fopen(timing_file, "re")) == NULL)
+    msg(FATAL, "Cannot open %s", timing_file);
 
-  struct args_s args1 = { fd_master, fdl };
-  struct args_s args2 = { fd_slave, fdc };
+  if (target > 0)
+  {
+    idx_file = malloc(strlen(timing_file) + 5);
+    strcpy(idx_file, timing_file);
+    strcat(idx_file, ".idx");
+
+    /* Without index the seek is done by reading from the start */
+    /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    if (replay_seek(tim, log, idx_file, target, &t) == -1)
+    {
+      msg(WARN, "Cannot use %s", idx_file);
+      rewind(tim);
+      if (store == NULL)
+        rewind(log);
+      t = 0;
+    }
+    free(idx_file);
+  }
 
-  init_etime();
+  while (fgets(line, sizeof line, tim) != NULL)
+  {
+    if (sscanf(line, "%lf %zu", &delay, &len) != 2)
+      msg(FATAL, "Invalid line in %s: %s", timing_file, line);
 
-  pthread_create(&t1, NULL, manage_io, &args1);
-  pthread_create(&t2, NULL, inject_keys, &args2);
+    t += (long long)(delay * 1000000.0 + 0.5);
 
-  pthread_join(t2, NULL);
+    /* Sleep only once the seek position is reached, the first chunk */
+    /* past it only for the time left after it.                      */
+    /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    if (t > target)
+    {
+      if (delay > (t - target) / 1e6)
+        delay = (t - target) / 1e6;
+      if (max_gap > 0 && delay > max_gap)
+        delay = max_gap;
+      delay /= speed;
+
+      ts.tv_sec  = (time_t)delay;
+      ts.tv_nsec = (long)((delay - ts.tv_sec) * 1e9);
+      while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+    }
+
+    while (len > 0)
+    {
+      n = fread(buf, 1, len < sizeof buf ? len : sizeof buf, log);
+      if (n == 0)
+        msg(FATAL, "%s is shorter than its timing file", log_file);
+
+      if (write(1, buf, n) == -1)
+        return EXIT_FAILURE;
+
+      len -= n;
+    }
+  }
+
+  fclose(log);
+  fclose(tim);
 
-  close(fdc);
-  close(fdl);
+  if (store != NULL)
+  {
+    pthread_join(tid, NULL);
+    fclose(store);
+  }
+
+  return EXIT_SUCCESS;
 }
 
-/* ===================== */
-/* Slave side of the PTY */
-/* ===================== */
-void
-slave(int fd_slave, char ** argv)
+/* ===================================================================== */
+/* Writes on the standard output the log log_file deduplicated by -z.    */
+/* ===================================================================== */
+int
+unpack(const char * log_file)
 {
-  int rc;
-
-  /* The slave side of the PTY becomes the standard input and outputs */
-  /* of the child process.                                            */
-  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
-  close(0); /* Close standard input (current terminal)  */
-  close(1); /* Close standard output (current terminal) */
-  close(2); /* Close standard error (current terminal)  */
-
-  /* PTY becomes standard input (0) */
-  /* """""""""""""""""""""""""""""" */
-  if (dup(fd_slave) == -1)
-    msg(FATAL, "Error %d on dup()", errno);
-
-  /* PTY becomes standard output (1) */
-  /* """"""""""""""""""""""""""""""" */
-  if (dup(fd_slave) == -1)
-    msg(FATAL, "Error %d on dup()", errno);
-
-  /* PTY becomes standard error (2) */
-  /* """""""""""""""""""""""""""""" */
-  if (dup(fd_slave) == -1)
-    msg(FATAL, "Error %d on dup()", errno);
-
-  /* Make the current process a new session leader */
-  /* """"""""""""""""""""""""""""""""""""""""""""" */
-  setsid();
+  int fd, rc;
 
-  /* As the child is a session leader, set the controlling terminal to */
-  /* be the slave side of the PTY (Mandatory for programs like thea    */
-  /* shell to make them correctly manage their outputs).               */
-  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
-  ioctl(0, TIOCSCTTY, 1);
+  if ((fd = open(log_file, O_RDONLY | O_CLOEXEC)) == -1)
+    msg(FATAL, "Cannot open %s", log_file);
 
-  /* Set the effective uid from the real uid. */
-  /* """""""""""""""""""""""""""""""""""""""" */
-  seteuid(getuid());
+  if ((rc = ptylie_unpack(fd, 1)) == PTYLIE_EINVAL)
+    msg(FATAL, "%s is not a deduplicated log", log_file);
+  else if (rc != PTYLIE_OK)
+    msg(FATAL, "Cannot rebuild %s: %s", log_file, strerror(errno));
 
-  setupterm((char *)0, 1, (int *)0);
+  close(fd);
 
-  /* Program execution with its arguments */
-  /* """""""""""""""""""""""""""""""""""" */
-  rc = execvp(argv[my_optind], argv + my_optind);
-  if (rc == -1)
-    msg(FATAL, "Error %d on execvp()", errno);
+  return EXIT_SUCCESS;
 }
 
 /* ================================= */
@@ -1549,18 +2056,31 @@ my_getopt(int argc, char * argv[], const char * optstring)
 int
 main(int argc, char * argv[])
 {
-  int      fd_master, fd_slave;
-  int      opt;
-  int      fdl, fdc = 0;
-  unsigned n;
-  int      end;
-  unsigned width  = 0;
-  unsigned height = 0;
-  pid_t    slave_pid;
-
-  duration = default_duration;
-
-  while ((opt = my_getopt(argc, argv, "Vl:s:i:w:h:d:o:")) != -1)
+  int           opt;
+  unsigned      n;
+  int           end;
+  int           fdc      = 0;
+  char *        manifest = NULL;
+  int           jobs     = 0;
+  int           pool     = 0;
+  char *        replayed = NULL;
+  char *        unpacked = NULL;
+  double        speed    = 1.0;
+  double        max_gap  = 0.0;
+  double        seek     = 0.0;
+  ptylie_opts_t opts;
+  ptylie_t *    s;
+  bench_t       bench = { 0 };
+  int           run;
+  int           status = 0;
+  long long     start;
+
+  ptylie_opts_init(&opts);
+
+  while ((opt = my_getopt(argc, argv,
+                          "Vl:s:i:w:h:d:o:M:j:p:c:D:f:I:t:r:x:g:k:vS:F:T:B:O:"
+                          "ER:G:L:N:W:P:Q:A:X:zU:C:a:"))
+         != -1)
   {
     switch (opt)
     {
@@ -1576,8 +2096,170 @@ main(int argc, char * argv[])
         srt_file = strdup(my_optarg);
         break;
 
+      case 'c':
+        ctl_path = strdup(my_optarg);
+        break;
+
+      case 'D':
+        snap_file = strdup(my_optarg);
+        break;
+
+      case 't':
+        timing_file = strdup(my_optarg);
+        break;
+
+      case 'v':
+        opts.virtual_time = 1;
+        break;
+
+      case 'z':
+        opts.log_dedup = 1;
+        break;
+
+      case 'U':
+        unpacked = strdup(my_optarg);
+        break;
+
+      case 'a':
+        target_add(my_optarg);
+        break;
+
+      case 'C':
+        n = sscanf(my_optarg, "%zu%n", &ring_size, &end);
+        if (n != 1 || my_optarg[end] != '\0' || ring_size == 0)
+          usage(argv[0]);
+        ring_size <<= 20;
+        break;
+
+      case 'r':
+        replayed = strdup(my_optarg);
+        break;
+
+      case 'x':
+        n = sscanf(my_optarg, "%lf%n", &speed, &end);
+        if (n != 1 || my_optarg[end] != '\0' || speed <= 0)
+          usage(argv[0]);
+        break;
+
+      case 'g':
+        n = sscanf(my_optarg, "%lf%n", &max_gap, &end);
+        if (n != 1 || my_optarg[end] != '\0' || max_gap < 0)
+          usage(argv[0]);
+        break;
+
+      case 'k':
+        n = sscanf(my_optarg, "%lf%n", &seek, &end);
+        if (n != 1 || my_optarg[end] != '\0' || seek < 0)
+          usage(argv[0]);
+        break;
+
+      case 'f':
+        if (strcmp(my_optarg, "text") == 0)
+          snap_format = PTYLIE_SNAP_TEXT;
+        else if (strcmp(my_optarg, "json") == 0)
+          snap_format = PTYLIE_SNAP_JSON;
+        else
+          usage(argv[0]);
+        break;
+
+      case 'S':
+        stats_file = strdup(my_optarg);
+        break;
+
+      case 'T':
+        trace_file = strdup(my_optarg);
+        break;
+
+      case 'L':
+        latency_file = strdup(my_optarg);
+        break;
+
+      case 'P':
+        sample_file = strdup(my_optarg);
+        break;
+
+      case 'A':
+        render_file = strdup(my_optarg);
+        break;
+
+      case 'X':
+        transcript_file = strdup(my_optarg);
+        break;
+
+      case 'Q':
+        n = sscanf(my_optarg, "%ld%n", &sample_interval, &end);
+        if (n != 1 || my_optarg[end] != '\0' || sample_interval <= 0)
+          usage(argv[0]);
+        break;
+
+      case 'N':
+        n = sscanf(my_optarg, "%d%n", &runs, &end);
+        if (n != 1 || my_optarg[end] != '\0' || runs < 1)
+          usage(argv[0]);
+        break;
+
+      case 'W':
+        n = sscanf(my_optarg, "%d%n", &warmups, &end);
+        if (n != 1 || my_optarg[end] != '\0' || warmups < 0)
+          usage(argv[0]);
+        break;
+
+      case 'E':
+        in_eot = 1;
+        break;
+
+      case 'G':
+        n = sscanf(my_optarg, "%ld%n", &start_wait, &end);
+        if (n != 1 || my_optarg[end] != '\0' || start_wait < 0)
+          usage(argv[0]);
+        break;
+
+      case 'R':
+        n = sscanf(my_optarg, "%lf%n", &in_rate, &end);
+        if (n != 1 || in_rate <= 0)
+          usage(argv[0]);
+        if (my_optarg[end] == 'l' && my_optarg[end + 1] == '\0')
+          in_lines = 1;
+        else if (my_optarg[end] != '\0')
+          usage(argv[0]);
+        break;
+
+      case 'B':
+        n = sscanf(my_optarg, "%zu%n", &out_size, &end);
+        if (n != 1 || my_optarg[end] != '\0' || out_size == 0)
+          usage(argv[0]);
+        out_size *= 1024;
+        break;
+
+      case 'O':
+        if (strcmp(my_optarg, "block") == 0)
+          out_policy = OUT_BLOCK;
+        else if (strcmp(my_optarg, "drop") == 0)
+          out_policy = OUT_DROP;
+        else if (strcmp(my_optarg, "coalesce") == 0)
+          out_policy = OUT_COALESCE;
+        else
+          usage(argv[0]);
+        break;
+
+      case 'F':
+        if (strcmp(my_optarg, "text") == 0)
+          stats_format = PTYLIE_STATS_TEXT;
+        else if (strcmp(my_optarg, "openmetrics") == 0)
+          stats_format = PTYLIE_STATS_OPENMETRICS;
+        else
+          usage(argv[0]);
+        break;
+
+      case 'I':
+        n = sscanf(my_optarg, "%ld%n", &snap_interval, &end);
+        if (n != 1 || my_optarg[end] != '\0' || snap_interval < 0)
+          usage(argv[0]);
+        break;
+
       case 'i':
-        fdc = open(my_optarg, O_RDONLY);
+        cmd_file = strdup(my_optarg);
+        fdc      = open(my_optarg, O_RDONLY);
         if (fdc == -1)
         {
           msg(WARN, "Cannot open %s\n", my_optarg);
@@ -1586,36 +2268,42 @@ main(int argc, char * argv[])
         break;
 
       case 'd':
-        duration = atoi(my_optarg);
-        if (duration <= 0)
-          duration = default_duration;
+        opts.duration = atoi(my_optarg);
         break;
 
       case 'o':
-        offset = atol(my_optarg);
-        if (offset < 0)
-        {
-          offset      = -offset;
-          offset_sign = -1;
-        }
-        srt_offset.tv_sec  = offset / 1000;
-        srt_offset.tv_usec = (offset - srt_offset.tv_sec * 1000) * 1000;
-
+        opts.srt_offset = atol(my_optarg);
         break;
 
       case 'w':
-        n = sscanf(my_optarg, "%u%n", &width, &end);
+        n = sscanf(my_optarg, "%u%n", &opts.width, &end);
         if (n != 1 || my_optarg[end] != '\0')
           usage(argv[0]);
-        if (width == 0)
+        if (opts.width == 0)
           usage(argv[0]);
         break;
 
       case 'h':
-        n = sscanf(my_optarg, "%u%n", &height, &end);
+        n = sscanf(my_optarg, "%u%n", &opts.height, &end);
         if (n != 1 || my_optarg[end] != '\0')
           usage(argv[0]);
-        if (height == 0)
+        if (opts.height == 0)
+          usage(argv[0]);
+        break;
+
+      case 'M':
+        manifest = strdup(my_optarg);
+        break;
+
+      case 'j':
+        n = sscanf(my_optarg, "%d%n", &jobs, &end);
+        if (n != 1 || my_optarg[end] != '\0' || jobs <= 0)
+          usage(argv[0]);
+        break;
+
+      case 'p':
+        n = sscanf(my_optarg, "%d%n", &pool, &end);
+        if (n != 1 || my_optarg[end] != '\0' || pool < 0)
           usage(argv[0]);
         break;
 
@@ -1624,7 +2312,32 @@ main(int argc, char * argv[])
     }
   }
 
-  if (optind >= argc)
+  /* Runner mode, the sessions are described in the manifest */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (manifest != NULL)
+  {
+    /* Children parked in advance make the sessions start faster */
+    /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    if (pool > 0)
+      ptylie_pool(pool);
+
+    return run_manifest(manifest, jobs);
+  }
+
+  if (unpacked != NULL)
+    return unpack(unpacked);
+
+  /* Replay mode, a recorded log is played back */
+  /* """""""""""""""""""""""""""""""""""""""""" */
+  if (replayed != NULL)
+  {
+    if (timing_file == NULL)
+      usage(argv[0]);
+
+    return replay(replayed, timing_file, speed, max_gap, seek);
+  }
+
+  if (my_optind >= argc)
   {
     msg(WARN, "Expected argument after options\n");
     usage(argv[0]);
@@ -1636,51 +2349,141 @@ main(int argc, char * argv[])
   if (argc <= 1)
     msg(FATAL, "Usage: %s program_name [parameters]", argv[0]);
 
-  if (fdc == -1)
-    usage(argv[0]);
-
   if (log_file == NULL)
     log_file = "ptylog";
 
   if (srt_file == NULL)
     srt_file = "ptylog.srt";
 
-  fdl = open(log_file, O_RDWR | O_CREAT | O_TRUNC,
-             S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+  opts.log_file    = log_file;
+  opts.srt_file    = srt_file;
+  opts.timing_file = timing_file;
+  opts.start_wait  = start_wait;
+  opts.ring_size   = ring_size;
+
+  /* The command file is read again by each repeated run */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (runs + warmups > 1 && cmd_file == NULL)
+    usage(argv[0]);
+
+  /* Counters dumped on SIGUSR1 and at exit */
+  /* """""""""""""""""""""""""""""""""""""" */
+  if (stats_file != NULL)
+  {
+    struct sigaction sa;
 
-  chown(log_file, getuid(), getgid());
+    sa.sa_handler = stats_handler;
+    sa.sa_flags   = 0;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+  }
 
-  fd_master = open_master();
+  /* Log kept in memory written on SIGUSR2 */
+  /* """"""""""""""""""""""""""""""""""""" */
+  if (ring_size > 0)
+  {
+    struct sigaction sa;
 
-  /* Open the slave side of the PTY */
-  /* """""""""""""""""""""""""""""" */
-  fd_slave = open(ptsname(fd_master), O_RDWR | O_APPEND);
+    sa.sa_handler = dump_handler;
+    sa.sa_flags   = 0;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR2, &sa, NULL);
+  }
 
   /* Initialize the terminal */
   /* """"""""""""""""""""""" */
-  set_terminal(fd_master, &old_termios_master);
-  set_terminal(fd_slave, &old_termios_slave);
+  set_terminal();
 
   /* Restore terminal on exit */
   /* """""""""""""""""""""""" */
   atexit(cleanup);
 
-  set_terminal_size(fd_slave, width, height);
+  /* Non blocking stdout fed from out_buf by manage_io */
+  /* """""""""""""""""""""""""""""""""""""""""""""""" */
+  if (out_size < BUFSIZ)
+    out_size = BUFSIZ;
+  if ((out_buf = malloc(out_size)) == NULL)
+    msg(FATAL, "Cannot allocate the output buffer");
+  if ((out_flags = fcntl(1, F_GETFL)) != -1)
+    fcntl(1, F_SETFL, out_flags | O_NONBLOCK);
+
+  /* With -N the child of the next run is started in its PTY while */
+  /* the current run goes on, unless -a programs are started first */
+  /* as they would take the child parked for the main program.     */
+  /* The first run pays a cold start, it is not measured.          */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (runs + warmups > 1)
+  {
+    bench.samples = malloc(runs * BENCH_METRICS * sizeof(double));
+    if (bench.samples == NULL)
+      msg(FATAL, "Cannot allocate the runs statistics");
+    if (targets_nb == 0)
+    {
+      ptylie_pool(1);
+      if (warmups == 0)
+      {
+        warmups      = 1;
+        bench.warmup = 1;
+      }
+    }
+  }
 
-  /* Create the child process */
-  /* """""""""""""""""""""""" */
-  if ((slave_pid = fork()))
+  for (run = 0; run < warmups + runs; run++)
   {
-    int rc;
+    int last = run == warmups + runs - 1;
+
+    if (run > 0 && (fdc = open(cmd_file, O_RDONLY)) == -1)
+      msg(FATAL, "Cannot open %s", cmd_file);
+
+    s = session_new(&opts, fdc);
 
-    master(fd_master, fd_slave, fdl, fdc);
+    /* The other programs are started first, a server is then up */
+    /* before its clients.                                       */
+    /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    targets_start(s, &opts);
 
-    /* Wait for the slave to end */
-    /* ''''''''''''''''''''''''' */
-    wait(&rc);
+    /* Create the child process */
+    /* """""""""""""""""""""""" */
+    start = now_ns();
+    if (ptylie_spawn(s, argv + my_optind) != PTYLIE_OK)
+      msg(FATAL, "\r\n%s\r", ptylie_errmsg(s));
+
+    master(s);
+
+    /* Output not yet accepted by stdout */
+    /* """"""""""""""""""""""""""""""""" */
+    out_drain();
+
+    if (bench.samples != NULL && run >= warmups)
+      bench_record(&bench, s, now_ns() - start);
+
+    if (child_status != 0)
+      status = child_status;
+
+    /* The log kept in memory is only written if the child failed */
+    /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    if (ring_size > 0 && child_status != 0 && ptylie_dump(s) != PTYLIE_OK)
+      msg(WARN, "%s", ptylie_errmsg(s));
+
+    if (stats_file != NULL && last)
+    {
+      cleanup();
+      stats_dump(s);
+    }
+
+    targets_end();
+
+    /* Also writes the final state of the screen and ends the trace */
+    /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    ptylie_free(s);
   }
-  else
-    slave(fd_slave, argv);
 
-  return 0;
+  if (bench.samples != NULL)
+  {
+    ptylie_pool(0);
+    cleanup();
+    bench_report(&bench, warmups);
+  }
+
+  return status;
 }
@@ -0,0 +1,182 @@
+/* ################################################################### */
+/* libptylie: runs programs in pseudo terminals, injects keystrokes in */
+/* their keyboard buffer and records their output.                     */
+/*                                                                     */
+/* All the functions returning an int or a ssize_t return a negative   */
+/* PTYLIE_E* code on error, ptylie_errmsg gives a detailed message.    */
+/* A handle must not be used by more than one thread at a time except  */
+/* that the output side (ptylie_read, ptylie_write) and the injection  */
+/* side (ptylie_step, ptylie_inject, ptylie_resize) can be driven by   */
+/* two different threads, and that ptylie_dump can be called by any    */
+/* thread.                                                             */
+/* ################################################################### */
+
+#ifndef PTYLIE_H
+#define PTYLIE_H
+
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <time.h>
+
+typedef struct ptylie_s ptylie_t;
+
+typedef struct ptylie_opts_s ptylie_opts_t;
+
+/* Error codes */
+/* """"""""""" */
+enum
+{
+  PTYLIE_OK       = 0,
+  PTYLIE_ESYS     = -1, /* a system call has failed, see errno */
+  PTYLIE_EINVAL   = -2, /* invalid argument                    */
+  PTYLIE_ESCRIPT  = -3, /* invalid directive in a command file */
+  PTYLIE_ETIMEOUT = -4, /* the timeout has expired             */
+  PTYLIE_ECLOSED  = -5  /* the PTY has been closed             */
+};
+
+/* Formats of the screen snapshots (ptylie_screen) */
+/* """"""""""""""""""""""""""""""""""""""""""""""" */
+enum
+{
+  PTYLIE_SNAP_TEXT = 0, /* header line followed by the screen lines */
+  PTYLIE_SNAP_JSON = 1  /* one JSON object per line                 */
+};
+
+/* Formats of the counters (ptylie_stats) */
+/* """""""""""""""""""""""""""""""""""""" */
+enum
+{
+  PTYLIE_STATS_TEXT        = 0, /* one key=value line per counter */
+  PTYLIE_STATS_OPENMETRICS = 1  /* OpenMetrics text format        */
+};
+
+/* Entries of the index of a timing file (opts.timing_file), they have */
+/* a fixed size to allow a binary search: the recording time in us,    */
+/* the offset of the chunk in the log and in the timing file.          */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#define PTYLIE_IDX_FORMAT "%015lld %015lld %015lld\n"
+#define PTYLIE_IDX_SIZE 48
+#define PTYLIE_IDX_STEP 1000000LL /* us between two index entries */
+
+/* First bytes of a deduplicated log (opts.log_dedup, ptylie_unpack) */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#define PTYLIE_STORE_MAGIC "PTYCDC1\n"
+#define PTYLIE_STORE_MAGIC_SIZE 8
+
+/* Session creation options, see ptylie_opts_init for the defaults */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct ptylie_opts_s
+{
+  unsigned     width;        /* terminal geometry, 80x24 if both are 0 */
+  unsigned     height;       /*                                        */
+  const char * log_file;     /* output log, NULL for no log            */
+  int          log_dedup;    /* 1 to deduplicate the log, see          */
+                             /* ptylie_unpack                          */
+  size_t       ring_size;    /* bytes of the last chunks of the log    */
+                             /* kept in memory instead of writing it,  */
+                             /* see ptylie_dump, 0 to write the log    */
+  const char * srt_file;     /* subtitles file used by \k              */
+  int          duration;     /* subtitles duration in ms               */
+  long         srt_offset;   /* ms added to the subtitles timestamps   */
+  const char * timing_file;  /* timing of the log, NULL for none       */
+  int          virtual_time; /* 1 to skip the sleeps, see ptylie_new   */
+  long         start_wait;   /* max ms waited for the child to read    */
+                             /* its input before the first key, 0 for  */
+                             /* no start gate                          */
+};
+
+void
+ptylie_opts_init(ptylie_opts_t * opts);
+
+int
+ptylie_new(ptylie_t ** ps, const ptylie_opts_t * opts);
+
+int
+ptylie_spawn(ptylie_t * s, char * const argv[]);
+
+int
+ptylie_pool(unsigned size);
+
+int
+ptylie_unpack(int fd_in, int fd_out);
+
+int
+ptylie_script(ptylie_t * s, int fd);
+
+int
+ptylie_target(ptylie_t * s, const char * name, ptylie_t * t);
+
+int
+ptylie_control(ptylie_t * s, const char * path);
+
+int
+ptylie_screen(ptylie_t * s, const char * file, int format, long interval);
+
+int
+ptylie_snapshot(ptylie_t * s, const char * marker);
+
+int
+ptylie_stats(ptylie_t * s, FILE * out, int format);
+
+int
+ptylie_trace(ptylie_t * s, const char * file);
+
+int
+ptylie_latency(ptylie_t * s, const char * file);
+
+int
+ptylie_transcript(ptylie_t * s, const char * file);
+
+int
+ptylie_dump(ptylie_t * s);
+
+int
+ptylie_render(ptylie_t * s, const char * file);
+
+int
+ptylie_sample(ptylie_t * s, const char * file, long interval);
+
+int
+ptylie_step(ptylie_t * s, struct timespec * delay);
+
+int
+ptylie_inject(ptylie_t * s, const void * buf, size_t len);
+
+ssize_t
+ptylie_write(ptylie_t * s, const void * buf, size_t len);
+
+ssize_t
+ptylie_read(ptylie_t * s, void * buf, size_t len, int timeout);
+
+int
+ptylie_resize(ptylie_t * s, unsigned width, unsigned height);
+
+int
+ptylie_wait(ptylie_t * s, int * status, int timeout);
+
+int
+ptylie_fd(ptylie_t * s);
+
+int
+ptylie_exit_fd(ptylie_t * s);
+
+int
+ptylie_rusage(ptylie_t * s, struct rusage * usage);
+
+int
+ptylie_marker(ptylie_t * s, unsigned i, const char ** name, long long * ns);
+
+pid_t
+ptylie_pid(ptylie_t * s);
+
+void
+ptylie_free(ptylie_t * s);
+
+const char *
+ptylie_strerror(int err);
+
+const char *
+ptylie_errmsg(ptylie_t * s);
+
+#endif
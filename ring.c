@@ -0,0 +1,197 @@
+/* ################################################################### */
+/* Ring of timestamped records kept in memory. The offsets count the   */
+/* bytes written since the creation of the ring, the byte at offset o  */
+/* is at buf[o % size]. Each record is a ring_rec_t header followed by */
+/* its data, possibly split at the end of buf.                         */
+/* The writer never waits: before overwriting the oldest records it    */
+/* moves first past them, then writes and publishes the new head. A    */
+/* reader copies the bytes between first and head and reads first      */
+/* again after the copy, the records before the new first may have     */
+/* been overwritten during the copy and are skipped (as a seqlock).    */
+/* ################################################################### */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+typedef struct ring_rec_s ring_rec_t;
+
+/* ---------- */
+/* Prototypes */
+/* ---------- */
+
+static void
+ring_copy_in(ring_t * r, unsigned long long off, const void * src,
+             size_t len);
+
+static void
+ring_copy_out(ring_t * r, unsigned long long off, void * dst, size_t len);
+
+/* ----------- */
+/* Definitions */
+/* ----------- */
+
+#define RING_MIN 4096 /* smallest size of a ring */
+
+struct ring_rec_s
+{
+  long long time; /* given by the writer */
+  size_t    len;  /* bytes of data       */
+};
+
+struct ring_s
+{
+  unsigned char *    buf;
+  size_t             size;
+  unsigned long long head;  /* end of the newest record        */
+  unsigned long long first; /* start of the oldest record kept */
+};
+
+/* ================================================================ */
+/* Copies len bytes to the ring at the offset off.                  */
+/* ================================================================ */
+static void
+ring_copy_in(ring_t * r, unsigned long long off, const void * src,
+             size_t len)
+{
+  size_t pos = off % r->size;
+  size_t n   = r->size - pos < len ? r->size - pos : len;
+
+  memcpy(r->buf + pos, src, n);
+  memcpy(r->buf, (const unsigned char *)src + n, len - n);
+}
+
+/* ================================================================ */
+/* Copies len bytes of the ring from the offset off.                */
+/* ================================================================ */
+static void
+ring_copy_out(ring_t * r, unsigned long long off, void * dst, size_t len)
+{
+  size_t pos = off % r->size;
+  size_t n   = r->size - pos < len ? r->size - pos : len;
+
+  memcpy(dst, r->buf + pos, n);
+  memcpy((unsigned char *)dst + n, r->buf, len - n);
+}
+
+/* ================================================================ */
+/* Returns a new empty ring of size bytes, headers included, or     */
+/* NULL if it cannot be allocated.                                  */
+/* ================================================================ */
+ring_t *
+ring_new(size_t size)
+{
+  ring_t * r;
+
+  if (size < RING_MIN)
+    size = RING_MIN;
+
+  if ((r = calloc(1, sizeof(ring_t))) == NULL)
+    return NULL;
+
+  if ((r->buf = malloc(size)) == NULL)
+  {
+    free(r);
+    return NULL;
+  }
+  r->size = size;
+
+  return r;
+}
+
+/* ================================================================ */
+/* Appends a record of len bytes with its time, only the end of a   */
+/* record larger than the ring is kept. Must always be called by    */
+/* the same thread.                                                 */
+/* ================================================================ */
+void
+ring_put(ring_t * r, long long time, const void * buf, size_t len)
+{
+  ring_rec_t         rec;
+  unsigned long long head  = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+  unsigned long long first = __atomic_load_n(&r->first, __ATOMIC_RELAXED);
+  unsigned long long end;
+
+  if (len > r->size - sizeof rec)
+  {
+    buf = (const unsigned char *)buf + len - (r->size - sizeof rec);
+    len = r->size - sizeof rec;
+  }
+  end = head + sizeof rec + len;
+
+  /* The readers must see the oldest records dropped before their */
+  /* bytes are overwritten.                                        */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (end - first > r->size)
+  {
+    while (end - first > r->size)
+    {
+      ring_copy_out(r, first, &rec, sizeof rec);
+      first += sizeof rec + rec.len;
+    }
+    __atomic_store_n(&r->first, first, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+  }
+
+  rec.time = time;
+  rec.len  = len;
+  ring_copy_in(r, head, &rec, sizeof rec);
+  ring_copy_in(r, head + sizeof rec, buf, len);
+
+  __atomic_store_n(&r->head, end, __ATOMIC_RELEASE);
+}
+
+/* ================================================================ */
+/* Calls fn with ctx for each record of a copy of the ring, from    */
+/* the oldest one. Can be called by any thread while the writer     */
+/* goes on, the records it overwrites during the copy are missing.  */
+/* Returns 0, -1 if the copy cannot be allocated or the first non 0 */
+/* value returned by fn.                                            */
+/* ================================================================ */
+int
+ring_read(ring_t * r, ring_fn_t fn, void * ctx)
+{
+  unsigned long long first, head, last;
+  unsigned char *    copy;
+  ring_rec_t         rec;
+  size_t             pos, len;
+  int                rc = 0;
+
+  if ((copy = malloc(r->size)) == NULL)
+    return -1;
+
+  /* first is read before head so that first <= head, again if the */
+  /* writer has gone round the ring between the two.                */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  do
+  {
+    first = __atomic_load_n(&r->first, __ATOMIC_ACQUIRE);
+    head  = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  } while (head - first > r->size);
+
+  len = head - first;
+  ring_copy_out(r, first, copy, len);
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  last = __atomic_load_n(&r->first, __ATOMIC_RELAXED);
+
+  pos = last >= head ? len : last > first ? last - first : 0;
+  while (rc == 0 && pos < len)
+  {
+    memcpy(&rec, copy + pos, sizeof rec);
+    rc = fn(ctx, rec.time, copy + pos + sizeof rec, rec.len);
+    pos += sizeof rec + rec.len;
+  }
+
+  free(copy);
+
+  return rc;
+}
+
+void
+ring_free(ring_t * r)
+{
+  free(r->buf);
+  free(r);
+}
@@ -0,0 +1,31 @@
+/* ################################################################### */
+/* Ring of timestamped records kept in memory: a single writer appends */
+/* records without ever waiting, overwriting the oldest ones, while    */
+/* any other thread can read a consistent copy of the records kept.    */
+/* ################################################################### */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+
+typedef struct ring_s ring_t;
+
+/* Called by ring_read for each record, a non 0 return stops the read */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+typedef int (*ring_fn_t)(void * ctx, long long time, const void * buf,
+                         size_t len);
+
+ring_t *
+ring_new(size_t size);
+
+void
+ring_put(ring_t * r, long long time, const void * buf, size_t len);
+
+int
+ring_read(ring_t * r, ring_fn_t fn, void * ctx);
+
+void
+ring_free(ring_t * r);
+
+#endif
@@ -0,0 +1,1803 @@
+/* ################################################################## */
+/* Headless VT100/xterm screen model: a DEC compatible escape         */
+/* sequences parser driving a grid of cells with damage tracking.     */
+/* ################################################################## */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "vt.h"
+
+/* ---------- */
+/* Prototypes */
+/* ---------- */
+
+static void
+vt_init_tables(void);
+
+static int
+vt_wcwidth(uint32_t cp);
+
+static void
+vt_clear_cells(vt_t * vt, vt_cell_t * cell, unsigned n);
+
+static void
+vt_fix_wide(vt_t * vt, unsigned y, unsigned x);
+
+static void
+vt_scroll_up(vt_t * vt, unsigned top, unsigned bottom, unsigned n);
+
+static void
+vt_scroll_down(vt_t * vt, unsigned top, unsigned bottom, unsigned n);
+
+static void
+vt_linefeed(vt_t * vt);
+
+static void
+vt_put(vt_t * vt, uint32_t cp);
+
+static void
+vt_put_ascii(vt_t * vt, const unsigned char * p, size_t n);
+
+static void
+vt_execute(vt_t * vt, unsigned char c);
+
+static void
+vt_save_cursor(vt_t * vt, int save);
+
+static void
+vt_switch_screen(vt_t * vt, int alt);
+
+static void
+vt_esc_dispatch(vt_t * vt, unsigned char c);
+
+static void
+vt_csi_dispatch(vt_t * vt, unsigned char c);
+
+static uint32_t
+vt_sgr_color(vt_t * vt, int * i);
+
+static void
+vt_sgr(vt_t * vt);
+
+static void
+vt_set_mode(vt_t * vt, int set);
+
+static void
+vt_reset(vt_t * vt);
+
+static void
+vt_json_string(FILE * out, const char * str);
+
+static void
+vt_dump_line(vt_t * vt, FILE * out, unsigned y, int json);
+
+static const unsigned char *
+vt_text_end(const unsigned char * p, const unsigned char * end);
+
+static void
+vt_cost_esc(vt_cost_t * cost, unsigned char c);
+
+static void
+vt_cost_csi(vt_cost_t * cost, unsigned char c);
+
+/* ----------- */
+/* Definitions */
+/* ----------- */
+
+#define VT_MAX_PARAMS 16
+
+/* Parser states, see https://vt100.net/emu/dec_ansi_parser */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+enum
+{
+  S_GROUND,
+  S_ESC,
+  S_ESC_INT,
+  S_CSI_ENTRY,
+  S_CSI_PARAM,
+  S_CSI_INT,
+  S_CSI_IGNORE,
+  S_OSC,
+  S_STRING, /* DCS, SOS, PM and APC strings are ignored */
+  S_NB
+};
+
+/* Parser actions */
+/* """""""""""""" */
+enum
+{
+  A_NONE,
+  A_PRINT,
+  A_EXECUTE,
+  A_CLEAR,
+  A_COLLECT,
+  A_PARAM,
+  A_ESC_DISPATCH,
+  A_CSI_DISPATCH
+};
+
+/* The action and the next state of each state/byte pair, */
+/* coded as action << 4 | state.                          */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""" */
+static unsigned char  vt_table[S_NB][256];
+static pthread_once_t vt_once = PTHREAD_ONCE_INIT;
+
+/* Ranges of double width and zero width code points, sorted */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct range_s
+{
+  uint32_t first;
+  uint32_t last;
+};
+
+static const struct range_s wide_ranges[] = {
+  { 0x1100, 0x115f },   { 0x231a, 0x231b },   { 0x2329, 0x232a },
+  { 0x23e9, 0x23ec },   { 0x23f0, 0x23f0 },   { 0x23f3, 0x23f3 },
+  { 0x25fd, 0x25fe },   { 0x2614, 0x2615 },   { 0x2648, 0x2653 },
+  { 0x267f, 0x267f },   { 0x2693, 0x2693 },   { 0x26a1, 0x26a1 },
+  { 0x26aa, 0x26ab },   { 0x26bd, 0x26be },   { 0x26c4, 0x26c5 },
+  { 0x26ce, 0x26ce },   { 0x26d4, 0x26d4 },   { 0x26ea, 0x26ea },
+  { 0x26f2, 0x26f3 },   { 0x26f5, 0x26f5 },   { 0x26fa, 0x26fa },
+  { 0x26fd, 0x26fd },   { 0x2705, 0x2705 },   { 0x270a, 0x270b },
+  { 0x2728, 0x2728 },   { 0x274c, 0x274c },   { 0x274e, 0x274e },
+  { 0x2753, 0x2755 },   { 0x2757, 0x2757 },   { 0x2795, 0x2797 },
+  { 0x27b0, 0x27b0 },   { 0x27bf, 0x27bf },   { 0x2b1b, 0x2b1c },
+  { 0x2b50, 0x2b50 },   { 0x2b55, 0x2b55 },   { 0x2e80, 0x303e },
+  { 0x3041, 0x33ff },   { 0x3400, 0x4dbf },   { 0x4e00, 0x9fff },
+  { 0xa000, 0xa4cf },   { 0xa960, 0xa97f },   { 0xac00, 0xd7a3 },
+  { 0xf900, 0xfaff },   { 0xfe10, 0xfe19 },   { 0xfe30, 0xfe6f },
+  { 0xff00, 0xff60 },   { 0xffe0, 0xffe6 },   { 0x16fe0, 0x16fe4 },
+  { 0x17000, 0x18cff }, { 0x1b000, 0x1b2ff }, { 0x1f004, 0x1f004 },
+  { 0x1f0cf, 0x1f0cf }, { 0x1f18e, 0x1f18e }, { 0x1f191, 0x1f19a },
+  { 0x1f200, 0x1f202 }, { 0x1f210, 0x1f23b }, { 0x1f240, 0x1f248 },
+  { 0x1f250, 0x1f251 }, { 0x1f260, 0x1f265 }, { 0x1f300, 0x1f320 },
+  { 0x1f32d, 0x1f335 }, { 0x1f337, 0x1f37c }, { 0x1f37e, 0x1f393 },
+  { 0x1f3a0, 0x1f3ca }, { 0x1f3cf, 0x1f3d3 }, { 0x1f3e0, 0x1f3f0 },
+  { 0x1f3f4, 0x1f3f4 }, { 0x1f3f8, 0x1f43e }, { 0x1f440, 0x1f440 },
+  { 0x1f442, 0x1f4fc }, { 0x1f4ff, 0x1f53d }, { 0x1f54b, 0x1f54e },
+  { 0x1f550, 0x1f567 }, { 0x1f57a, 0x1f57a }, { 0x1f595, 0x1f596 },
+  { 0x1f5a4, 0x1f5a4 }, { 0x1f5fb, 0x1f64f }, { 0x1f680, 0x1f6c5 },
+  { 0x1f6cc, 0x1f6cc }, { 0x1f6d0, 0x1f6d2 }, { 0x1f6d5, 0x1f6d7 },
+  { 0x1f6eb, 0x1f6ec }, { 0x1f6f4, 0x1f6fc }, { 0x1f7e0, 0x1f7eb },
+  { 0x1f90c, 0x1f93a }, { 0x1f93c, 0x1f945 }, { 0x1f947, 0x1f9ff },
+  { 0x1fa70, 0x1faff }, { 0x20000, 0x2fffd }, { 0x30000, 0x3fffd },
+};
+
+static const struct range_s zero_ranges[] = {
+  { 0x0300, 0x036f },   { 0x0483, 0x0489 }, { 0x0591, 0x05bd },
+  { 0x05bf, 0x05bf },   { 0x05c1, 0x05c2 }, { 0x05c4, 0x05c5 },
+  { 0x05c7, 0x05c7 },   { 0x0610, 0x061a }, { 0x064b, 0x065f },
+  { 0x0670, 0x0670 },   { 0x06d6, 0x06dc }, { 0x06df, 0x06e4 },
+  { 0x06e7, 0x06e8 },   { 0x06ea, 0x06ed }, { 0x0900, 0x0902 },
+  { 0x093a, 0x093a },   { 0x093c, 0x093c }, { 0x0941, 0x0948 },
+  { 0x094d, 0x094d },   { 0x0951, 0x0957 }, { 0x0e31, 0x0e31 },
+  { 0x0e34, 0x0e3a },   { 0x0e47, 0x0e4e }, { 0x1ab0, 0x1aff },
+  { 0x1dc0, 0x1dff },   { 0x200b, 0x200f }, { 0x202a, 0x202e },
+  { 0x2060, 0x2064 },   { 0x20d0, 0x20ff }, { 0xfe00, 0xfe0f },
+  { 0xfe20, 0xfe2f },   { 0xfeff, 0xfeff }, { 0xe0100, 0xe01ef },
+};
+
+/* State of a screen. The lines are accessed through arrays of */
+/* pointers so that scrolling only moves pointers.             */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct vt_s
+{
+  unsigned     cols;
+  unsigned     rows;
+  vt_cell_t *  grid[2];  /* cells of the primary and alternate screens */
+  vt_cell_t ** lines[2]; /* lines of the primary and alternate screens */
+  vt_cell_t ** line;     /* lines of the active screen                 */
+  int          alt;      /* 1 if the alternate screen is active        */
+  unsigned *   dirty;    /* bitmap of the lines damaged since the dump */
+  unsigned     nb_dirty; /* number of lines damaged since the dump     */
+
+  /* Cursor and pen */
+  /* '''''''''''''' */
+  unsigned x, y;
+  int      wrap_pending; /* the last column has been written */
+  uint32_t attr;
+  uint32_t fg;
+  uint32_t bg;
+  uint32_t last_cp; /* for REP */
+
+  /* Cursor saved by DECSC */
+  /* ''''''''''''''''''''' */
+  unsigned saved_x, saved_y;
+  uint32_t saved_attr, saved_fg, saved_bg;
+
+  unsigned top, bottom; /* scrolling region (inclusive) */
+  int      autowrap;
+  int      origin;
+  int      cursor_on;
+
+  /* Parser */
+  /* '''''' */
+  int          state;
+  unsigned     params[VT_MAX_PARAMS];
+  int          nb_params;
+  char         private; /* '?', '>', ... */
+  char         inter;   /* last intermediate byte */
+  uint32_t     cp;      /* UTF-8 sequence being decoded */
+  int          need;    /* continuation bytes still expected */
+};
+
+/* ================================================================ */
+/* Builds the transition table of the parser, see vt_table.         */
+/* ================================================================ */
+static void
+vt_init_tables(void)
+{
+  int s, c;
+
+#define SET(st, from, to, action, next)                                     \
+  for (c = (from); c <= (to); c++)                                          \
+    vt_table[st][c] = (action) << 4 | (next)
+
+  for (s = 0; s < S_NB; s++)
+  {
+    /* By default stay in the same state and do nothing */
+    /* '''''''''''''''''''''''''''''''''''''''''''''''' */
+    SET(s, 0x00, 0xff, A_NONE, s);
+
+    /* C0 controls are executed in all the states but the strings */
+    /* '''''''''''''''''''''''''''''''''''''''''''''''''''''''''' */
+    if (s != S_OSC && s != S_STRING)
+    {
+      SET(s, 0x00, 0x17, A_EXECUTE, s);
+      SET(s, 0x19, 0x19, A_EXECUTE, s);
+      SET(s, 0x1c, 0x1f, A_EXECUTE, s);
+    }
+
+    /* Transitions from anywhere */
+    /* ''''''''''''''''''''''''' */
+    SET(s, 0x18, 0x18, A_EXECUTE, S_GROUND);
+    SET(s, 0x1a, 0x1a, A_EXECUTE, S_GROUND);
+    SET(s, 0x1b, 0x1b, A_CLEAR, S_ESC);
+  }
+
+  SET(S_GROUND, 0x20, 0x7e, A_PRINT, S_GROUND);
+  SET(S_GROUND, 0x80, 0xff, A_PRINT, S_GROUND);
+
+  SET(S_ESC, 0x20, 0x2f, A_COLLECT, S_ESC_INT);
+  SET(S_ESC, 0x30, 0x7e, A_ESC_DISPATCH, S_GROUND);
+  SET(S_ESC, '[', '[', A_CLEAR, S_CSI_ENTRY);
+  SET(S_ESC, ']', ']', A_NONE, S_OSC);
+  SET(S_ESC, 'P', 'P', A_NONE, S_STRING);
+  SET(S_ESC, 'X', 'X', A_NONE, S_STRING);
+  SET(S_ESC, '^', '_', A_NONE, S_STRING);
+
+  SET(S_ESC_INT, 0x20, 0x2f, A_COLLECT, S_ESC_INT);
+  SET(S_ESC_INT, 0x30, 0x7e, A_ESC_DISPATCH, S_GROUND);
+
+  SET(S_CSI_ENTRY, 0x20, 0x2f, A_COLLECT, S_CSI_INT);
+  SET(S_CSI_ENTRY, 0x30, 0x3b, A_PARAM, S_CSI_PARAM);
+  SET(S_CSI_ENTRY, 0x3c, 0x3f, A_COLLECT, S_CSI_PARAM);
+  SET(S_CSI_ENTRY, 0x40, 0x7e, A_CSI_DISPATCH, S_GROUND);
+
+  SET(S_CSI_PARAM, 0x20, 0x2f, A_COLLECT, S_CSI_INT);
+  SET(S_CSI_PARAM, 0x30, 0x3b, A_PARAM, S_CSI_PARAM);
+  SET(S_CSI_PARAM, 0x3c, 0x3f, A_NONE, S_CSI_IGNORE);
+  SET(S_CSI_PARAM, 0x40, 0x7e, A_CSI_DISPATCH, S_GROUND);
+
+  SET(S_CSI_INT, 0x20, 0x2f, A_COLLECT, S_CSI_INT);
+  SET(S_CSI_INT, 0x30, 0x3f, A_NONE, S_CSI_IGNORE);
+  SET(S_CSI_INT, 0x40, 0x7e, A_CSI_DISPATCH, S_GROUND);
+
+  SET(S_CSI_IGNORE, 0x40, 0x7e, A_NONE, S_GROUND);
+
+  /* OSC strings end with BEL or ST (ESC \) */
+  /* '''''''''''''''''''''''''''''''''''''' */
+  SET(S_OSC, 0x07, 0x07, A_NONE, S_GROUND);
+
+#undef SET
+}
+
+/* ================================================================ */
+/* Returns the number of columns used by the code point cp.         */
+/* ================================================================ */
+static int
+vt_wcwidth(uint32_t cp)
+{
+  const struct range_s * r;
+  int                    lo, hi, mid, n;
+
+  if (cp < 0x300)
+    return 1;
+
+  for (r = wide_ranges, n = sizeof wide_ranges / sizeof *r;;
+       r = zero_ranges, n = sizeof zero_ranges / sizeof *r)
+  {
+    lo = 0;
+    hi = n - 1;
+    while (lo <= hi)
+    {
+      mid = (lo + hi) / 2;
+      if (cp < r[mid].first)
+        hi = mid - 1;
+      else if (cp > r[mid].last)
+        lo = mid + 1;
+      else
+        return r == wide_ranges ? 2 : 0;
+    }
+
+    if (r == zero_ranges)
+      return 1;
+  }
+}
+
+/* ================================================================ */
+/* Allocates a new screen of cols x rows cells.                     */
+/* ================================================================ */
+vt_t *
+vt_new(unsigned cols, unsigned rows)
+{
+  vt_t * vt;
+
+  pthread_once(&vt_once, vt_init_tables);
+
+  if ((vt = calloc(1, sizeof(vt_t))) == NULL)
+    return NULL;
+
+  if (vt_resize(vt, cols, rows) == -1)
+  {
+    free(vt);
+    return NULL;
+  }
+
+  vt_reset(vt);
+
+  return vt;
+}
+
+/* ============================ */
+/* Frees a screen and its cells */
+/* ============================ */
+void
+vt_free(vt_t * vt)
+{
+  free(vt->grid[0]);
+  free(vt->lines[0]);
+  free(vt->dirty);
+  free(vt);
+}
+
+/* ================================================================ */
+/* Fills n cells with blanks drawn with the current background.     */
+/* ================================================================ */
+static void
+vt_clear_cells(vt_t * vt, vt_cell_t * cell, unsigned n)
+{
+  vt_cell_t blank = { ' ', 0, vt->bg };
+
+  while (n-- > 0)
+    *cell++ = blank;
+}
+
+#define DIRTY(vt, y)                                                          \
+  do                                                                          \
+  {                                                                           \
+    if (!((vt)->dirty[(y) / 32] & (1U << ((y) % 32))))                        \
+    {                                                                         \
+      (vt)->dirty[(y) / 32] |= 1U << ((y) % 32);                              \
+      (vt)->nb_dirty++;                                                       \
+    }                                                                         \
+  } while (0)
+
+/* ================================================================ */
+/* Resizes the screen, the content is kept from the top left corner */
+/* Returns -1 if the memory cannot be allocated.                    */
+/* ================================================================ */
+int
+vt_resize(vt_t * vt, unsigned cols, unsigned rows)
+{
+  vt_cell_t *  grid[2];
+  vt_cell_t ** lines[2];
+  unsigned *   dirty;
+  unsigned     i, y;
+
+  if (cols == 0 || rows == 0)
+    return -1;
+
+  grid[0]  = malloc(2 * cols * rows * sizeof(vt_cell_t));
+  lines[0] = malloc(2 * rows * sizeof(vt_cell_t *));
+  dirty    = calloc((rows + 31) / 32, sizeof(unsigned));
+
+  if (grid[0] == NULL || lines[0] == NULL || dirty == NULL)
+  {
+    free(grid[0]);
+    free(lines[0]);
+    free(dirty);
+    return -1;
+  }
+
+  grid[1]  = grid[0] + cols * rows;
+  lines[1] = lines[0] + rows;
+
+  for (i = 0; i < 2; i++)
+  {
+    for (y = 0; y < rows; y++)
+    {
+      lines[i][y] = grid[i] + y * cols;
+      vt_clear_cells(vt, lines[i][y], cols);
+
+      if (vt->lines[i] != NULL && y < vt->rows)
+        memcpy(lines[i][y], vt->lines[i][y],
+               (cols < vt->cols ? cols : vt->cols) * sizeof(vt_cell_t));
+    }
+  }
+
+  /* grid[1] and lines[1] share the allocations of index 0 */
+  /* ''''''''''''''''''''''''''''''''''''''''''''''''''''' */
+  free(vt->grid[0]);
+  free(vt->lines[0]);
+  free(vt->dirty);
+
+  vt->grid[0]  = grid[0];
+  vt->grid[1]  = grid[1];
+  vt->lines[0] = lines[0];
+  vt->lines[1] = lines[1];
+  vt->line     = lines[vt->alt];
+  vt->dirty    = dirty;
+  vt->cols     = cols;
+  vt->rows     = rows;
+  vt->nb_dirty = 0;
+
+  for (y = 0; y < rows; y++)
+    DIRTY(vt, y);
+
+  vt->top    = 0;
+  vt->bottom = rows - 1;
+
+  if (vt->x >= cols)
+    vt->x = cols - 1;
+  if (vt->y >= rows)
+    vt->y = rows - 1;
+  vt->wrap_pending = 0;
+
+  return 0;
+}
+
+/* ================================================================ */
+/* Called before the cell (x, y) is overwritten: blanks the other   */
+/* half of the double width char it may belong to.                  */
+/* ================================================================ */
+static void
+vt_fix_wide(vt_t * vt, unsigned y, unsigned x)
+{
+  vt_cell_t * row = vt->line[y];
+
+  if ((row[x].c & VT_WIDE_CONT) && x > 0)
+    vt_clear_cells(vt, &row[x - 1], 1);
+  else if ((row[x].c & VT_WIDE) && x + 1 < vt->cols)
+    vt_clear_cells(vt, &row[x + 1], 1);
+}
+
+/* ================================================================ */
+/* Scrolls the lines top to bottom up by n lines, blank lines are   */
+/* inserted at the bottom.                                          */
+/* ================================================================ */
+static void
+vt_scroll_up(vt_t * vt, unsigned top, unsigned bottom, unsigned n)
+{
+  vt_cell_t * tmp[64];
+  unsigned    y, height = bottom - top + 1;
+
+  if (n > height)
+    n = height;
+
+  /* Rotate the line pointers by chunks of at most 64 lines */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  while (n > 0)
+  {
+    unsigned k = n > 64 ? 64 : n;
+
+    memcpy(tmp, &vt->line[top], k * sizeof(vt_cell_t *));
+    memmove(&vt->line[top], &vt->line[top + k],
+            (height - k) * sizeof(vt_cell_t *));
+    memcpy(&vt->line[bottom - k + 1], tmp, k * sizeof(vt_cell_t *));
+
+    for (y = bottom - k + 1; y <= bottom; y++)
+      vt_clear_cells(vt, vt->line[y], vt->cols);
+
+    n -= k;
+  }
+
+  for (y = top; y <= bottom; y++)
+    DIRTY(vt, y);
+}
+
+/* ================================================================ */
+/* Scrolls the lines top to bottom down by n lines, blank lines are */
+/* inserted at the top.                                             */
+/* ================================================================ */
+static void
+vt_scroll_down(vt_t * vt, unsigned top, unsigned bottom, unsigned n)
+{
+  vt_cell_t * tmp[64];
+  unsigned    y, height = bottom - top + 1;
+
+  if (n > height)
+    n = height;
+
+  while (n > 0)
+  {
+    unsigned k = n > 64 ? 64 : n;
+
+    memcpy(tmp, &vt->line[bottom - k + 1], k * sizeof(vt_cell_t *));
+    memmove(&vt->line[top + k], &vt->line[top],
+            (height - k) * sizeof(vt_cell_t *));
+    memcpy(&vt->line[top], tmp, k * sizeof(vt_cell_t *));
+
+    for (y = top; y < top + k; y++)
+      vt_clear_cells(vt, vt->line[y], vt->cols);
+
+    n -= k;
+  }
+
+  for (y = top; y <= bottom; y++)
+    DIRTY(vt, y);
+}
+
+/* ================================================================ */
+/* Moves the cursor down, scrolls if it is on the bottom margin.    */
+/* ================================================================ */
+static void
+vt_linefeed(vt_t * vt)
+{
+  if (vt->y == vt->bottom)
+    vt_scroll_up(vt, vt->top, vt->bottom, 1);
+  else if (vt->y < vt->rows - 1)
+    vt->y++;
+}
+
+/* ================================================================ */
+/* Writes the code point cp at the cursor position.                 */
+/* ================================================================ */
+static void
+vt_put(vt_t * vt, uint32_t cp)
+{
+  int         w = vt_wcwidth(cp);
+  vt_cell_t * cell;
+
+  /* Combining chars are ignored */
+  /* """"""""""""""""""""""""""" */
+  if (w == 0)
+    return;
+
+  if (vt->wrap_pending && vt->autowrap)
+  {
+    vt->x = 0;
+    vt_linefeed(vt);
+  }
+  vt->wrap_pending = 0;
+
+  /* A double width char does not fit in the last column */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (w == 2 && vt->x == vt->cols - 1)
+  {
+    if (!vt->autowrap || vt->cols < 2)
+      return;
+
+    vt_fix_wide(vt, vt->y, vt->x);
+    vt_clear_cells(vt, &vt->line[vt->y][vt->x], 1);
+    DIRTY(vt, vt->y);
+    vt->x = 0;
+    vt_linefeed(vt);
+  }
+
+  vt_fix_wide(vt, vt->y, vt->x);
+
+  cell     = &vt->line[vt->y][vt->x];
+  cell->c  = cp | vt->attr | (w == 2 ? VT_WIDE : 0);
+  cell->fg = vt->fg;
+  cell->bg = vt->bg;
+
+  if (w == 2)
+  {
+    vt_fix_wide(vt, vt->y, vt->x + 1);
+    cell[1].c  = VT_WIDE_CONT | vt->attr;
+    cell[1].fg = vt->fg;
+    cell[1].bg = vt->bg;
+  }
+
+  DIRTY(vt, vt->y);
+
+  vt->last_cp = cp;
+  vt->x += w;
+  if (vt->x >= vt->cols)
+  {
+    vt->x            = vt->cols - 1;
+    vt->wrap_pending = 1;
+  }
+}
+
+/* ================================================================ */
+/* Fast path for a run of n printable ASCII chars.                  */
+/* ================================================================ */
+static void
+vt_put_ascii(vt_t * vt, const unsigned char * p, size_t n)
+{
+  vt_cell_t * row;
+  unsigned    i, k;
+
+  if (!vt->autowrap)
+  {
+    while (n-- > 0)
+      vt_put(vt, *p++);
+    return;
+  }
+
+  while (n > 0)
+  {
+    if (vt->wrap_pending)
+    {
+      vt->x = 0;
+      vt_linefeed(vt);
+      vt->wrap_pending = 0;
+    }
+
+    k = vt->cols - vt->x;
+    if (k > n)
+      k = n;
+
+    row = vt->line[vt->y];
+    vt_fix_wide(vt, vt->y, vt->x);
+    vt_fix_wide(vt, vt->y, vt->x + k - 1);
+
+    for (i = 0; i < k; i++)
+    {
+      row[vt->x + i].c  = p[i] | vt->attr;
+      row[vt->x + i].fg = vt->fg;
+      row[vt->x + i].bg = vt->bg;
+    }
+
+    DIRTY(vt, vt->y);
+
+    vt->last_cp = p[k - 1];
+    vt->x += k;
+    if (vt->x >= vt->cols)
+    {
+      vt->x            = vt->cols - 1;
+      vt->wrap_pending = 1;
+    }
+
+    p += k;
+    n -= k;
+  }
+}
+
+/* ================================================================ */
+/* Executes a C0 control char.                                      */
+/* ================================================================ */
+static void
+vt_execute(vt_t * vt, unsigned char c)
+{
+  switch (c)
+  {
+    case '\b':
+      if (vt->x > 0)
+        vt->x--;
+      break;
+
+    case '\t':
+      vt->x = (vt->x / 8 + 1) * 8;
+      if (vt->x >= vt->cols)
+        vt->x = vt->cols - 1;
+      break;
+
+    case '\n':
+    case '\v':
+    case '\f':
+      vt_linefeed(vt);
+      break;
+
+    case '\r':
+      vt->x = 0;
+      break;
+
+    default: /* BEL, SO, SI, ... */
+      return;
+  }
+
+  vt->wrap_pending = 0;
+}
+
+/* ================================================================ */
+/* Saves or restores the cursor and the pen (DECSC/DECRC).          */
+/* ================================================================ */
+static void
+vt_save_cursor(vt_t * vt, int save)
+{
+  if (save)
+  {
+    vt->saved_x    = vt->x;
+    vt->saved_y    = vt->y;
+    vt->saved_attr = vt->attr;
+    vt->saved_fg   = vt->fg;
+    vt->saved_bg   = vt->bg;
+  }
+  else
+  {
+    vt->x            = vt->saved_x < vt->cols ? vt->saved_x : vt->cols - 1;
+    vt->y            = vt->saved_y < vt->rows ? vt->saved_y : vt->rows - 1;
+    vt->attr         = vt->saved_attr;
+    vt->fg           = vt->saved_fg;
+    vt->bg           = vt->saved_bg;
+    vt->wrap_pending = 0;
+  }
+}
+
+/* ================================================================ */
+/* Switches between the primary and the alternate screens.          */
+/* ================================================================ */
+static void
+vt_switch_screen(vt_t * vt, int alt)
+{
+  unsigned y;
+
+  if (vt->alt == alt)
+    return;
+
+  vt->alt  = alt;
+  vt->line = vt->lines[alt];
+
+  for (y = 0; y < vt->rows; y++)
+  {
+    if (alt)
+      vt_clear_cells(vt, vt->line[y], vt->cols);
+    DIRTY(vt, y);
+  }
+}
+
+/* ================================================================ */
+/* Executes an escape sequence without CSI.                         */
+/* ================================================================ */
+static void
+vt_esc_dispatch(vt_t * vt, unsigned char c)
+{
+  unsigned x, y;
+
+  /* DECALN: fills the screen with E */
+  /* """"""""""""""""""""""""""""""" */
+  if (vt->inter == '#')
+  {
+    if (c == '8')
+      for (y = 0; y < vt->rows; y++)
+      {
+        for (x = 0; x < vt->cols; x++)
+        {
+          vt->line[y][x].c  = 'E';
+          vt->line[y][x].fg = vt->line[y][x].bg = 0;
+        }
+        DIRTY(vt, y);
+      }
+    return;
+  }
+
+  /* Character sets designations are ignored */
+  /* """"""""""""""""""""""""""""""""""""""" */
+  if (vt->inter != 0)
+    return;
+
+  switch (c)
+  {
+    case '7':
+      vt_save_cursor(vt, 1);
+      break;
+
+    case '8':
+      vt_save_cursor(vt, 0);
+      break;
+
+    case 'D': /* IND */
+      vt_linefeed(vt);
+      break;
+
+    case 'E': /* NEL */
+      vt->x = 0;
+      vt_linefeed(vt);
+      break;
+
+    case 'M': /* RI */
+      if (vt->y == vt->top)
+        vt_scroll_down(vt, vt->top, vt->bottom, 1);
+      else if (vt->y > 0)
+        vt->y--;
+      break;
+
+    case 'c': /* RIS */
+      vt_reset(vt);
+      break;
+
+    default:
+      return;
+  }
+
+  vt->wrap_pending = 0;
+}
+
+/* ================================================================ */
+/* Executes a CSI sequence, the parameters are in vt->params.       */
+/* ================================================================ */
+static void
+vt_csi_dispatch(vt_t * vt, unsigned char c)
+{
+  vt_cell_t * row = vt->line[vt->y];
+  unsigned    n, m, y;
+
+  /* First parameter with 1 as default value */
+  /* """"""""""""""""""""""""""""""""""""""" */
+  n = vt->nb_params > 0 && vt->params[0] > 0 ? vt->params[0] : 1;
+
+  /* Only the DEC private modes are managed among the private */
+  /* sequences.                                               */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (vt->inter != 0
+      || (vt->private != 0 && !(vt->private == '?' && (c == 'h' || c == 'l'))))
+    return;
+
+  switch (c)
+  {
+    case '@': /* ICH */
+      if (n > vt->cols - vt->x)
+        n = vt->cols - vt->x;
+      vt_fix_wide(vt, vt->y, vt->x);
+      memmove(&row[vt->x + n], &row[vt->x],
+              (vt->cols - vt->x - n) * sizeof(vt_cell_t));
+      vt_clear_cells(vt, &row[vt->x], n);
+      if (row[vt->cols - 1].c & VT_WIDE)
+        vt_clear_cells(vt, &row[vt->cols - 1], 1);
+      DIRTY(vt, vt->y);
+      break;
+
+    case 'A': /* CUU */
+      m     = vt->y >= vt->top ? vt->top : 0;
+      vt->y = vt->y - m > n ? vt->y - n : m;
+      break;
+
+    case 'B': /* CUD */
+    case 'e': /* VPR */
+      m     = vt->y <= vt->bottom ? vt->bottom : vt->rows - 1;
+      vt->y = m - vt->y > n ? vt->y + n : m;
+      break;
+
+    case 'C': /* CUF */
+    case 'a': /* HPR */
+      vt->x = vt->cols - 1 - vt->x > n ? vt->x + n : vt->cols - 1;
+      break;
+
+    case 'D': /* CUB */
+      vt->x = vt->x > n ? vt->x - n : 0;
+      break;
+
+    case 'E': /* CNL */
+      m     = vt->y <= vt->bottom ? vt->bottom : vt->rows - 1;
+      vt->y = m - vt->y > n ? vt->y + n : m;
+      vt->x = 0;
+      break;
+
+    case 'F': /* CPL */
+      m     = vt->y >= vt->top ? vt->top : 0;
+      vt->y = vt->y - m > n ? vt->y - n : m;
+      vt->x = 0;
+      break;
+
+    case 'G': /* CHA */
+    case '`': /* HPA */
+      vt->x = n <= vt->cols ? n - 1 : vt->cols - 1;
+      break;
+
+    case 'H': /* CUP */
+    case 'f': /* HVP */
+      m = vt->nb_params > 1 && vt->params[1] > 0 ? vt->params[1] : 1;
+      if (vt->origin)
+      {
+        n += vt->top;
+        vt->y = n <= vt->bottom + 1 ? n - 1 : vt->bottom;
+      }
+      else
+        vt->y = n <= vt->rows ? n - 1 : vt->rows - 1;
+      vt->x = m <= vt->cols ? m - 1 : vt->cols - 1;
+      break;
+
+    case 'd': /* VPA */
+      if (vt->origin)
+      {
+        n += vt->top;
+        vt->y = n <= vt->bottom + 1 ? n - 1 : vt->bottom;
+      }
+      else
+        vt->y = n <= vt->rows ? n - 1 : vt->rows - 1;
+      break;
+
+    case 'J': /* ED */
+      switch (vt->nb_params > 0 ? vt->params[0] : 0)
+      {
+        case 0:
+          vt_fix_wide(vt, vt->y, vt->x);
+          vt_clear_cells(vt, &row[vt->x], vt->cols - vt->x);
+          DIRTY(vt, vt->y);
+          for (y = vt->y + 1; y < vt->rows; y++)
+          {
+            vt_clear_cells(vt, vt->line[y], vt->cols);
+            DIRTY(vt, y);
+          }
+          break;
+
+        case 1:
+          for (y = 0; y < vt->y; y++)
+          {
+            vt_clear_cells(vt, vt->line[y], vt->cols);
+            DIRTY(vt, y);
+          }
+          vt_fix_wide(vt, vt->y, vt->x);
+          vt_clear_cells(vt, row, vt->x + 1);
+          DIRTY(vt, vt->y);
+          break;
+
+        case 2:
+        case 3:
+          for (y = 0; y < vt->rows; y++)
+          {
+            vt_clear_cells(vt, vt->line[y], vt->cols);
+            DIRTY(vt, y);
+          }
+          break;
+      }
+      break;
+
+    case 'K': /* EL */
+      vt_fix_wide(vt, vt->y, vt->x);
+      switch (vt->nb_params > 0 ? vt->params[0] : 0)
+      {
+        case 0:
+          vt_clear_cells(vt, &row[vt->x], vt->cols - vt->x);
+          break;
+
+        case 1:
+          vt_clear_cells(vt, row, vt->x + 1);
+          break;
+
+        case 2:
+          vt_clear_cells(vt, row, vt->cols);
+          break;
+      }
+      DIRTY(vt, vt->y);
+      break;
+
+    case 'L': /* IL */
+      if (vt->y >= vt->top && vt->y <= vt->bottom)
+      {
+        vt_scroll_down(vt, vt->y, vt->bottom, n);
+        vt->x = 0;
+      }
+      break;
+
+    case 'M': /* DL */
+      if (vt->y >= vt->top && vt->y <= vt->bottom)
+      {
+        vt_scroll_up(vt, vt->y, vt->bottom, n);
+        vt->x = 0;
+      }
+      break;
+
+    case 'P': /* DCH */
+      if (n > vt->cols - vt->x)
+        n = vt->cols - vt->x;
+      vt_fix_wide(vt, vt->y, vt->x);
+      vt_fix_wide(vt, vt->y, vt->x + n - 1);
+      memmove(&row[vt->x], &row[vt->x + n],
+              (vt->cols - vt->x - n) * sizeof(vt_cell_t));
+      vt_clear_cells(vt, &row[vt->cols - n], n);
+      DIRTY(vt, vt->y);
+      break;
+
+    case 'X': /* ECH */
+      if (n > vt->cols - vt->x)
+        n = vt->cols - vt->x;
+      vt_fix_wide(vt, vt->y, vt->x);
+      vt_fix_wide(vt, vt->y, vt->x + n - 1);
+      vt_clear_cells(vt, &row[vt->x], n);
+      DIRTY(vt, vt->y);
+      break;
+
+    case 'S': /* SU */
+      vt_scroll_up(vt, vt->top, vt->bottom, n);
+      break;
+
+    case 'T': /* SD, the xterm mouse tracking variant is ignored */
+      if (vt->nb_params <= 1)
+        vt_scroll_down(vt, vt->top, vt->bottom, n);
+      break;
+
+    case 'm': /* SGR, does not cancel a pending wrap */
+      vt_sgr(vt);
+      return;
+
+    case 'r': /* DECSTBM */
+      m = vt->nb_params > 1 && vt->params[1] > 0 ? vt->params[1] : vt->rows;
+      if (m > vt->rows)
+        m = vt->rows;
+      if (n < m)
+      {
+        vt->top    = n - 1;
+        vt->bottom = m - 1;
+        vt->x      = 0;
+        vt->y      = vt->origin ? vt->top : 0;
+      }
+      break;
+
+    case 's': /* SCOSC */
+      vt_save_cursor(vt, 1);
+      break;
+
+    case 'u': /* SCORC */
+      vt_save_cursor(vt, 0);
+      break;
+
+    case 'Z': /* CBT */
+      while (n-- > 0 && vt->x > 0)
+        vt->x = (vt->x - 1) / 8 * 8;
+      break;
+
+    case 'b': /* REP */
+      if (vt->last_cp != 0)
+      {
+        if (n > vt->cols * vt->rows)
+          n = vt->cols * vt->rows;
+        while (n-- > 0)
+          vt_put(vt, vt->last_cp);
+      }
+      return;
+
+    case 'h': /* SM */
+    case 'l': /* RM */
+      if (vt->private == '?')
+        vt_set_mode(vt, c == 'h');
+      return;
+
+    default:
+      return;
+  }
+
+  vt->wrap_pending = 0;
+}
+
+/* ================================================================ */
+/* Parses the extended color starting at vt->params[*i] (38 and 48  */
+/* SGR attributes) and returns it. *i is moved to its last element. */
+/* ================================================================ */
+static uint32_t
+vt_sgr_color(vt_t * vt, int * i)
+{
+  unsigned * p = vt->params;
+  int        n = vt->nb_params;
+
+  if (*i + 2 < n && p[*i + 1] == 5)
+  {
+    *i += 2;
+    return VT_COLOR_IDX | (p[*i] & 0xff);
+  }
+
+  if (*i + 4 < n && p[*i + 1] == 2)
+  {
+    *i += 4;
+    return VT_COLOR_RGB | (p[*i - 2] & 0xff) << 16 | (p[*i - 1] & 0xff) << 8
+           | (p[*i] & 0xff);
+  }
+
+  *i = n;
+  return 0;
+}
+
+/* ================================================================ */
+/* Sets the attributes and colors of the pen (SGR).                 */
+/* ================================================================ */
+static void
+vt_sgr(vt_t * vt)
+{
+  int      i;
+  unsigned p;
+
+  if (vt->nb_params == 0)
+    vt->params[vt->nb_params++] = 0;
+
+  for (i = 0; i < vt->nb_params; i++)
+  {
+    p = vt->params[i];
+
+    switch (p)
+    {
+      case 0:
+        vt->attr = vt->fg = vt->bg = 0;
+        break;
+
+      case 1:
+        vt->attr |= VT_BOLD;
+        break;
+
+      case 2:
+        vt->attr |= VT_DIM;
+        break;
+
+      case 3:
+        vt->attr |= VT_ITALIC;
+        break;
+
+      case 4:
+        vt->attr |= VT_UNDERLINE;
+        break;
+
+      case 5:
+      case 6:
+        vt->attr |= VT_BLINK;
+        break;
+
+      case 7:
+        vt->attr |= VT_REVERSE;
+        break;
+
+      case 8:
+        vt->attr |= VT_HIDDEN;
+        break;
+
+      case 9:
+        vt->attr |= VT_STRIKE;
+        break;
+
+      case 21:
+      case 22:
+        vt->attr &= ~(VT_BOLD | VT_DIM);
+        break;
+
+      case 23:
+        vt->attr &= ~VT_ITALIC;
+        break;
+
+      case 24:
+        vt->attr &= ~VT_UNDERLINE;
+        break;
+
+      case 25:
+        vt->attr &= ~VT_BLINK;
+        break;
+
+      case 27:
+        vt->attr &= ~VT_REVERSE;
+        break;
+
+      case 28:
+        vt->attr &= ~VT_HIDDEN;
+        break;
+
+      case 29:
+        vt->attr &= ~VT_STRIKE;
+        break;
+
+      case 38:
+        vt->fg = vt_sgr_color(vt, &i);
+        break;
+
+      case 39:
+        vt->fg = 0;
+        break;
+
+      case 48:
+        vt->bg = vt_sgr_color(vt, &i);
+        break;
+
+      case 49:
+        vt->bg = 0;
+        break;
+
+      default:
+        if (p >= 30 && p <= 37)
+          vt->fg = VT_COLOR_IDX | (p - 30);
+        else if (p >= 40 && p <= 47)
+          vt->bg = VT_COLOR_IDX | (p - 40);
+        else if (p >= 90 && p <= 97)
+          vt->fg = VT_COLOR_IDX | (p - 90 + 8);
+        else if (p >= 100 && p <= 107)
+          vt->bg = VT_COLOR_IDX | (p - 100 + 8);
+        break;
+    }
+  }
+}
+
+/* ================================================================ */
+/* Sets or resets the DEC private modes in vt->params (DECSET and   */
+/* DECRST).                                                         */
+/* ================================================================ */
+static void
+vt_set_mode(vt_t * vt, int set)
+{
+  int i;
+
+  for (i = 0; i < vt->nb_params; i++)
+  {
+    switch (vt->params[i])
+    {
+      case 6: /* DECOM */
+        vt->origin = set;
+        vt->x      = 0;
+        vt->y      = set ? vt->top : 0;
+        break;
+
+      case 7: /* DECAWM */
+        vt->autowrap = set;
+        break;
+
+      case 25: /* DECTCEM */
+        vt->cursor_on = set;
+        break;
+
+      case 47:
+      case 1047:
+        vt_switch_screen(vt, set);
+        break;
+
+      case 1049:
+        if (set)
+        {
+          vt_save_cursor(vt, 1);
+          vt_switch_screen(vt, 1);
+        }
+        else
+        {
+          vt_switch_screen(vt, 0);
+          vt_save_cursor(vt, 0);
+        }
+        break;
+    }
+  }
+
+  vt->wrap_pending = 0;
+}
+
+/* ================================================================ */
+/* Puts the screen in its initial state (RIS).                      */
+/* ================================================================ */
+static void
+vt_reset(vt_t * vt)
+{
+  unsigned y;
+
+  vt->attr = vt->fg = vt->bg = 0;
+  vt->x = vt->y = 0;
+  vt->saved_x = vt->saved_y = 0;
+  vt->saved_attr = vt->saved_fg = vt->saved_bg = 0;
+  vt->wrap_pending                             = 0;
+  vt->last_cp                                  = 0;
+  vt->top                                      = 0;
+  vt->bottom                                   = vt->rows - 1;
+  vt->autowrap                                 = 1;
+  vt->origin                                   = 0;
+  vt->cursor_on                                = 1;
+  vt->alt                                      = 0;
+  vt->line                                     = vt->lines[0];
+  vt->state                                    = S_GROUND;
+  vt->need                                     = 0;
+
+  for (y = 0; y < vt->rows; y++)
+  {
+    vt_clear_cells(vt, vt->lines[0][y], vt->cols);
+    vt_clear_cells(vt, vt->lines[1][y], vt->cols);
+    DIRTY(vt, y);
+  }
+}
+
+/* ================================================================ */
+/* Feeds the screen with len bytes of output of the child.          */
+/* Printable ASCII runs are written directly, the rest goes through */
+/* the transition table.                                            */
+/* ================================================================ */
+void
+vt_feed(vt_t * vt, const unsigned char * buf, size_t len)
+{
+  const unsigned char * p   = buf;
+  const unsigned char * end = buf + len;
+  unsigned char         c, t;
+
+  while (p < end)
+  {
+    c = *p;
+
+    if (vt->state == S_GROUND)
+    {
+      /* Pending UTF-8 sequence */
+      /* '''''''''''''''''''''' */
+      if (vt->need > 0)
+      {
+        if ((c & 0xc0) == 0x80)
+        {
+          vt->cp = vt->cp << 6 | (c & 0x3f);
+          p++;
+          if (--vt->need == 0)
+            vt_put(vt, vt->cp <= 0x10ffff ? vt->cp : 0xfffd);
+          continue;
+        }
+
+        /* Truncated sequence, c is processed normally */
+        /* ''''''''''''''''''''''''''''''''''''''''''' */
+        vt->need = 0;
+        vt_put(vt, 0xfffd);
+      }
+
+      /* Run of printable ASCII chars */
+      /* '''''''''''''''''''''''''''' */
+      if (c >= 0x20 && c < 0x7f)
+      {
+        const unsigned char * q = p + 1;
+
+        while (q < end && *q >= 0x20 && *q < 0x7f)
+          q++;
+
+        vt_put_ascii(vt, p, q - p);
+        p = q;
+        continue;
+      }
+
+      /* Start of an UTF-8 sequence */
+      /* '''''''''''''''''''''''''' */
+      if (c >= 0x80)
+      {
+        p++;
+        if (c >= 0xc2 && c <= 0xdf)
+        {
+          vt->cp   = c & 0x1f;
+          vt->need = 1;
+        }
+        else if (c >= 0xe0 && c <= 0xef)
+        {
+          vt->cp   = c & 0x0f;
+          vt->need = 2;
+        }
+        else if (c >= 0xf0 && c <= 0xf4)
+        {
+          vt->cp   = c & 0x07;
+          vt->need = 3;
+        }
+        else
+          vt_put(vt, 0xfffd);
+        continue;
+      }
+    }
+
+    p++;
+    t         = vt_table[vt->state][c];
+    vt->state = t & 0x0f;
+
+    switch (t >> 4)
+    {
+      case A_EXECUTE:
+        vt_execute(vt, c);
+        break;
+
+      case A_CLEAR:
+        vt->nb_params = 0;
+        vt->private   = 0;
+        vt->inter     = 0;
+        break;
+
+      case A_COLLECT:
+        if (c >= 0x3c && c <= 0x3f)
+          vt->private = c;
+        else
+          vt->inter = c;
+        break;
+
+      case A_PARAM:
+        if (vt->nb_params == 0)
+          vt->params[vt->nb_params++] = 0;
+
+        if (c == ';' || c == ':')
+        {
+          if (vt->nb_params < VT_MAX_PARAMS)
+            vt->params[vt->nb_params++] = 0;
+        }
+        else if (vt->params[vt->nb_params - 1] < 10000)
+          vt->params[vt->nb_params - 1] =
+            vt->params[vt->nb_params - 1] * 10 + c - '0';
+        break;
+
+      case A_ESC_DISPATCH:
+        vt_esc_dispatch(vt, c);
+        break;
+
+      case A_CSI_DISPATCH:
+        vt_csi_dispatch(vt, c);
+        break;
+    }
+  }
+}
+
+/* ================================================================ */
+/* Returns the number of lines damaged since the last dump.         */
+/* ================================================================ */
+int
+vt_damaged(vt_t * vt)
+{
+  return vt->nb_dirty;
+}
+
+/* ================================================================ */
+/* Writes the string str with the JSON escapes.                     */
+/* ================================================================ */
+static void
+vt_json_string(FILE * out, const char * str)
+{
+  const unsigned char * p;
+
+  fputc('"', out);
+  for (p = (const unsigned char *)str; *p; p++)
+  {
+    if (*p == '"' || *p == '\\')
+      fprintf(out, "\\%c", *p);
+    else if (*p < 0x20)
+      fprintf(out, "\\u%04x", *p);
+    else
+      fputc(*p, out);
+  }
+  fputc('"', out);
+}
+
+/* ================================================================ */
+/* Writes the line y UTF-8 encoded and without its trailing blanks. */
+/* ================================================================ */
+static void
+vt_dump_line(vt_t * vt, FILE * out, unsigned y, int json)
+{
+  vt_cell_t *   row = vt->line[y];
+  unsigned      x, len;
+  uint32_t      cp;
+  unsigned char u[4];
+
+  for (len = vt->cols; len > 0; len--)
+    if ((row[len - 1].c & (VT_CP_MASK | VT_WIDE_CONT)) != ' ')
+      break;
+
+  if (json)
+    fputc('"', out);
+
+  for (x = 0; x < len; x++)
+  {
+    if (row[x].c & VT_WIDE_CONT)
+      continue;
+
+    cp = row[x].c & VT_CP_MASK;
+
+    if (cp < 0x80)
+    {
+      if (json && (cp == '"' || cp == '\\'))
+        fprintf(out, "\\%c", (int)cp);
+      else if (cp < 0x20)
+        fputc(' ', out);
+      else
+        fputc(cp, out);
+    }
+    else if (cp < 0x800)
+    {
+      u[0] = 0xc0 | cp >> 6;
+      u[1] = 0x80 | (cp & 0x3f);
+      fwrite(u, 1, 2, out);
+    }
+    else if (cp < 0x10000)
+    {
+      u[0] = 0xe0 | cp >> 12;
+      u[1] = 0x80 | (cp >> 6 & 0x3f);
+      u[2] = 0x80 | (cp & 0x3f);
+      fwrite(u, 1, 3, out);
+    }
+    else
+    {
+      u[0] = 0xf0 | cp >> 18;
+      u[1] = 0x80 | (cp >> 12 & 0x3f);
+      u[2] = 0x80 | (cp >> 6 & 0x3f);
+      u[3] = 0x80 | (cp & 0x3f);
+      fwrite(u, 1, 4, out);
+    }
+  }
+
+  if (json)
+    fputc('"', out);
+}
+
+/* ================================================================ */
+/* Writes a snapshot of the screen in out, as text or as a JSON     */
+/* line. t is the time of the snapshot in ms and marker the name of */
+/* the last script marker or NULL.                                  */
+/* The list of damaged lines is reset.                              */
+/* ================================================================ */
+void
+vt_dump(vt_t * vt, FILE * out, int json, long t, const char * marker)
+{
+  unsigned y;
+  int      first;
+
+  if (json)
+  {
+    fprintf(out, "{\"t\":%ld,\"marker\":", t);
+    if (marker != NULL)
+      vt_json_string(out, marker);
+    else
+      fputs("null", out);
+    fprintf(out,
+            ",\"cols\":%u,\"rows\":%u,\"cursor\":[%u,%u],"
+            "\"cursor_visible\":%s,\"alt\":%s,\"damaged\":[",
+            vt->cols, vt->rows, vt->x, vt->y,
+            vt->cursor_on ? "true" : "false", vt->alt ? "true" : "false");
+
+    for (y = 0, first = 1; y < vt->rows; y++)
+      if (vt->dirty[y / 32] & (1U << (y % 32)))
+      {
+        fprintf(out, first ? "%u" : ",%u", y);
+        first = 0;
+      }
+
+    fputs("],\"lines\":[", out);
+    for (y = 0; y < vt->rows; y++)
+    {
+      if (y > 0)
+        fputc(',', out);
+      vt_dump_line(vt, out, y, 1);
+    }
+    fputs("]}\n", out);
+  }
+  else
+  {
+    fprintf(out, "=== %s%st=%ldms %ux%u cursor=%u,%u\n",
+            marker != NULL ? marker : "", marker != NULL ? " " : "", t,
+            vt->cols, vt->rows, vt->x, vt->y);
+    for (y = 0; y < vt->rows; y++)
+    {
+      vt_dump_line(vt, out, y, 0);
+      fputc('\n', out);
+    }
+  }
+
+  memset(vt->dirty, 0, (vt->rows + 31) / 32 * sizeof(unsigned));
+  vt->nb_dirty = 0;
+}
+
+/* ================================================================ */
+/* Returns the first C0 control or DEL byte in [p, end), end if     */
+/* none. With SSE2, 16 bytes are tested at once.                    */
+/* ================================================================ */
+static const unsigned char *
+vt_text_end(const unsigned char * p, const unsigned char * end)
+{
+#ifdef __SSE2__
+  const __m128i c0  = _mm_set1_epi8(0x1f);
+  const __m128i del = _mm_set1_epi8(0x7f);
+  const __m128i nul = _mm_setzero_si128();
+  __m128i       v;
+  int           mask;
+
+  while (end - p >= 16)
+  {
+    /* Saturated subtraction: the bytes <= 0x1f become 0 */
+    /* ''''''''''''''''''''''''''''''''''''''''''''''''' */
+    v    = _mm_loadu_si128((const __m128i *)p);
+    mask = _mm_movemask_epi8(_mm_or_si128(
+      _mm_cmpeq_epi8(_mm_subs_epu8(v, c0), nul), _mm_cmpeq_epi8(v, del)));
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+
+  while (p < end && *p >= 0x20 && *p != 0x7f)
+    p++;
+
+  return p;
+}
+
+/* ================================================================ */
+/* Resets the parser of vt_strip.                                   */
+/* ================================================================ */
+void
+vt_strip_init(vt_strip_t * strip)
+{
+  pthread_once(&vt_once, vt_init_tables);
+
+  strip->state = S_GROUND;
+}
+
+/* ================================================================ */
+/* Copies to out the plain text of len bytes of output of the       */
+/* child: the escape sequences (CSI, OSC, DCS...) and the controls  */
+/* but LF and HT are removed, the sequences can span several calls. */
+/* out must have room for len bytes, the number of bytes written is */
+/* returned.                                                        */
+/* ================================================================ */
+size_t
+vt_strip(vt_strip_t * strip, const unsigned char * buf, size_t len,
+         unsigned char * out)
+{
+  const unsigned char * p   = buf;
+  const unsigned char * end = buf + len;
+  const unsigned char * q;
+  unsigned char *       o = out;
+  unsigned char         c, t;
+
+  while (p < end)
+  {
+    c = *p;
+
+    if (strip->state == S_GROUND && c >= 0x20 && c != 0x7f)
+    {
+      q = vt_text_end(p + 1, end);
+      memcpy(o, p, q - p);
+      o += q - p;
+      p = q;
+      continue;
+    }
+
+    p++;
+    t            = vt_table[strip->state][c];
+    strip->state = t & 0x0f;
+
+    if (t >> 4 == A_EXECUTE && (c == '\n' || c == '\t'))
+      *o++ = c;
+  }
+
+  return o - out;
+}
+
+/* ================================================================ */
+/* Resets the counters and the parser of a render cost.             */
+/* ================================================================ */
+void
+vt_cost_init(vt_cost_t * cost)
+{
+  pthread_once(&vt_once, vt_init_tables);
+
+  memset(cost, 0, sizeof *cost);
+}
+
+/* ================================================================ */
+/* Counts an escape sequence without CSI.                           */
+/* ================================================================ */
+static void
+vt_cost_esc(vt_cost_t * cost, unsigned char c)
+{
+  if (cost->inter != 0)
+    return;
+
+  switch (c)
+  {
+    case '8': /* DECRC */
+      cost->moves++;
+      break;
+
+    case 'D': /* IND */
+    case 'M': /* RI  */
+      cost->scrolls++;
+      break;
+
+    case 'c': /* RIS */
+      cost->clears++;
+      break;
+  }
+}
+
+/* ================================================================ */
+/* Counts a CSI sequence, the private ones only set modes.          */
+/* ================================================================ */
+static void
+vt_cost_csi(vt_cost_t * cost, unsigned char c)
+{
+  if (cost->inter != 0 || cost->private != 0)
+    return;
+
+  switch (c)
+  {
+    case 'J': /* ED */
+      if (cost->param == 2 || cost->param == 3)
+        cost->clears++;
+      else
+        cost->erases++;
+      break;
+
+    case 'K': /* EL  */
+    case 'X': /* ECH */
+      cost->erases++;
+      break;
+
+    case 'A': /* CUU */
+    case 'B': /* CUD */
+    case 'C': /* CUF */
+    case 'D': /* CUB */
+    case 'E': /* CNL */
+    case 'F': /* CPL */
+    case 'G': /* CHA */
+    case 'H': /* CUP */
+    case 'a': /* HPR */
+    case 'd': /* VPA */
+    case 'e': /* VPR */
+    case 'f': /* HVP */
+    case '`': /* HPA */
+      cost->moves++;
+      break;
+
+    case 'L': /* IL */
+    case 'M': /* DL */
+    case 'S': /* SU */
+    case 'T': /* SD */
+      cost->scrolls++;
+      break;
+
+    case 'm': /* SGR */
+      cost->sgr++;
+      break;
+  }
+}
+
+/* ================================================================ */
+/* Adds the render cost of len bytes of output of the child. Runs   */
+/* of printable bytes are counted at once, the rest goes through    */
+/* the transition table of vt_feed.                                 */
+/* ================================================================ */
+void
+vt_cost_feed(vt_cost_t * cost, const unsigned char * buf, size_t len)
+{
+  const unsigned char * p   = buf;
+  const unsigned char * end = buf + len;
+  const unsigned char * q;
+  unsigned char         c, t;
+
+  while (p < end)
+  {
+    c = *p;
+
+    if (cost->state == S_GROUND && c >= 0x20 && c != 0x7f)
+    {
+      q = vt_text_end(p + 1, end);
+      cost->text += q - p;
+      p = q;
+      continue;
+    }
+
+    p++;
+    cost->control++;
+    t           = vt_table[cost->state][c];
+    cost->state = t & 0x0f;
+
+    switch (t >> 4)
+    {
+      case A_CLEAR:
+        cost->param     = 0;
+        cost->nb_params = 0;
+        cost->private   = 0;
+        cost->inter     = 0;
+        break;
+
+      case A_COLLECT:
+        if (c >= 0x3c && c <= 0x3f)
+          cost->private = c;
+        else
+          cost->inter = c;
+        break;
+
+      case A_PARAM:
+        if (c == ';' || c == ':')
+          cost->nb_params++;
+        else if (cost->nb_params == 0 && cost->param < 10000)
+          cost->param = cost->param * 10 + c - '0';
+        break;
+
+      case A_ESC_DISPATCH:
+        vt_cost_esc(cost, c);
+        break;
+
+      case A_CSI_DISPATCH:
+        vt_cost_csi(cost, c);
+        break;
+    }
+  }
+}
@@ -0,0 +1,108 @@
+/* ################################################################### */
+/* Headless VT100/xterm screen model fed with the output of the child. */
+/* ################################################################### */
+
+#ifndef VT_H
+#define VT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct vt_s vt_t;
+
+typedef struct vt_cell_s vt_cell_t;
+
+/* The code point of a cell and its attributes are packed in vt_cell_s.c */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#define VT_CP_MASK 0x001fffffU
+#define VT_BOLD (1U << 21)
+#define VT_DIM (1U << 22)
+#define VT_ITALIC (1U << 23)
+#define VT_UNDERLINE (1U << 24)
+#define VT_BLINK (1U << 25)
+#define VT_REVERSE (1U << 26)
+#define VT_HIDDEN (1U << 27)
+#define VT_STRIKE (1U << 28)
+#define VT_ATTR_MASK 0x1fe00000U
+#define VT_WIDE (1U << 29)      /* first column of a double width char  */
+#define VT_WIDE_CONT (1U << 30) /* second column of a double width char */
+
+/* Colors: 0 is the default color, VT_COLOR_IDX | n the palette entry */
+/* n and VT_COLOR_RGB | 0xrrggbb a direct color.                       */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#define VT_COLOR_IDX 0x01000000U
+#define VT_COLOR_RGB 0x02000000U
+
+struct vt_cell_s
+{
+  uint32_t c;
+  uint32_t fg;
+  uint32_t bg;
+};
+
+typedef struct vt_strip_s vt_strip_t;
+
+/* State of vt_strip between two chunks of output */
+/* """""""""""""""""""""""""""""""""""""""""""""" */
+struct vt_strip_s
+{
+  int state; /* parser state */
+};
+
+typedef struct vt_cost_s vt_cost_t;
+
+/* Render cost of an output stream: what it asks the terminal to do, */
+/* counted by vt_cost_feed with the parser of the screen model but   */
+/* without the screen.                                               */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct vt_cost_s
+{
+  unsigned long long text;    /* printable bytes, UTF-8 included        */
+  unsigned long long control; /* bytes of the controls and sequences    */
+  unsigned long      clears;  /* full screen clears: ED 2, ED 3 and RIS */
+  unsigned long      erases;  /* partial erases: ED 0, ED 1, EL and ECH */
+  unsigned long      moves;   /* cursor positionings and DECRC          */
+  unsigned long      scrolls; /* SU, SD, IL, DL, IND and RI             */
+  unsigned long      sgr;     /* SGR (graphic rendition) sequences      */
+
+  /* Parser */
+  /* '''''' */
+  int      state;
+  unsigned param; /* first parameter of the sequence */
+  int      nb_params;
+  char     private;
+  char     inter;
+};
+
+vt_t *
+vt_new(unsigned cols, unsigned rows);
+
+void
+vt_free(vt_t * vt);
+
+int
+vt_resize(vt_t * vt, unsigned cols, unsigned rows);
+
+void
+vt_feed(vt_t * vt, const unsigned char * buf, size_t len);
+
+int
+vt_damaged(vt_t * vt);
+
+void
+vt_dump(vt_t * vt, FILE * out, int json, long t, const char * marker);
+
+void
+vt_strip_init(vt_strip_t * strip);
+
+size_t
+vt_strip(vt_strip_t * strip, const unsigned char * buf, size_t len,
+         unsigned char * out);
+
+void
+vt_cost_init(vt_cost_t * cost);
+
+void
+vt_cost_feed(vt_cost_t * cost, const unsigned char * buf, size_t len);
+
+#endif